@@ -0,0 +1,508 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+#include <stdarg.h>
+
+
+/**
+ * The number of files to analyse at a time, which
+ * together with `ANALYSE_MAX_SIZE` bounds the memory use
+ */
+#ifndef ANALYSE_BATCH
+# define ANALYSE_BATCH  256
+#endif
+
+/**
+ * The maximum size of a file, in bytes, enough for a raw
+ * dump of three gamma ramps with 65536 stops each
+ */
+#ifndef ANALYSE_MAX_SIZE
+# define ANALYSE_MAX_SIZE  (3UL << 17)
+#endif
+
+
+
+/**
+ * A file to analyse, and the result
+ */
+typedef struct analyse_job
+{
+	/**
+	 * The file
+	 */
+	const char *path;
+
+	/**
+	 * Buffer for `path` when it is read from standard input
+	 */
+	char *path_buf;
+
+	/**
+	 * The number of bytes allocated to `path_buf`
+	 */
+	size_t path_size;
+
+	/**
+	 * The contents of the file, followed by a NUL byte
+	 */
+	char *data;
+
+	/**
+	 * The number of bytes allocated to `data`
+	 */
+	size_t data_size;
+
+	/**
+	 * Buffer for regenerating a gamma ramp
+	 */
+	uint16_t *ramp;
+
+	/**
+	 * The number of stops allocated to `ramp`
+	 */
+	size_t ramp_size;
+
+	/**
+	 * The output lines for the file
+	 */
+	char *output;
+
+	/**
+	 * The number of bytes allocated to `output`
+	 */
+	size_t output_size;
+
+	/**
+	 * The number of bytes used in `output`
+	 */
+	size_t output_len;
+
+	/**
+	 * The size of the file
+	 */
+	size_t bytes;
+
+	/**
+	 * The number of analysed gamma ramps or read calibrations
+	 */
+	size_t ramps;
+
+	/**
+	 * 0 on success, otherwise the error number
+	 */
+	int error;
+
+} analyse_job_t;
+
+
+
+/**
+ * Append a formatted line to the output for a file
+ * 
+ * @param   job     The file
+ * @param   format  The format string, see printf(3)
+ * @param   ...     The arguments for `format`
+ * @return          Zero on success, -1 on error
+ */
+static int
+analyse_printf(analyse_job_t *restrict job, const char *format, ...)
+{
+	va_list args;
+	char *new;
+	size_t size;
+	int n;
+
+	for (;;) {
+		va_start(args, format);
+		n = vsnprintf(job->output ? &job->output[job->output_len] : NULL,
+		              job->output_size - job->output_len, format, args);
+		va_end(args);
+		if (n < 0)
+			return -1;
+		if ((size_t)n < job->output_size - job->output_len)
+			break;
+		size = job->output_len + (size_t)n + 1;
+		size = size < 2 * job->output_size ? 2 * job->output_size : size;
+		new = realloc(job->output, size);
+		if (!new)
+			return -1;
+		job->output = new;
+		job->output_size = size;
+	}
+	job->output_len += (size_t)n;
+	return 0;
+}
+
+
+/**
+ * Read a file into `job->data`
+ * 
+ * @param   job  The file
+ * @return       Zero on success, -1 on error
+ */
+static int
+analyse_read(analyse_job_t *restrict job)
+{
+	int fd = open(job->path, O_RDONLY);
+	struct stat st;
+	size_t size;
+	ssize_t r;
+	char *new;
+	int old_errno;
+
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0)
+		goto fail;
+	if (st.st_size < 0 || (uintmax_t)st.st_size > ANALYSE_MAX_SIZE) {
+		errno = EFBIG;
+		goto fail;
+	}
+	size = (size_t)st.st_size;
+	if (job->data_size < size + 1) {
+		new = realloc(job->data, size + 1);
+		if (!new)
+			goto fail;
+		job->data = new;
+		job->data_size = size + 1;
+	}
+
+	/* The file may have shrunk or grown since `fstat`. */
+	for (job->bytes = 0; job->bytes < size; job->bytes += (size_t)r) {
+		r = read(fd, &job->data[job->bytes], size - job->bytes);
+		if (r < 0 && errno == EINTR)
+			r = 0;
+		else if (r < 0)
+			goto fail;
+		else if (!r)
+			break;
+	}
+	job->data[job->bytes] = '\0';
+	close(fd);
+	return 0;
+fail:
+	old_errno = errno;
+	close(fd);
+	errno = old_errno;
+	return -1;
+}
+
+
+/**
+ * Analyse a raw dump of the red, green and blue gamma ramps of
+ * a CRT controller, in that order and in host byte order, like
+ * they are returned by `drm_get_gamma`
+ * 
+ * @param   job  The file, read into `job->data`
+ * @return       Zero on success, -1 on error
+ */
+static int
+analyse_raw(analyse_job_t *restrict job)
+{
+	const uint16_t *restrict ramp = (const void *)job->data;
+	size_t i, ch, stops = job->bytes / (3 * sizeof(*ramp));
+	double gamma[3], contrast[3], brightness[3], residual[3];
+	unsigned int error[3], e;
+	gamma_pipeline_t pipeline;
+	float curve[GAMMA_CURVE_STOPS + 1];
+	uint16_t *new;
+
+	if (!stops || job->bytes % (3 * sizeof(*ramp))) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (job->ramp_size < stops) {
+		new = realloc(job->ramp, stops * sizeof(*new));
+		if (!new)
+			return -1;
+		job->ramp = new;
+		job->ramp_size = stops;
+	}
+
+	for (ch = 0; ch < 3; ch++, ramp += stops) {
+		residual[ch] = gamma_fit(stops, ramp, &gamma[ch], &contrast[ch], &brightness[ch]);
+
+		/* Regenerate the gamma ramp like it would be applied, to see how well it round-trips. */
+		gamma_pipeline_init(&pipeline, gamma[ch], contrast[ch], brightness[ch]);
+		gamma_pipeline_quantise(&pipeline, curve, stops, job->ramp, 0);
+		for (error[ch] = 0, i = 0; i < stops; i++) {
+			e = (unsigned int)abs((int)job->ramp[i] - (int)ramp[i]);
+			error[ch] = e > error[ch] ? e : error[ch];
+		}
+	}
+	job->ramps = 3;
+
+	return analyse_printf(job, "%s\t0\t-\t%zu\t%f:%f:%f\t%f:%f:%f\t%f:%f:%f\t%.3f:%.3f:%.3f\t%u:%u:%u\n",
+	                      job->path, stops, gamma[0], gamma[1], gamma[2],
+	                      contrast[0], contrast[1], contrast[2],
+	                      brightness[0], brightness[1], brightness[2],
+	                      residual[0], residual[1], residual[2],
+	                      error[0], error[1], error[2]);
+}
+
+
+/**
+ * Read the calibrations in a file saved by crt-calibrator
+ * 
+ * @param   job  The file, read into `job->data`
+ * @return       Zero on success, -1 on error; `errno` is set to
+ *               `EINVAL` if the file is malformed, including if
+ *               a CRT controller's `gamma` does not follow both
+ *               its `brightness` and its `contrast`
+ */
+static int
+analyse_text(analyse_job_t *restrict job)
+{
+	double gamma[3], contrast[3], brightness[3];
+	char *line, *end, *edid = NULL;
+	unsigned long int index = 0;
+	int have_brightness = 0, have_contrast = 0;
+
+	for (line = job->data; *line; line = end) {
+		end = strchr(line, '\n');
+		end = end ? (*end = '\0', end + 1) : strchr(line, '\0');
+
+		if (sscanf(line, "# index = %lu", &index) == 1) {
+			if (have_brightness || have_contrast)
+				goto invalid;
+			edid = NULL;
+		} else if (!strncmp(line, "edid = ", 7)) {
+			edid = &line[7];
+		} else if (!strncmp(line, "brightness = ", 13)) {
+			if (sscanf(&line[13], "%lf:%lf:%lf", &brightness[0], &brightness[1], &brightness[2]) != 3)
+				goto invalid;
+			have_brightness = 1;
+		} else if (!strncmp(line, "contrast = ", 11)) {
+			if (sscanf(&line[11], "%lf:%lf:%lf", &contrast[0], &contrast[1], &contrast[2]) != 3)
+				goto invalid;
+			have_contrast = 1;
+		} else if (!strncmp(line, "gamma = ", 8)) {
+			/* The gamma is the last setting for each CRT controller. */
+			if (!have_brightness || !have_contrast)
+				goto invalid;
+			if (sscanf(&line[8], "%lf:%lf:%lf", &gamma[0], &gamma[1], &gamma[2]) != 3)
+				goto invalid;
+			have_brightness = have_contrast = 0;
+			if (analyse_printf(job, "%s\t%lu\t%s\t-\t%f:%f:%f\t%f:%f:%f\t%f:%f:%f\t-\t-\n",
+			                   job->path, index, edid && *edid ? edid : "-",
+			                   gamma[0], gamma[1], gamma[2],
+			                   contrast[0], contrast[1], contrast[2],
+			                   brightness[0], brightness[1], brightness[2]) < 0)
+				return -1;
+			job->ramps += 3;
+		} else if (*line) {
+			goto invalid;
+		}
+	}
+	if (have_brightness || have_contrast)
+		goto invalid;
+	return 0;
+
+invalid:
+	errno = EINVAL;
+	return -1;
+}
+
+
+/**
+ * Check whether a file looks like it was saved by crt-calibrator
+ * 
+ * @param   job  The file, read into `job->data`
+ * @return       1 if the file looks like saved calibrations, 0 otherwise
+ */
+static int
+analyse_is_text(const analyse_job_t *restrict job)
+{
+	return job->bytes >= 10 && !strncmp(job->data, "# index = ", 10) && !memchr(job->data, '\0', job->bytes);
+}
+
+
+/**
+ * Analyse a file, used as `pool_func_t`
+ * 
+ * @param  i     The index of the file
+ * @param  data  The files, `analyse_job_t *`
+ */
+static void
+analyse_file(size_t i, void *data)
+{
+	analyse_job_t *restrict job = &((analyse_job_t *)data)[i];
+	size_t n;
+	int r;
+
+	job->output_len = 0;
+	job->ramps = 0;
+	job->error = 0;
+
+	r = analyse_read(job);
+	if (!r && analyse_is_text(job)) {
+		r = analyse_text(job);
+		/* A raw dump can begin like saved calibrations by chance. */
+		if (r < 0 && errno == EINVAL && !(job->bytes % (3 * sizeof(uint16_t)))) {
+			/* `analyse_text` replaced newlines with NUL, and the file had no NUL. */
+			for (n = 0; n < job->bytes; n++)
+				if (!job->data[n])
+					job->data[n] = '\n';
+			job->output_len = 0;
+			job->ramps = 0;
+			r = analyse_raw(job);
+		}
+	} else if (!r) {
+		r = analyse_raw(job);
+	}
+	if (r < 0)
+		job->error = errno;
+}
+
+
+/**
+ * Get the next file to analyse
+ * 
+ * @param   job   Output parameter for the file
+ * @param   argv  The files from the command line, `NULL` to read them,
+ *                one per line, from standard input; advanced past
+ *                the returned file
+ * @return        1 if a file was returned, 0 if there are
+ *                no more files, -1 on error
+ */
+static int
+analyse_next(analyse_job_t *restrict job, char ***argv)
+{
+	ssize_t len;
+
+	if (*argv) {
+		if (!**argv)
+			return 0;
+		job->path = *(*argv)++;
+		return 1;
+	}
+
+	do {
+		len = getline(&job->path_buf, &job->path_size, stdin);
+		if (len < 0)
+			return ferror(stdin) ? -1 : 0;
+		if (len && job->path_buf[len - 1] == '\n')
+			job->path_buf[--len] = '\0';
+	} while (!len);
+	job->path = job->path_buf;
+	return 1;
+}
+
+
+/**
+ * Analyse saved gamma ramps and calibrations without a display
+ * 
+ * Each file is either a raw dump of the red, green and blue gamma
+ * ramps of a CRT controller, as 16-bit unsigned integers in host
+ * byte order, or, if it starts with `# index = ` and contains no
+ * NUL bytes, calibrations saved by crt-calibrator; if it cannot
+ * be read as calibrations but its size is a multiple of 6 bytes,
+ * it is a raw dump after all. The gamma ramps are analysed with
+ * `gamma_fit`, saved calibrations are only read.
+ * 
+ * The files are analysed in batches, in parallel, and the results
+ * are printed to stdout as tab-separated values, in the order the
+ * files were given, one line per CRT controller: the file, the
+ * index of the CRT controller in the file, its EDID, the number of
+ * stops, and its gamma, contrast, brightness, the residual of the
+ * fit, and the greatest difference between the gamma ramp and the
+ * gamma ramp regenerated from the analysis, each for red, green
+ * and blue, separated by colons. `-`
+ * is printed for values that are not available for the file.
+ * Throughput statistics are printed to stderr when done.
+ * 
+ * @param   argc  The number of elements in `argv`
+ * @param   argv  Command line arguments, the files to analyse;
+ *                if none, they are read from stdin, one per line
+ * @return        0 on success, 1 on error or if any file
+ *                could not be analysed, 2 on usage error
+ */
+int
+main(int argc, char *argv[])
+{
+	const char *threads = getenv("CRT_CALIBRATOR_THREADS");
+	const char *argv0 = *argv;
+	char **files = NULL;
+	analyse_job_t *restrict jobs;
+	size_t i, n, file_count = 0, failures = 0, ramps = 0, bytes = 0;
+	unsigned long long int start, elapsed;
+	double seconds;
+	int r = 1, rc = 0;
+	long t;
+
+	if (argc > 1 && argv[1][0] == '-') {
+		if (argv[1][1] == '-' && !argv[1][2]) {
+			argv++;
+			argc--;
+		} else {
+			fprintf(stderr, "usage: %s [file] ...\n", argv0);
+			return 2;
+		}
+	}
+	if (argc > 1)
+		files = &argv[1];
+
+	jobs = calloc(ANALYSE_BATCH, sizeof(*jobs));
+	if (!jobs)
+		goto fail;
+
+	t = (threads && *threads) ? strtol(threads, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+	pool_init(t > 0 ? (size_t)t : 1);
+
+	printf("file\tindex\tedid\tstops\tgamma\tcontrast\tbrightness\tresidual\troundtrip\n");
+	start = clock_ns();
+
+	while (r > 0) {
+		for (n = 0; n < ANALYSE_BATCH; n++) {
+			r = analyse_next(&jobs[n], &files);
+			if (r <= 0)
+				break;
+		}
+		if (r < 0)
+			goto fail;
+
+		pool_run(n, analyse_file, jobs);
+
+		for (i = 0; i < n; i++) {
+			if (jobs[i].error) {
+				fprintf(stderr, "%s: %s: %s\n", argv0, jobs[i].path, strerror(jobs[i].error));
+				failures++;
+				continue;
+			}
+			fwrite(jobs[i].output, 1, jobs[i].output_len, stdout);
+			ramps += jobs[i].ramps;
+			bytes += jobs[i].bytes;
+		}
+		file_count += n;
+		if (ferror(stdout))
+			goto fail;
+	}
+	if (fflush(stdout))
+		goto fail;
+
+	elapsed = clock_ns() - start;
+	seconds = (double)(elapsed ? elapsed : 1) / 1000000000.;
+	fprintf(stderr, "%zu files (%zu failed), %zu gamma ramps, %zu bytes in %llu ns, "
+	        "%.0f files/s, %.0f gamma ramps/s, %.3f MB/s\n",
+	        file_count, failures, ramps, bytes, elapsed,
+	        (double)file_count / seconds, (double)ramps / seconds, (double)bytes / seconds / 1000000.);
+	rc = !!failures;
+
+out:
+	pool_destroy();
+	if (jobs) {
+		for (i = 0; i < ANALYSE_BATCH; i++) {
+			free(jobs[i].path_buf);
+			free(jobs[i].data);
+			free(jobs[i].ramp);
+			free(jobs[i].output);
+		}
+		free(jobs);
+	}
+	return rc;
+
+fail:
+	perror(argv0);
+	rc = 1;
+	goto out;
+}
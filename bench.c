@@ -0,0 +1,361 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+/**
+ * The default number of timed runs of each pattern
+ */
+#ifndef BENCH_RUNS
+# define BENCH_RUNS  10
+#endif
+
+
+/**
+ * The moiré gaps to benchmark are 1 to this value
+ */
+#ifndef BENCH_MAX_GAP
+# define BENCH_MAX_GAP  32
+#endif
+
+
+
+/**
+ * The display resolutions to benchmark
+ */
+static const uint32_t geometries[][2] = {
+	{1920, 1080},
+	{2560, 1440},
+	{3840, 2160},
+	{7680, 4320}
+};
+
+/**
+ * The display resolutions to hash, smaller than `geometries`
+ * so that all patterns can be checked in a few seconds, and
+ * including a width that is not a multiple of any tile size
+ */
+static const uint32_t hash_geometries[][2] = {
+	{1366,  768},
+	{1920, 1080},
+	{2560, 1440},
+	{3840, 2160}
+};
+
+/**
+ * The pixel formats to benchmark, as named by `CRT_CALIBRATOR_FB`
+ */
+static const char *const formats[] = {
+	"rgb565",
+	"rgb888",
+	"xrgb8888"
+};
+
+/**
+ * The number of timed runs of each pattern
+ */
+static size_t runs = BENCH_RUNS;
+
+/**
+ * Directory to dump the last frame of each pattern to, `NULL` if none
+ */
+static const char *dump_dir = NULL;
+
+/**
+ * Whether to print a hash of each pattern instead of timing it
+ */
+static int hash_mode = 0;
+
+/**
+ * The contents of the file with the expected hashes, each line
+ * preceded by a newline, `NULL` unless comparing hashes
+ */
+static char *golden = NULL;
+
+/**
+ * The number of patterns whose hash was not the expected hash
+ */
+static size_t mismatches = 0;
+
+/**
+ * The duration of each run, in nanoseconds
+ */
+static unsigned long long int *times;
+
+
+
+/**
+ * Compare two durations, for `qsort`
+ * 
+ * @param   a  One of the durations
+ * @param   b  The other duration
+ * @return     Negative if `a` is less than `b`, positive if
+ *             `a` is greater than `b`, zero otherwise
+ */
+static int
+cmp_time(const void *a, const void *b)
+{
+	unsigned long long int x = *(const unsigned long long int *)a;
+	unsigned long long int y = *(const unsigned long long int *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+/**
+ * Load the file with the expected hashes into `golden`
+ * 
+ * @param   path  The file, as output in hash mode
+ * @return        Zero on success, -1 on error
+ */
+static int
+load_golden(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	size_t n = 1, size = 4096;
+	char *new;
+	int old_errno;
+
+	if (!f)
+		return -1;
+	golden = malloc(size + 1);
+	if (!golden)
+		goto fail;
+	golden[0] = '\n';
+	for (;;) {
+		n += fread(&golden[n], 1, size - n, f);
+		if (n < size)
+			break;
+		new = realloc(golden, (size *= 2) + 1);
+		if (!new)
+			goto fail;
+		golden = new;
+	}
+	if (ferror(f))
+		goto fail;
+	golden[n] = '\0';
+	fclose(f);
+	return 0;
+fail:
+	old_errno = errno;
+	fclose(f);
+	free(golden);
+	golden = NULL;
+	errno = old_errno;
+	return -1;
+}
+
+
+/**
+ * Hash the current frame and print the hash, or compare
+ * it against the expected hash
+ * 
+ * @param  pattern    The name of the pattern
+ * @param  parameter  The moiré gap, 0 for other patterns
+ * @param  diagonal   Whether the moiré pattern is diagonal
+ * @param  format     The name of the framebuffer's pixel format
+ */
+static void
+hash(const char *pattern, uint32_t parameter, int diagonal, const char *format)
+{
+	const framebuffer_t *restrict fb = &framebuffers[0];
+	char line[256];
+
+	snprintf(line, sizeof(line), "\n%s\t%"PRIu32"\t%i\t%"PRIu32"\t%"PRIu32"\t%s\t%016"PRIx64"\n",
+	         pattern, parameter, diagonal, fb->width, fb->height, format, fb_hash(fb));
+
+	if (!golden) {
+		fputs(&line[1], stdout);
+	} else if (!strstr(golden, line)) {
+		fprintf(stderr, "hash mismatch: %s", &line[1]);
+		mismatches++;
+	}
+}
+
+
+/**
+ * Draw the monitor indices, without gamma ramps as
+ * there are no CRT controllers
+ */
+static void
+draw_id_only(void)
+{
+	draw_id();
+}
+
+
+/**
+ * Benchmark a pattern on the current framebuffer and print the result
+ * 
+ * @param   pattern    The name of the pattern
+ * @param   func       Function that draws the pattern, `NULL` for the moiré pattern
+ * @param   parameter  The moiré gap, 0 for other patterns
+ * @param   diagonal   Whether the moiré pattern is diagonal
+ * @param   format     The name of the framebuffer's pixel format
+ * @return             Zero on success, -1 on error
+ */
+static int
+bench(const char *pattern, void (*func)(void), uint32_t parameter, int diagonal, const char *format)
+{
+	const framebuffer_t *restrict fb = &framebuffers[0];
+	unsigned long long int start, total = 0, mean;
+	double bytes = (double)fb->width * (double)fb->height * (double)fb->bytes_per_pixel;
+	char *path;
+	size_t i;
+
+	if (hash_mode) {
+		func ? func() : draw_moire(parameter, diagonal, NULL);
+		hash(pattern, parameter, diagonal, format);
+		goto dump;
+	}
+
+	/* Warm up the caches, the tile cache, and the threads. */
+	func ? func() : draw_moire(parameter, diagonal, NULL);
+
+	for (i = 0; i < runs; i++) {
+		start = clock_ns();
+		func ? func() : draw_moire(parameter, diagonal, NULL);
+		times[i] = clock_ns() - start;
+		total += times[i];
+	}
+	qsort(times, runs, sizeof(*times), cmp_time);
+	mean = total / runs;
+
+	printf("%s\t%"PRIu32"\t%i\t%"PRIu32"\t%"PRIu32"\t%s\t%"PRIu32"\t%zu\t%llu\t%.3f\t%llu\t%llu\t%llu\n",
+	       pattern, parameter, diagonal, fb->width, fb->height, format, fb->bytes_per_pixel * 8,
+	       runs, mean, bytes / (double)(mean ? mean : 1), times[0], times[runs / 2],
+	       times[(runs * 99 + 99) / 100 - 1]);
+
+dump:
+	if (dump_dir) {
+		path = malloc(strlen(dump_dir) + strlen(pattern) + strlen(format) + 5 * 3 * sizeof(uint32_t) + 16);
+		if (!path)
+			return -1;
+		sprintf(path, "%s/%s-%"PRIu32"%s-%"PRIu32"x%"PRIu32"-%s.ppm", dump_dir, pattern, parameter,
+		        diagonal ? "d" : "", fb->width, fb->height, format);
+		if (fb_dump_ppm(fb, path) < 0) {
+			perror(path);
+			free(path);
+			return -1;
+		}
+		free(path);
+	}
+	return 0;
+}
+
+
+/**
+ * Benchmark the drawing of all patterns on in-memory framebuffers
+ * 
+ * Results are printed to stdout as tab-separated values, one line
+ * per pattern, resolution and pixel format; durations are in
+ * nanoseconds, and the throughput is the size of a frame divided
+ * by the mean duration
+ * 
+ * In hash mode, each pattern is drawn once and a hash of the frame
+ * is printed instead. The output can be saved and later passed
+ * to -c to check that changes to the drawing code do not change
+ * any pixel
+ * 
+ * @param   argc  The number of elements in `argv`
+ * @param   argv  Command line arguments, -n RUNS to set the number of timed runs,
+ *                -d DIR to dump the last frame of each pattern to a PPM file in DIR,
+ *                -H to print hashes instead of timings, -c FILE to compare
+ *                the hashes against the hashes in FILE
+ * @return        0 on success, 1 on error or if any hash differs, 2 on usage error
+ */
+int
+main(int argc, char *argv[])
+{
+	const char *threads = getenv("CRT_CALIBRATOR_THREADS");
+	const char *argv0 = *argv;
+	const uint32_t (*geoms)[2] = geometries;
+	size_t geom_count = sizeof(geometries) / sizeof(*geometries);
+	char spec[64];
+	size_t g, f;
+	uint32_t gap;
+	int diagonal;
+	framebuffer_t fb;
+	long n;
+
+	for (; argc > 1; argc -= 2, argv += 2) {
+		if (!strcmp(argv[1], "-H")) {
+			hash_mode = 1;
+			argc++, argv--;
+		} else if (argc == 2) {
+			break;
+		} else if (!strcmp(argv[1], "-n") && atol(argv[2]) > 0) {
+			runs = (size_t)atol(argv[2]);
+		} else if (!strcmp(argv[1], "-d")) {
+			dump_dir = argv[2];
+		} else if (!strcmp(argv[1], "-c") && !golden) {
+			hash_mode = 1;
+			if (load_golden(argv[2]) < 0) {
+				perror(argv[2]);
+				return 1;
+			}
+		} else {
+			break;
+		}
+	}
+	if (argc > 1) {
+		fprintf(stderr, "usage: %s [-n RUNS] [-d DIR] [-H] [-c FILE]\n", argv0);
+		free(golden);
+		return 2;
+	}
+
+	times = malloc(runs * sizeof(*times));
+	if (!times)
+		goto fail;
+
+	n = (threads && *threads) ? strtol(threads, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+	pool_init(n > 0 ? (size_t)n : 1);
+
+	if (hash_mode) {
+		geoms = hash_geometries;
+		geom_count = sizeof(hash_geometries) / sizeof(*hash_geometries);
+	}
+
+	if (hash_mode && !golden)
+		printf("pattern\tgap\tdiagonal\twidth\theight\tformat\thash\n");
+	else if (!hash_mode)
+		printf("pattern\tgap\tdiagonal\twidth\theight\tformat\tbpp\truns\t"
+		       "ns_per_frame\tgb_per_s\tmin_ns\tmedian_ns\tp99_ns\n");
+
+	for (g = 0; g < geom_count; g++) {
+		for (f = 0; f < sizeof(formats) / sizeof(*formats); f++) {
+			sprintf(spec, "%"PRIu32"x%"PRIu32":%s", geoms[g][0], geoms[g][1], formats[f]);
+			if (setenv("CRT_CALIBRATOR_FB", spec, 1) < 0 || fb_open(0, &fb) < 0)
+				goto fail;
+			framebuffers = &fb;
+			framebuffer_count = 1;
+
+			if (bench("contrast-brightness", draw_contrast_brightness, 0, 0, formats[f]) < 0 ||
+			    bench("id",                  draw_id_only,             0, 0, formats[f]) < 0 ||
+			    bench("gamma",               draw_gamma,               0, 0, formats[f]) < 0 ||
+			    bench("convergence",         draw_convergence,         0, 0, formats[f]) < 0)
+				goto fail;
+			for (diagonal = 0; diagonal < 2; diagonal++)
+				for (gap = 1; gap <= BENCH_MAX_GAP; gap++)
+					if (bench("moire", NULL, gap, diagonal, formats[f]) < 0)
+						goto fail;
+			fflush(stdout);
+
+			tile_clear();
+			framebuffer_count = 0;
+			framebuffers = NULL;
+			fb_close(&fb);
+		}
+	}
+
+	pool_destroy();
+	free(times);
+	free(golden);
+	if (mismatches)
+		fprintf(stderr, "%s: %zu hashes differ\n", argv0, mismatches);
+	return !!mismatches;
+fail:
+	perror(argv0);
+	pool_destroy();
+	free(times);
+	free(golden);
+	return 1;
+}
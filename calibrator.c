@@ -3,258 +3,60 @@
 
 
 /**
- * Draw bars in different shades of grey, red, green and blue
- * used for calibrating the contrast and brightness
+ * The signals that terminate the process and are caught
+ * by the parent process so that it can clean up
  */
-static void
-draw_contrast_brightness(void)
-{
-	const int CONTRAST_BRIGHTNESS_LEVELS[21] = {
-		0, 17, 27, 38, 48, 59, 70, 82, 94, 106, 119, 131,
-		144, 158, 171, 185, 198, 212, 226, 241, 255
-	};
-	size_t f;
-	uint32_t y, x, colour;
-	framebuffer_t *restrict fb;
-	int v;
-
-	for (f = 0; f < framebuffer_count; f++) {
-		fb = &framebuffers[f];
-		for (y = 0; y < 4; y++) {
-			for (x = 0; x < 21; x++) {
-				v = CONTRAST_BRIGHTNESS_LEVELS[x];
-				colour = fb_colour(v * ((y == 1) | (y == 0)),
-				                   v * ((y == 2) | (y == 0)),
-				                   v * ((y == 3) | (y == 0)));
-				fb_fill_rectangle(fb, colour, x * fb->width / 21, y * fb->height / 4,
-				                  (x + 1) * fb->width / 21 - x * fb->width / 21,
-				                  (y + 1) * fb->height / 4 - y * fb->height / 4);
-			}
-		}
-	}
-}
-
-
-/**
- * Draw a seven segment display
- *
- * @param  fb      The framebuffer to draw on
- * @param  colour  The intensity of the least intense colour to use
- * @param  x       The X component of the top left corner of the seven segment display
- * @param  y       The Y component of the top left corner of the seven segment display
- */
-static void
-draw_digit(framebuffer_t *restrict fb, int colour, uint32_t x, uint32_t y)
-{
-	uint32_t c;
-
-	c = fb_colour(colour + 0, colour + 0, colour + 0);
-	fb_fill_rectangle(fb, c, x + 20, y, 80, 20);
-
-	c = fb_colour(colour + 1, colour + 1, colour + 1);
-	fb_fill_rectangle(fb, c, x, y + 20, 20, 80);
-
-	c = fb_colour(colour + 2, colour + 2, colour + 2);
-	fb_fill_rectangle(fb, c, x + 100, y + 20, 20, 80);
-
-	c = fb_colour(colour + 3, colour + 3, colour + 3);
-	fb_fill_rectangle(fb, c, x + 20, y + 100, 80, 20);
-
-	c = fb_colour(colour + 4, colour + 4, colour + 4);
-	fb_fill_rectangle(fb, c, x, y + 120, 20, 80);
-
-	c = fb_colour(colour + 5, colour + 5, colour + 5);
-	fb_fill_rectangle(fb, c, x + 100, y + 120, 20, 80);
-
-	c = fb_colour(colour + 6, colour + 6, colour + 6);
-	fb_fill_rectangle(fb, c, x + 20, y + 200, 80, 20);
-}
-
-
-/**
- * Manipulate a CRT controllers gamma ramps to display a specific digit
- * for one of the seven segment display on only that CRT controller's
- * monitors
- * 
- * @param  crtc    The CRT controller information
- * @param  colour  The intensity of the least intense colour in the seven segment display
- * @param  value   The valud of the digit to display
- */
-static void
-gamma_digit(drm_crtc_t *restrict crtc, int colour, size_t value)
-{
-#define __  0
-	const int DIGITS[11] = { 1  | 2  | 4  | __ | 16 | 32 | 64,  /* (0) */
-	                         __ | __ | 4  | __ | __ | 32 | __,  /* (1) */
-	                         1  | __ | 4  | 8  | 16 | __ | 64,  /* (2) */
-	                         1  | __ | 4  | 8  | __ | 32 | 64,  /* (3) */
-	                         __ | 2  | 4  | 8  | __ | 32 | __,  /* (4) */
-	                         1  | 2  | __ | 8  | __ | 32 | 64,  /* (5) */
-	                         1  | 2  | __ | 8  | 16 | 32 | 64,  /* (6) */
-	                         1  | __ | 4  | __ | __ | 32 | __,  /* (7) */
-	                         1  | 2  | 4  | 8  | 16 | 32 | 64,  /* (8) */
-	                         1  | 2  | 4  | 8  | __ | 32 | 64,  /* (9) */
-	                         __ | __ | __ | __ | __ | __ | __}; /* not visible */
-#undef __
-	int i, j, digit = DIGITS[value];
-	uint16_t c;
-  
-	for (i = 0; i < 7; i++) {
-		c = (digit & (1 << i)) ? 0xFFFF : 0;
-		j = i + colour;
-		crtc->red[j] = crtc->green[j] = crtc->blue[j] = c;
-	}
-}
-
-
-/**
- * Draw an unique index on each monitor
- * 
- * @return  Zero on success, -1 on error
- */
-static int
-draw_id(void)
-{
-	size_t f, c, id = 0;
-	framebuffer_t *restrict fb;
-	drm_crtc_t *restrict crtc;
-	for (f = 0; f < framebuffer_count; f++) {
-		fb = &framebuffers[f];
-		fb_fill_rectangle(fb, fb_colour(0, 0, 0), 0, 0, fb->width, fb->height);
-		draw_digit(fb, 1, 40, 40);
-		draw_digit(fb, 8, 180, 40);
-	}
-	for (c = 0; c < crtc_count; c++) {
-		crtc = &crtcs[c];
-		if (drm_get_gamma(crtc) < 0)
-			return -1;
-		gamma_digit(crtc, 1, id < 10 ? 10 : (id / 10) % 10);
-		gamma_digit(crtc, 8,                (id /  1) % 10);
-		id++;
-		if (drm_set_gamma(crtc) < 0)
-			return -1;
-	}
-	return 0;
-}
-
+static const int fatal_signals[] = {SIGHUP, SIGINT, SIGQUIT, SIGTERM};
 
 /**
- * Draw squares used as reference when tweeking the gamma correction
+ * The fatal signal that the parent process has caught, 0 if none
  */
-static void
-draw_gamma(void)
-{
-	size_t f;
-	uint32_t x, y, background, average, high, low, xoff;
-	framebuffer_t *restrict fb;
-	int r, g, b;
-	for (f = 0; f < framebuffer_count; f++) {
-		fb = framebuffers + f;
-		for (x = 0; x < 4; x++) {
-			r = (x == 1) || (x == 0);
-			g = (x == 2) || (x == 0);
-			b = (x == 3) || (x == 0);
-			background = fb_colour(128 * r, 128 * g, 128 * b);
-			average    = fb_colour(188 * r, 188 * g, 188 * b);
-			high       = fb_colour(255 * r, 255 * g, 255 * b);
-			low        = fb_colour(0, 0, 0);
-			xoff = x * fb->width / 4;
-			fb_fill_rectangle(fb, background, xoff, 0, fb->width / 4, fb->height);
-			xoff += (fb->width / 4 - 200) / 2;
-			fb_fill_rectangle(fb, high, xoff, 40, 200, 200);
-			fb_fill_rectangle(fb, average, xoff + 50, 40, 100, 200);
-			fb_fill_rectangle(fb, average, xoff, 280, 200, 200);
-			for (y = 0; y < 200; y += 2) {
-				fb_draw_horizontal_line(fb, high, xoff + 50, 280 + y + 0, 100);
-				fb_draw_horizontal_line(fb, low , xoff + 50, 280 + y + 1, 100);
-			}
-			fb_fill_rectangle(fb, average, xoff, 520, 200, 200);
-			fb_fill_rectangle(fb, high, xoff + 50, 520, 100, 200);
-		}
-	}
-}
-
+static volatile sig_atomic_t caught_signal = 0;
 
-/**
- * Print a pattern on the screen that can be used when
- * calibrating the convergence
- */
-static void
-draw_convergence(void)
-{
-	uint32_t black = fb_colour(0, 0, 0);
-	uint32_t white = fb_colour(255, 255, 255);
-	uint32_t x, y;
-	size_t f;
-	framebuffer_t *restrict fb;
-	for (f = 0; f < framebuffer_count; f++) {
-		fb = framebuffers + f;
-		fb_fill_rectangle(fb, black, 0, 0, fb->width, fb->height);
-		for (y = 0; y <= fb->height; y += 16) {
-			if (y == fb->height)
-				y = fb->height - 1;
-			for (x = 0; x <= fb->width; x += 16) {
-				if (x == fb->height)
-					x = fb->height - 1;
-				fb_draw_pixel(fb, white, x, y);
-			}
-		}
-	}
-}
 
 
 /**
- * Print a pattern on the screen that can be used when
- * calibrating the moiré cancellation
+ * Record a fatal signal, used as a signal handler
  * 
- * @param  gap       The horizontal and vertical gap, in pixels, between the dots
- * @param  diagonal  Whether to draw dots in a diagonal pattern
+ * @param  signo  The signal
  */
 static void
-draw_moire(uint32_t gap, int diagonal)
+catch_signal(int signo)
 {
-	uint32_t black = fb_colour(0, 0, 0);
-	uint32_t white = fb_colour(255, 255, 255);
-	uint32_t x, y, gap2 = gap << 1;
-	size_t f;
-	framebuffer_t *restrict fb;
-	gap += (uint32_t)!diagonal;
-	if (diagonal) {
-		for (f = 0; f < framebuffer_count; f++) {
-			fb = framebuffers + f;
-			fb_fill_rectangle(fb, black, 0, 0, fb->width, fb->height);
-			for (y = 0; y < fb->height; y += gap)
-				for (x = (y % gap2); x < fb->width; x += gap2)
-					fb_draw_pixel(fb, white, x, y);
-		}
-	} else {
-		for (f = 0; f < framebuffer_count; f++) {
-			fb = framebuffers + f;
-			fb_fill_rectangle(fb, black, 0, 0, fb->width, fb->height);
-			for (y = 0; y < fb->height; y += gap)
-				for (x = 0; x < fb->width; x += gap)
-					fb_draw_pixel(fb, white, x, y);
-		}
-	}
+	caught_signal = signo;
 }
 
 
 /**
  * Analyse the monitors calibrations
  * 
+ * All stops of the gamma ramps are fitted, see `gamma_fit`
+ * 
  * @return  Zero on success, -1 on error
  */
 static int
 read_calibs(void)
 {
-	size_t c;
+	const uint16_t *restrict ramps[3];
+	unsigned long long int start;
+	size_t c, ch;
+	double residual;
 	for (c = 0; c < crtc_count; c++) {
 		if (drm_get_gamma(&crtcs[c]) < 0)
 			return -1;
-		gamma_analyse(crtcs[c].gamma_stops, crtcs[c].red,   &gammas[0][c], &contrasts[0][c], &brightnesses[0][c]);
-		gamma_analyse(crtcs[c].gamma_stops, crtcs[c].green, &gammas[1][c], &contrasts[1][c], &brightnesses[1][c]);
-		gamma_analyse(crtcs[c].gamma_stops, crtcs[c].blue,  &gammas[2][c], &contrasts[2][c], &brightnesses[2][c]);
+		ramps[0] = crtcs[c].red;
+		ramps[1] = crtcs[c].green;
+		ramps[2] = crtcs[c].blue;
+		start = clock_ns();
+		for (ch = 0; ch < 3; ch++) {
+			residual = gamma_fit(crtcs[c].gamma_stops, ramps[ch], &gammas[ch][c],
+			                     &contrasts[ch][c], &brightnesses[ch][c]);
+			if (residual > calibs_residual)
+				calibs_residual = residual;
+		}
+		calibs_analyse_ns += clock_ns() - start;
 	}
+	mark_calibs_dirty();
 	return 0;
 }
 
@@ -262,19 +64,36 @@ read_calibs(void)
 /**
  * Apply the selected calibrations to the monitors
  * 
+ * Only the channels that have changed are regenerated, with
+ * `gamma_pipeline_quantise` for each monitor's number of stops,
+ * and only the monitors that have changed are updated, all at
+ * once where possible
+ * 
  * @return  Zero on success, -1 on error
  */
 static int
 apply_calibs(void)
 {
-	size_t c;
+	gamma_pipeline_t pipeline;
+	uint16_t *restrict ramps[3];
+	float curve[GAMMA_CURVE_STOPS + 1];
+	size_t c, ch;
 	for (c = 0; c < crtc_count; c++) {
-		gamma_generate(crtcs[c].gamma_stops, crtcs[c].red,   gammas[0][c], contrasts[0][c], brightnesses[0][c]);
-		gamma_generate(crtcs[c].gamma_stops, crtcs[c].green, gammas[1][c], contrasts[1][c], brightnesses[1][c]);
-		gamma_generate(crtcs[c].gamma_stops, crtcs[c].blue,  gammas[2][c], contrasts[2][c], brightnesses[2][c]);
-		if (drm_set_gamma(&crtcs[c]) < 0)
-			return -1;
+		if (!calibs_dirty[c])
+			continue;
+		ramps[0] = crtcs[c].red;
+		ramps[1] = crtcs[c].green;
+		ramps[2] = crtcs[c].blue;
+		for (ch = 0; ch < 3; ch++) {
+			if (calibs_dirty[c] & (1 << ch)) {
+				gamma_pipeline_init(&pipeline, gammas[ch][c], contrasts[ch][c], brightnesses[ch][c]);
+				gamma_pipeline_quantise(&pipeline, curve, crtcs[c].gamma_stops, ramps[ch], 1);
+			}
+		}
 	}
+	if (set_gammas(calibs_dirty) < 0)
+		return -1;
+	memset(calibs_dirty, 0, crtc_count);
 	return 0;
 }
 
@@ -288,11 +107,14 @@ apply_calibs(void)
 static int
 save_calibs(FILE *fp)
 {
-	size_t c;
+	size_t c, i;
 	for (c = 0; c < crtc_count; c++) {
-		if (fprintf(fp, "# index = %lu\n", c) < 0)
+		if (fprintf(fp, "# index = %lu\nedid = ", c) < 0)
 			return -1;
-		if (fprintf(fp, "edid = %s\n", crtcs[c].edid) < 0)
+		for (i = 0; i < crtcs[c].edid_size; i++)
+			if (fprintf(fp, "%02X", crtcs[c].edid[i]) < 0)
+				return -1;
+		if (fprintf(fp, "\n") < 0)
 			return -1;
 		if (fprintf(fp, "brightness = %f:%f:%f\n", brightnesses[0][c], brightnesses[1][c], brightnesses[2][c]) < 0)
 			return -1;
@@ -310,10 +132,13 @@ main(int argc, char *argv[])
 {
 	FILE *output_file = stdout;
 	int tty_configured = 0, rc = 0, in_fork = 0, status;
-	int c, b, d, at_contrast, red, green, blue;
+	int c, b, at_contrast, red, green, blue, *restrict diagonals = NULL;
 	struct termios stty, saved_stty;
-	uint32_t gap;
-	size_t mon;
+	struct sigaction sa;
+	sigset_t fatal_set, saved_set;
+	uint32_t *restrict gaps = NULL;
+	unsigned char *restrict selected = NULL;
+	size_t i, mon, monitors;
 	pid_t pid;
 
 	if (argc > 1 && argv[1][0] == '-') {
@@ -343,11 +168,33 @@ main(int argc, char *argv[])
 	printf("\033[?25l");
 	fflush(stdout);
 
+	/* Catch fatal signals from before the fork, so that the parent cannot die before it waits. */
+	sigemptyset(&fatal_set);
+	for (i = 0; i < sizeof(fatal_signals) / sizeof(*fatal_signals); i++)
+		sigaddset(&fatal_set, fatal_signals[i]);
+	sigprocmask(SIG_BLOCK, &fatal_set, &saved_set);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = catch_signal;
+	sigemptyset(&sa.sa_mask);
+	for (i = 0; i < sizeof(fatal_signals) / sizeof(*fatal_signals); i++)
+		sigaction(fatal_signals[i], &sa, NULL);
+
 	pid = fork();
+	if (pid <= 0)
+		for (i = 0; i < sizeof(fatal_signals) / sizeof(*fatal_signals); i++)
+			signal(fatal_signals[i], SIG_DFL);
+	sigprocmask(SIG_SETMASK, &saved_set, NULL);
+
 	if (pid > 0) {
-		while (waitpid(pid, &status, 0) < 0)
+		/* Wait for the child to die, rather than dying ourselves, so that the displays are restored. */
+		if (caught_signal)
+			kill(pid, caught_signal);
+		while (waitpid(pid, &status, 0) < 0) {
 			if (errno != EINTR)
 				perror(*argv);
+			else if (caught_signal)
+				kill(pid, caught_signal);
+		}
 		rc = !!status;
 		goto done;
 	} else if (!pid) {
@@ -456,21 +303,21 @@ main(int argc, char *argv[])
 		if (b) {
 			b = 0;
 			if (c == 'A' && at_contrast) {
-				contrasts[0][mon] += (double)red / 100;
-				contrasts[1][mon] += (double)green / 100;
-				contrasts[2][mon] += (double)blue / 100;
+				set_calib(contrasts, mon, 0, contrasts[0][mon] + (double)red / 100);
+				set_calib(contrasts, mon, 1, contrasts[1][mon] + (double)green / 100);
+				set_calib(contrasts, mon, 2, contrasts[2][mon] + (double)blue / 100);
 			} else if (c == 'A') {
-				brightnesses[0][mon] += (double)red / 100;
-				brightnesses[1][mon] += (double)green / 100;
-				brightnesses[2][mon] += (double)blue / 100;
+				set_calib(brightnesses, mon, 0, brightnesses[0][mon] + (double)red / 100);
+				set_calib(brightnesses, mon, 1, brightnesses[1][mon] + (double)green / 100);
+				set_calib(brightnesses, mon, 2, brightnesses[2][mon] + (double)blue / 100);
 			} else if (c == 'B' && at_contrast) {
-				contrasts[0][mon] -= (double)red / 100;
-				contrasts[1][mon] -= (double)green / 100;
-				contrasts[2][mon] -= (double)blue / 100;
+				set_calib(contrasts, mon, 0, contrasts[0][mon] - (double)red / 100);
+				set_calib(contrasts, mon, 1, contrasts[1][mon] - (double)green / 100);
+				set_calib(contrasts, mon, 2, contrasts[2][mon] - (double)blue / 100);
 			} else if (c == 'B') {
-				brightnesses[0][mon] -= (double)red / 100;
-				brightnesses[1][mon] -= (double)green / 100;
-				brightnesses[2][mon] -= (double)blue / 100;
+				set_calib(brightnesses, mon, 0, brightnesses[0][mon] - (double)red / 100);
+				set_calib(brightnesses, mon, 1, brightnesses[1][mon] - (double)green / 100);
+				set_calib(brightnesses, mon, 2, brightnesses[2][mon] - (double)blue / 100);
 			} else if (c == 'C') {
 				mon = (mon + 1) % crtc_count;
 			} else if (c == 'D') {
@@ -536,16 +383,13 @@ main(int argc, char *argv[])
 		if (b) {
 			b = 0;
 			if (c == 'A') {
-				gammas[0][mon] += (double)red / 100;
-				gammas[1][mon] += (double)green / 100;
-				gammas[2][mon] += (double)blue / 100;
+				set_calib(gammas, mon, 0, gammas[0][mon] + (double)red / 100);
+				set_calib(gammas, mon, 1, gammas[1][mon] + (double)green / 100);
+				set_calib(gammas, mon, 2, gammas[2][mon] + (double)blue / 100);
 			} else if (c == 'B') {
-				gammas[0][mon] -= (double)red / 100;
-				gammas[1][mon] -= (double)green / 100;
-				gammas[2][mon] -= (double)blue / 100;
-				if (gammas[0][mon] < 0)  gammas[0][mon] = 0;
-				if (gammas[1][mon] < 0)  gammas[1][mon] = 0;
-				if (gammas[2][mon] < 0)  gammas[2][mon] = 0;
+				set_calib(gammas, mon, 0, fmax(gammas[0][mon] - (double)red / 100, 0));
+				set_calib(gammas, mon, 1, fmax(gammas[1][mon] - (double)green / 100, 0));
+				set_calib(gammas, mon, 2, fmax(gammas[2][mon] - (double)blue / 100, 0));
 			} else if (c == 'C') {
 				mon = (mon + 1) % crtc_count;
 			} else if (c == 'D') {
@@ -589,8 +433,15 @@ main(int argc, char *argv[])
 	printf("cancellation. This too is done on the using the\n");
 	printf("monitors' control panel.\n");
 	printf("\n");
-	printf("You can use <d> and the arrow keys to change the\n");
-	printf("dot-pattern on the screens.\n");
+	printf("<Left> and <right> is used to change which\n");
+	printf("monitor to calibrate. <Left> switches to the\n");
+	printf("previous monitor (one lower in index) and\n");
+	printf("<right> switches to the next monitor (one\n");
+	printf("higher in index.)\n");
+	printf("<Up> and <down> is used to increase and\n");
+	printf("decrease the gap between the dots, and <d>\n");
+	printf("is used to switch between the straight and\n");
+	printf("the diagonal dot-pattern.\n");
 	printf("\n");
 	printf("Press ENTER to continue, and ENTER again when\n");
 	printf("your are done.\n");
@@ -600,26 +451,49 @@ main(int argc, char *argv[])
 
 	printf("\033[H\033[2J");
 	fflush(stdout);
-	draw_moire(1, 1);
+	draw_moire(1, 1, NULL);
+
+	monitors = crtc_count ? crtc_count : 1;
+	gaps = malloc(monitors * sizeof(*gaps));
+	diagonals = malloc(monitors * sizeof(*diagonals));
+	selected = malloc(framebuffer_count + 1);
+	if (!gaps || !diagonals || !selected)
+		goto fail;
+	for (mon = 0; mon < monitors; mon++) {
+		gaps[mon] = 1;
+		diagonals[mon] = 1;
+	}
 
 	b = 0;
-	d = 1;
-	gap = 1;
+	mon = 0;
 	while ((c = getchar()) != '\n') {
 		if (b) {
 			b = 0;
-			if (c == 'A' || c == 'C') {
-				draw_moire(++gap, d);
-			} else if (c == 'B' || c == 'D') {
-				if (--gap == 0)
-					gap = 1;
-				draw_moire(gap, d);
+			if (c == 'A') {
+				gaps[mon]++;
+			} else if (c == 'B') {
+				if (gaps[mon] > 1)
+					gaps[mon]--;
+			} else if (c == 'C') {
+				mon = (mon + 1) % monitors;
+				continue;
+			} else if (c == 'D') {
+				mon = (mon == 0 ? monitors : mon) - 1;
+				continue;
+			} else {
+				continue;
 			}
 		} else if (c == '[') {
 			b = 1;
+			continue;
 		} else if (c == 'd') {
-			draw_moire(gap, d ^= 1);
+			diagonals[mon] ^= 1;
+		} else {
+			continue;
 		}
+		/* Only redraw the monitor being calibrated. */
+		select_framebuffers(mon, selected);
+		draw_moire(gaps[mon], diagonals[mon], selected);
 	}
 
 	printf("\033[H\033[2J");
@@ -640,12 +514,22 @@ main(int argc, char *argv[])
 			goto fail;
 
 done:
+	free(gaps);
+	free(diagonals);
+	free(selected);
+	if (in_fork)
+		report_stats();
 	if (!in_fork) {
 		release_video();
 		if (tty_configured)
 			tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_stty);
 		printf("\033[?25h");
 		fflush(stdout);
+		report_stats();
+	}
+	if (caught_signal) {
+		signal(caught_signal, SIG_DFL);
+		raise(caught_signal);
 	}
 	return rc;
 fail:
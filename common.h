@@ -3,23 +3,271 @@
 #include <linux/fb.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <math.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
 
+/**
+ * Function that fills a run of pixels on a line with one colour
+ * 
+ * @param  mem     The first pixel in the run
+ * @param  colour  The colour of the pixels, as returned by `fb_colour`
+ * @param  n       The number of pixels in the run
+ */
+typedef void fill_row_func_t(int8_t *restrict mem, uint32_t colour, size_t n);
+
+
+struct fb_format;
+
+/**
+ * Function that packs an sRGB colour into a pixel value
+ * 
+ * @param   format  The pixel format
+ * @param   red     The red   component from [0, 255] sRGB
+ * @param   green   The green component from [0, 255] sRGB
+ * @param   blue    The blue  component from [0, 255] sRGB
+ * @return          The colour encoded as a pixel value
+ */
+typedef uint32_t colour_pack_func_t(const struct fb_format *restrict format, int red, int green, int blue);
+
+
+/**
+ * Pixel format information
+ */
+typedef struct fb_format
+{
+	/**
+	 * The number of bits per pixel
+	 */
+	uint32_t bits_per_pixel;
+
+	/**
+	 * The bit offset of the red channel in a pixel
+	 */
+	uint32_t red_offset;
+
+	/**
+	 * The number of bits in the red channel
+	 */
+	uint32_t red_length;
+
+	/**
+	 * The bit offset of the green channel in a pixel
+	 */
+	uint32_t green_offset;
+
+	/**
+	 * The number of bits in the green channel
+	 */
+	uint32_t green_length;
+
+	/**
+	 * The bit offset of the blue channel in a pixel
+	 */
+	uint32_t blue_offset;
+
+	/**
+	 * The number of bits in the blue channel
+	 */
+	uint32_t blue_length;
+
+	/**
+	 * Function used to pack colours, selected for
+	 * the format when the framebuffer is opened
+	 */
+	colour_pack_func_t *pack;
+
+} fb_format_t;
+
+
+/**
+ * Maximum number of damage rectangles tracked on a framebuffer,
+ * when exceeded they are merged into their bounding box
+ */
+#ifndef FB_DAMAGE_MAX
+# define FB_DAMAGE_MAX  16
+#endif
+
+
+/**
+ * A rectangle on a framebuffer
+ */
+typedef struct fb_rect
+{
+	/**
+	 * The left-most column in the rectangle
+	 */
+	uint32_t x;
+
+	/**
+	 * The top-most line in the rectangle
+	 */
+	uint32_t y;
+
+	/**
+	 * The width of the rectangle, in pixels
+	 */
+	uint32_t width;
+
+	/**
+	 * The height of the rectangle, in pixels
+	 */
+	uint32_t height;
+
+} fb_rect_t;
+
+
+/**
+ * A filled in rectangle in a scene
+ */
+typedef struct scene_rect
+{
+	/**
+	 * The colour of the rectangle, as returned by `fb_colour`
+	 */
+	uint32_t colour;
+
+	/**
+	 * The starting pixel on the X axis for the rectangle
+	 */
+	uint32_t x;
+
+	/**
+	 * The starting pixel on the Y axis for the rectangle
+	 */
+	uint32_t y;
+
+	/**
+	 * The width of the rectangle, in pixels
+	 */
+	uint32_t width;
+
+	/**
+	 * The height of the rectangle, in pixels
+	 */
+	uint32_t height;
+
+} scene_rect_t;
+
+
+/**
+ * The maximum number of bits in a channel that
+ * a colour lookup table can transform
+ */
+#ifndef LUT_BITS
+# define LUT_BITS  10
+#endif
+
+
+struct lut;
+
+/**
+ * Function that transforms a run of pixels with a colour lookup table
+ * 
+ * @param  lut  The lookup table
+ * @param  dst  Output buffer for the transformed pixels
+ * @param  src  The pixels to transform
+ * @param  n    The number of pixels
+ */
+typedef void lut_row_func_t(const struct lut *restrict lut, int8_t *restrict dst, const int8_t *restrict src, size_t n);
+
+
+/**
+ * Colour lookup table, used to apply gamma ramps to
+ * the pixels of a framebuffer in software
+ */
+typedef struct lut
+{
+	/**
+	 * The transformed red channel, in place in a
+	 * pixel, for each value of the red channel
+	 */
+	uint32_t red[1 << LUT_BITS];
+
+	/**
+	 * The transformed green channel, in place in a
+	 * pixel, for each value of the green channel
+	 */
+	uint32_t green[1 << LUT_BITS];
+
+	/**
+	 * The transformed blue channel, in place in a
+	 * pixel, for each value of the blue channel
+	 */
+	uint32_t blue[1 << LUT_BITS];
+
+	/**
+	 * The bit offset of the red channel in a pixel
+	 */
+	uint32_t red_offset;
+
+	/**
+	 * The bit offset of the green channel in a pixel
+	 */
+	uint32_t green_offset;
+
+	/**
+	 * The bit offset of the blue channel in a pixel
+	 */
+	uint32_t blue_offset;
+
+	/**
+	 * The largest value of the red channel
+	 */
+	uint32_t red_mask;
+
+	/**
+	 * The largest value of the green channel
+	 */
+	uint32_t green_mask;
+
+	/**
+	 * The largest value of the blue channel
+	 */
+	uint32_t blue_mask;
+
+	/**
+	 * The bits of a pixel that are not part of
+	 * any channel, these are left as is
+	 */
+	uint32_t keep;
+
+	/**
+	 * Function used to transform runs of pixels,
+	 * selected for the pixel size
+	 */
+	lut_row_func_t *row;
+
+} lut_t;
+
+
+/**
+ * Function that runs a job in the worker thread pool
+ * 
+ * @param  job   The index of the job
+ * @param  data  User-defined data
+ */
+typedef void pool_func_t(size_t job, void *data);
+
+
 /**
  * Framebuffer information
  */
@@ -30,6 +278,12 @@ typedef struct framebuffer
 	 */
 	int fd;
 
+	/**
+	 * Whether the framebuffer is a virtual framebuffer,
+	 * rather than a framebuffer device
+	 */
+	int is_virtual;
+
 	/**
 	 * The width of the display in pixels
 	 */
@@ -40,6 +294,17 @@ typedef struct framebuffer
 	 */
 	uint32_t height;
 
+	/**
+	 * The first line that may be drawn on
+	 */
+	uint32_t clip_top;
+
+	/**
+	 * The line after the last line that may be drawn on,
+	 * normally `height`
+	 */
+	uint32_t clip_bottom;
+
 	/**
 	 * Increment for `mem` to move to next pixel on the line
 	 */
@@ -51,13 +316,159 @@ typedef struct framebuffer
 	uint32_t line_length;
 
 	/**
-	 * Framebuffer pointer, `MAP_FAILED` (from <sys/mman.h>) if not mapped
+	 * The memory to draw on, `shadow` if allocated, otherwise `device`
 	 */
 	int8_t *mem;
 
+	/**
+	 * Framebuffer pointer, `MAP_FAILED` (from <sys/mman.h>) if not mapped;
+	 * the back buffer if `double_buffered`
+	 */
+	int8_t *device;
+
+	/**
+	 * The area of the framebuffer that is displayed,
+	 * same as `device` unless `double_buffered`
+	 */
+	int8_t *front;
+
+	/**
+	 * Whether `device` is an off-screen area that
+	 * `fb_present` pans the display to
+	 */
+	int double_buffered;
+
+	/**
+	 * Whether the driver supports waiting for
+	 * the vertical blank before panning
+	 */
+	int vsync;
+
+	/**
+	 * The vertical offset of the back buffer in the virtual
+	 * resolution, if `double_buffered`
+	 */
+	uint32_t back_yoffset;
+
+	/**
+	 * The vertical offset of the visible area in the
+	 * virtual resolution when the framebuffer was opened
+	 */
+	uint32_t origin_yoffset;
+
+	/**
+	 * The variable screen information, with the
+	 * current panning, used to pan the display
+	 */
+	struct fb_var_screeninfo var_info;
+
+	/**
+	 * The start of the mapping of the framebuffer's memory,
+	 * which `device` points into, `MAP_FAILED` if not mapped
+	 */
+	int8_t *map;
+
+	/**
+	 * The size of the mapping at `map`
+	 */
+	size_t map_size;
+
+	/**
+	 * The offset of the visible area, `device`, in the
+	 * framebuffer's memory, from the panning
+	 */
+	size_t visible_offset;
+
+	/**
+	 * Off-screen copy of the framebuffer in system memory, with the
+	 * same layout as `device`, `NULL` if not allocated; changes are
+	 * copied to `device` by `fb_flush`
+	 */
+	int8_t *shadow;
+
+	/**
+	 * Areas of `shadow` that have changed since the last flush
+	 */
+	fb_rect_t damage[FB_DAMAGE_MAX];
+
+	/**
+	 * The number of elements in `damage`
+	 */
+	size_t damage_count;
+
+	/**
+	 * Areas of `shadow` that changed before the last time the
+	 * display was panned, if `double_buffered`, and have not yet
+	 * been copied to the new back buffer; they are copied,
+	 * together with `damage`, by the next flush
+	 */
+	fb_rect_t prev_damage[FB_DAMAGE_MAX];
+
+	/**
+	 * The number of elements in `prev_damage`
+	 */
+	size_t prev_damage_count;
+
+	/**
+	 * Function used to fill runs of pixels, selected
+	 * for `bytes_per_pixel` when the framebuffer is opened
+	 */
+	fill_row_func_t *fill_row;
+
+	/**
+	 * Function used to fill runs of pixels in fills too
+	 * large to be kept in the cache, bypassing the cache
+	 * where possible, selected with `fill_select_stream`
+	 */
+	fill_row_func_t *fill_stream;
+
+	/**
+	 * The pixel format
+	 */
+	fb_format_t format;
+
+	/**
+	 * Colour lookup table that is applied to the pixels when
+	 * they are copied from `shadow` to `device`, `NULL` if none
+	 */
+	lut_t *lut;
+
+	/**
+	 * When the framebuffer was opened, as returned by `clock_ns`
+	 */
+	unsigned long long int opened_at;
+
+	/**
+	 * The number of nanoseconds it took to open the framebuffer
+	 */
+	unsigned long long int open_ns;
+
+	/**
+	 * The number of nanoseconds the first draw on the
+	 * framebuffer took, 0 if nothing has been drawn
+	 */
+	unsigned long long int first_draw_ns;
+
+	/**
+	 * The number of nanoseconds from when the framebuffer was
+	 * opened to when the first draw on it was flushed, 0 if
+	 * nothing has been drawn
+	 */
+	unsigned long long int first_frame_ns;
+
 } framebuffer_t;
 
 
+/**
+ * Function that draws on a framebuffer
+ * 
+ * @param  fb     The framebuffer, possibly clipped to a band of lines
+ * @param  index  The index of the framebuffer in `framebuffers`
+ * @param  data   User-defined data
+ */
+typedef void fb_draw_func_t(framebuffer_t *restrict fb, size_t index, void *data);
+
+
 /**
  * Graphics card information
  */
@@ -94,6 +505,53 @@ typedef struct drm_card
 	 */
 	size_t connector_count;
 
+	/**
+	 * Whether gamma ramps are applied with atomic commits,
+	 * rather than with the legacy interface
+	 */
+	int atomic;
+
+	/**
+	 * Whether `gamma_lut_prop` and `gamma_lut_size_prop`
+	 * have been looked up
+	 */
+	int crtc_props_resolved;
+
+	/**
+	 * The identifier of the CRT controllers' `GAMMA_LUT`
+	 * property, 0 if the graphics card has none
+	 */
+	uint32_t gamma_lut_prop;
+
+	/**
+	 * The identifier of the CRT controllers' `GAMMA_LUT_SIZE`
+	 * property, 0 if the graphics card has none
+	 */
+	uint32_t gamma_lut_size_prop;
+
+	/**
+	 * The identifier of the connectors' `EDID`
+	 * property, 0 if not yet found
+	 */
+	uint32_t edid_prop;
+
+	/**
+	 * The atomic request with the queued gamma ramps,
+	 * `NULL` if none are queued
+	 */
+	drmModeAtomicReq *request;
+
+	/**
+	 * The CRT controllers whose gamma ramps are in `request`,
+	 * with room for `crtc_count` CRT controllers
+	 */
+	struct drm_crtc **restrict queued;
+
+	/**
+	 * The number of elements in `queued`
+	 */
+	size_t queued_count;
+
 } drm_card_t;
 
 
@@ -128,15 +586,54 @@ typedef struct drm_crtc
 	int connected;
 
 	/**
-	 * The CRT's EDID, hexadecimally encoded
+	 * Whether the CRT controller has a mode set, if not,
+	 * `x`, `y`, `width` and `height` are zero
+	 */
+	int mode_valid;
+
+	/**
+	 * The left edge of the area of the scanout buffer
+	 * that the CRT controller shows, in pixels
+	 */
+	uint32_t x;
+
+	/**
+	 * The top edge of the area of the scanout buffer
+	 * that the CRT controller shows, in pixels
+	 */
+	uint32_t y;
+
+	/**
+	 * The width of the CRT controller's mode, in pixels
+	 */
+	uint32_t width;
+
+	/**
+	 * The height of the CRT controller's mode, in pixels
+	 */
+	uint32_t height;
+
+	/**
+	 * The CRT's EDID, `NULL` if not available
+	 */
+	unsigned char *restrict edid;
+
+	/**
+	 * The size of `edid`, in bytes
 	 */
-	char *restrict edid;
+	size_t edid_size;
 
 	/**
 	 * The number of stops on the gamma ramps
 	 */
 	size_t gamma_stops;
 
+	/**
+	 * Whether the CRT controller has no gamma ramps, so that
+	 * the ramps are applied to the framebuffer in software
+	 */
+	int software_gamma;
+
 	/**
 	 * The gamma ramp for the red channel
 	 */
@@ -152,12 +649,177 @@ typedef struct drm_crtc
 	 */
 	uint16_t *restrict blue;
 
-} drm_crtc_t;
+	/**
+	 * The gamma ramps as last committed with `GAMMA_LUT`, followed
+	 * by the queued gamma ramps, `NULL` if the legacy interface
+	 * is used for the CRT controller
+	 */
+	struct drm_color_lut *restrict lut;
+
+	/**
+	 * The property blob with the committed gamma ramps, 0 if none
+	 */
+	uint32_t lut_blob;
+
+	/**
+	 * The property blob with the queued gamma ramps, 0 if none
+	 */
+	uint32_t queued_blob;
+
+} drm_crtc_t;
+
+
+/**
+ * The number of intervals between the points of a master
+ * curve, gamma ramps with a divisor of this number of
+ * stops are resampled without interpolation
+ */
+#ifndef GAMMA_CURVE_STOPS
+# define GAMMA_CURVE_STOPS  4096
+#endif
+
+/**
+ * The maximum number of operations in a gamma ramp pipeline
+ */
+#ifndef GAMMA_PIPELINE_MAX
+# define GAMMA_PIPELINE_MAX  8
+#endif
+
+
+/**
+ * Stage of a gamma ramp pipeline, each stage maps the
+ * value of a stop, starting with its input value in [0, 1),
+ * and the value after the last stage is quantised
+ */
+typedef enum gamma_stage
+{
+	/**
+	 * Raise the value to the reciprocal of a gamma,
+	 * negative values are treated as 0
+	 */
+	GAMMA_STAGE_GAMMA,
+
+	/**
+	 * Map 0 to a brightness and 1 to a contrast, linearly
+	 */
+	GAMMA_STAGE_LEVELS,
+
+	/**
+	 * Multiply the value by a factor, for example
+	 * to adjust the white point
+	 */
+	GAMMA_STAGE_SCALE,
+
+	/**
+	 * Add an offset to the value
+	 */
+	GAMMA_STAGE_OFFSET
+
+} gamma_stage_t;
+
+
+/**
+ * Operation in a compiled gamma ramp pipeline
+ */
+typedef struct gamma_op
+{
+	/**
+	 * Whether the operation is a `GAMMA_STAGE_GAMMA`
+	 * stage, otherwise it is a linear map
+	 */
+	int power;
+
+	/**
+	 * The gamma, if `power` is set
+	 */
+	double gamma;
+
+	/**
+	 * What 0 is mapped to, unless `power` is set
+	 */
+	double low;
+
+	/**
+	 * What 1 is mapped to, unless `power` is set
+	 */
+	double high;
+
+} gamma_op_t;
+
+
+/**
+ * Gamma ramp pipeline, made of ordered stages that
+ * are compiled, as they are added, into as few
+ * operations as possible
+ */
+typedef struct gamma_pipeline
+{
+	/**
+	 * The number of elements in `ops`
+	 */
+	size_t op_count;
+
+	/**
+	 * The operations, consecutive gamma stages are
+	 * merged into one, as are consecutive linear stages
+	 */
+	gamma_op_t ops[GAMMA_PIPELINE_MAX];
+
+} gamma_pipeline_t;
+
+
+
+/***** draw.c *****/
+
+/**
+ * Draw bars in different shades of grey, red, green and blue
+ * used for calibrating the contrast and brightness
+ */
+void draw_contrast_brightness(void);
+
+/**
+ * Draw an unique index on each monitor
+ * 
+ * @return  Zero on success, -1 on error
+ */
+int draw_id(void);
+
+/**
+ * Draw squares used as reference when tweeking the gamma correction
+ */
+void draw_gamma(void);
+
+/**
+ * Print a pattern on the screen that can be used when
+ * calibrating the convergence
+ */
+void draw_convergence(void);
+
+/**
+ * Print a pattern on the screen that can be used when
+ * calibrating the moiré cancellation
+ * 
+ * @param  gap       The horizontal and vertical gap, in pixels, between the dots
+ * @param  diagonal  Whether to draw dots in a diagonal pattern
+ * @param  selected  For each framebuffer, whether to draw the pattern
+ *                   on it, `NULL` to draw it on all framebuffers
+ */
+void draw_moire(uint32_t gap, int diagonal, const unsigned char *restrict selected);
 
 
 
 /***** gamma.c *****/
 
+/**
+ * The number of gamma ramps that have been found in the cache
+ */
+extern unsigned long long int gamma_cache_hits;
+
+/**
+ * The number of gamma ramps that have had to be generated
+ */
+extern unsigned long long int gamma_cache_misses;
+
 /**
  * Analyse a gamma ramp
  * 
@@ -170,9 +832,47 @@ typedef struct drm_crtc
 void gamma_analyse(size_t stops, const uint16_t* restrict ramp, double *restrict gamma,
                    double *restrict contrast, double* restrict brightness);
 
+/**
+ * Analyse a gamma ramp by fitting the gamma, contrast, and
+ * brightness to all of its stops
+ * 
+ * Starting from the result of `gamma_analyse`, iterations
+ * alternate between fitting the contrast and brightness by
+ * linear least squares, and the reciprocal of the gamma by
+ * weighted least squares in the log domain, so that a gamma
+ * ramp that is not exactly of the form generated by
+ * `gamma_generate`, for example one left by another program,
+ * gives the parameters of the closest such ramp
+ * 
+ * The parameters with the least residual found are returned,
+ * so the result is never worse than that of `gamma_analyse`
+ * 
+ * @param   stops       The number of stops in the gamma ramp
+ * @param   ramp        The gamma ramp
+ * @param   gamma       Output parameter for the gamma
+ * @param   contrast    Output parameter for the contrast
+ * @param   brightness  Output parameter for the brightness
+ * @return              The root mean square of the difference between
+ *                      `ramp` and the gamma ramp given by the parameters,
+ *                      in 16-bit units
+ */
+double gamma_fit(size_t stops, const uint16_t *restrict ramp, double *restrict gamma,
+                 double *restrict contrast, double *restrict brightness);
+
 /**
  * Generate a gamma ramp
  * 
+ * The most recently generated gamma ramps are cached, keyed
+ * by the exact parameters, so that going back to a previous
+ * setting, or giving several monitors the same setting,
+ * only copies the gamma ramp
+ * 
+ * Unless the `CRT_CALIBRATOR_GAMMA_REFERENCE` environment variable
+ * is set, gamma ramps with 256, 1024, or 4096 stops are generated
+ * with fixed-point arithmetic, see `gamma_generate_fixed`, and
+ * other gamma ramps with a vectorised approximation of `pow` when
+ * the CPU supports it, see `gamma_generate_avx2`
+ * 
  * @param  stops       The number of stops in the gamma ramp
  * @param  ramp        Memory area to where to write the gamma ramp
  * @param  gamma       The gamma
@@ -181,6 +881,176 @@ void gamma_analyse(size_t stops, const uint16_t* restrict ramp, double *restrict
  */
 void gamma_generate(size_t stops, uint16_t *restrict ramp, double gamma, double contrast, double brightness);
 
+/**
+ * Release all cached gamma ramps
+ */
+void gamma_clear(void);
+
+/**
+ * Reset a gamma ramp pipeline to the default stages,
+ * which generate the same gamma ramps as `gamma_generate`
+ * 
+ * @param  pipeline    The pipeline
+ * @param  gamma       The gamma
+ * @param  contrast    The contrast
+ * @param  brightness  The brightness
+ */
+void gamma_pipeline_init(gamma_pipeline_t *restrict pipeline, double gamma, double contrast, double brightness);
+
+/**
+ * Add a stage to the end of a gamma ramp pipeline
+ * 
+ * The stage is merged into the last operation if it is of
+ * the same kind, so that the pipeline is always compiled
+ * 
+ * @param   pipeline  The pipeline
+ * @param   stage     The stage
+ * @param   value     The gamma for `GAMMA_STAGE_GAMMA`, the contrast for
+ *                    `GAMMA_STAGE_LEVELS`, the factor for `GAMMA_STAGE_SCALE`,
+ *                    or the offset for `GAMMA_STAGE_OFFSET`
+ * @param   value2    The brightness for `GAMMA_STAGE_LEVELS`, otherwise unused
+ * @return            Zero on success, -1 on error
+ */
+int gamma_pipeline_add(gamma_pipeline_t *restrict pipeline, gamma_stage_t stage, double value, double value2);
+
+/**
+ * Generate a gamma ramp with a gamma ramp pipeline
+ * 
+ * Every stop is passed through all operations before it is
+ * quantised, once. If the pipeline is equivalent to the
+ * default stages, the gamma ramp is generated exactly like
+ * by `gamma_generate`, with the same speed
+ * 
+ * @param  pipeline  The pipeline
+ * @param  stops     The number of stops in the gamma ramp
+ * @param  ramp      Memory area to where to write the gamma ramp
+ * @param  cached    Whether the gamma ramp may be taken from and
+ *                   added to the cache, which must not be used
+ *                   from multiple threads at the same time
+ */
+void gamma_pipeline_generate(const gamma_pipeline_t *restrict pipeline, size_t stops, uint16_t *restrict ramp, int cached);
+
+/**
+ * Evaluate a gamma ramp pipeline into a master curve
+ * 
+ * A master curve holds the unquantised values of a gamma ramp
+ * at `GAMMA_CURVE_STOPS + 1` evenly spaced points from 0 to 1,
+ * inclusive, so that it can be resampled to any number of stops
+ * with `gamma_curve_quantise`
+ * 
+ * @param  pipeline  The pipeline
+ * @param  curve     Output buffer for the master curve
+ */
+void gamma_pipeline_curve(const gamma_pipeline_t *restrict pipeline, float *restrict curve);
+
+/**
+ * Resample a master curve, with linear interpolation, to the
+ * number of stops of a gamma ramp, and quantise it
+ * 
+ * If the number of stops is a divisor of `GAMMA_CURVE_STOPS`,
+ * no interpolation is needed, and the gamma ramp differs by
+ * at most 1 from the gamma ramp that `gamma_pipeline_generate`
+ * would generate; otherwise the difference is greatest at the
+ * steepest parts of the gamma ramp, a few units for gamma ramps
+ * with fewer stops than the master curve, but more for the first
+ * stops of gamma ramps with more stops and a high gamma
+ * 
+ * @param  curve  The master curve
+ * @param  stops  The number of stops in the gamma ramp
+ * @param  ramp   Memory area to where to write the gamma ramp
+ */
+void gamma_curve_quantise(const float *restrict curve, size_t stops, uint16_t *restrict ramp);
+
+/**
+ * Generate a gamma ramp with a gamma ramp pipeline, as it is
+ * applied, by quantising the pipeline's master curve to the
+ * number of stops of the gamma ramp
+ * 
+ * If the pipeline is equivalent to the default stages and the
+ * gamma ramp has 256, 1024, or 4096 stops, the gamma ramp is
+ * instead generated like by `gamma_generate`, with fixed-point
+ * arithmetic, so that the gamma ramps applied to these common
+ * stop counts are the same with every compiler, and the master
+ * curve is not calculated; otherwise the master curve is
+ * calculated with `gamma_pipeline_curve` and resampled
+ * with `gamma_curve_quantise`
+ * 
+ * @param  pipeline  The pipeline
+ * @param  curve     Buffer for the pipeline's master curve, with
+ *                   `GAMMA_CURVE_STOPS + 1` points; its contents
+ *                   are unspecified afterwards
+ * @param  stops     The number of stops in the gamma ramp
+ * @param  ramp      Memory area to where to write the gamma ramp
+ * @param  cached    Whether the gamma ramp may be taken from and
+ *                   added to the cache, which must not be used
+ *                   from multiple threads at the same time
+ */
+void gamma_pipeline_quantise(const gamma_pipeline_t *restrict pipeline, float *restrict curve, size_t stops,
+                             uint16_t *restrict ramp, int cached);
+
+
+
+/***** fill.c *****/
+
+/**
+ * Select the fastest row-fill kernel for a pixel size
+ * 
+ * @param   bytes_per_pixel  The number of bytes per pixel
+ * @return                   The kernel, a no-operation if
+ *                           the pixel size is not supported
+ */
+fill_row_func_t *fill_select(uint32_t bytes_per_pixel);
+
+/**
+ * Select a row-fill kernel for a pixel size that uses
+ * non-temporal stores, for fills too large to be kept
+ * in the cache, `fill_fence` must be called before
+ * the filled memory is read by another thread
+ * 
+ * @param   bytes_per_pixel  The number of bytes per pixel
+ * @return                   The kernel, a no-operation if
+ *                           the pixel size is not supported
+ */
+fill_row_func_t *fill_select_stream(uint32_t bytes_per_pixel);
+
+/**
+ * Copy memory using non-temporal stores, for bulk copies
+ * to or from video memory that should not evict the cache
+ * 
+ * The stores are globally visible when the function returns
+ * 
+ * @param  dst  The destination
+ * @param  src  The source
+ * @param  n    The number of bytes to copy
+ */
+void fill_copy_stream(int8_t *restrict dst, const int8_t *restrict src, size_t n);
+
+/**
+ * Wait until all non-temporal stores made by the
+ * calling thread are globally visible
+ */
+void fill_fence(void);
+
+
+
+/***** lut.c *****/
+
+/**
+ * Create a colour lookup table that applies gamma ramps to
+ * the pixels of a framebuffer
+ * 
+ * @param   format  The framebuffer's pixel format
+ * @param   stops   The number of stops in each gamma ramp, at least 1
+ * @param   red     The gamma ramp for the red channel
+ * @param   green   The gamma ramp for the green channel
+ * @param   blue    The gamma ramp for the blue channel
+ * @return          The lookup table, free with `free`, `NULL` on error;
+ *                  `errno` is set to `ENOTSUP` if the pixel format
+ *                  is not supported
+ */
+lut_t *lut_create(const fb_format_t *restrict format, size_t stops, const uint16_t *restrict red,
+                  const uint16_t *restrict green, const uint16_t *restrict blue);
+
 
 
 /***** framebuffer.c *****/
@@ -209,18 +1079,85 @@ int fb_open(size_t index, framebuffer_t *restrict fb);
 void fb_close(framebuffer_t *restrict fb);
 
 /**
- * Construct an sRGB colour in 32-bit XRGB encoding to
- * use when specifying colours
+ * Set the gamma ramps to apply to a framebuffer in software,
+ * for displays whose gamma ramps cannot be set
+ * 
+ * The ramps are applied when the shadow buffer is flushed to
+ * the display, so what is drawn is unaffected; the framebuffer
+ * must be redrawn or reflushed for a change to take effect
+ * 
+ * @param   fb     The framebuffer
+ * @param   stops  The number of stops in each gamma ramp
+ * @param   red    The gamma ramp for the red channel, `NULL` to remove the ramps
+ * @param   green  The gamma ramp for the green channel
+ * @param   blue   The gamma ramp for the blue channel
+ * @return         Zero on success, -1 on error; `errno` is set to `ENOTSUP`
+ *                 if the framebuffer has no shadow buffer or its pixel
+ *                 format is not supported
+ */
+int fb_set_lut(framebuffer_t *restrict fb, size_t stops, const uint16_t *restrict red,
+               const uint16_t *restrict green, const uint16_t *restrict blue);
+
+/**
+ * Copy the visible pixels of a framebuffer, as they are
+ * currently shown on the display, into a buffer
+ * 
+ * @param  fb   The framebuffer
+ * @param  buf  Output buffer, `fb->height` lines of `fb->width`
+ *              pixels, without padding
+ */
+void fb_save(const framebuffer_t *restrict fb, int8_t *restrict buf);
+
+/**
+ * Copy pixels saved with `fb_save` back to the part of
+ * a framebuffer that was shown when it was opened
+ * 
+ * The framebuffer must not have been resized since the
+ * pixels were saved
+ * 
+ * @param  fb   The framebuffer
+ * @param  buf  The saved pixels
+ */
+void fb_restore(framebuffer_t *restrict fb, const int8_t *restrict buf);
+
+/**
+ * Update the mapping of a framebuffer if the display mode,
+ * or the panning, has changed since it was mapped
+ * 
+ * If the framebuffer cannot be remapped, its size is set
+ * to zero so that nothing is drawn on it
+ * 
+ * @param   fb  The framebuffer
+ * @return      Zero on success, -1 on error
+ */
+int fb_refresh(framebuffer_t *restrict fb);
+
+/**
+ * Check whether two pixel formats are identical
+ * 
+ * @param   a  One of the formats
+ * @param   b  The other format
+ * @return     1 if the formats are identical, 0 otherwise
+ */
+#ifdef __GNUC__
+__attribute__((__pure__))
+#endif
+int fb_same_format(const fb_format_t *restrict a, const fb_format_t *restrict b);
+
+/**
+ * Construct an sRGB colour in a framebuffer's pixel format
+ * to use when specifying colours
  * 
+ * @param   fb     The framebuffer
  * @param   red    The red   component from [0, 255] sRGB
  * @param   green  The green component from [0, 255] sRGB
  * @param   blue   The blue  component from [0, 255] sRGB
  * @return         The colour as one 32-bit integer
  */
 #ifdef __GNUC__
-__attribute__((__const__))
+__attribute__((__pure__))
 #endif
-uint32_t fb_colour(int red, int green, int blue);
+uint32_t fb_colour(const framebuffer_t *restrict fb, int red, int green, int blue);
 
 /**
  * Print a filled in rectangle to a framebuffer
@@ -256,6 +1193,117 @@ void fb_draw_horizontal_line(framebuffer_t *restrict fb, uint32_t colour, uint32
  */
 void fb_draw_vertical_line(framebuffer_t *restrict fb, uint32_t colour, uint32_t x, uint32_t y, uint32_t length);
 
+/**
+ * Draw a tile repeatedly down a framebuffer
+ * 
+ * @param  fb      The framebuffer
+ * @param  tile    The tile, as returned by `tile_get` for `fb`
+ * @param  y       The line on which to draw the first line of the tile
+ * @param  height  The number of lines to draw, the tile starts
+ *                 over after each `tile->height` lines
+ */
+void fb_draw_tile(framebuffer_t *restrict fb, const framebuffer_t *restrict tile, uint32_t y, uint32_t height);
+
+/**
+ * Mark an area of a framebuffer as changed so that
+ * it is copied to the display on the next flush
+ * 
+ * @param  fb      The framebuffer
+ * @param  x       The starting pixel on the X axis for the area
+ * @param  y       The starting pixel on the Y axis for the area
+ * @param  width   The width of the area, in pixels
+ * @param  height  The height of the area, in pixels
+ */
+void fb_damage(framebuffer_t *restrict fb, uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+
+/**
+ * Copy all changed areas of a framebuffer to the display
+ * 
+ * @param  fb  The framebuffer
+ */
+void fb_flush(framebuffer_t *restrict fb);
+
+/**
+ * Show what has been flushed to a framebuffer, and mark
+ * the framebuffer as unchanged
+ * 
+ * For a double-buffered framebuffer, this waits for the
+ * vertical blank and pans the display to the back buffer,
+ * which then becomes the front buffer; the changed areas are
+ * kept so that they are copied to the new back buffer by the
+ * next flush. If the driver cannot pan, the framebuffer falls
+ * back to a single buffer.
+ * 
+ * @param  fb  The framebuffer
+ */
+void fb_present(framebuffer_t *restrict fb);
+
+/**
+ * Copy the changed areas within a band of lines of a framebuffer
+ * to the display, without marking them as unchanged, applying
+ * the framebuffer's colour lookup table if it has one
+ * 
+ * @param  fb      The framebuffer
+ * @param  y       The first line in the band
+ * @param  height  The number of lines in the band
+ */
+void fb_flush_lines(const framebuffer_t *restrict fb, uint32_t y, uint32_t height);
+
+/**
+ * Write the contents of a framebuffer to a file as
+ * an 8-bit binary portable pixmap (PPM)
+ * 
+ * @param   fb    The framebuffer
+ * @param   path  The file to write
+ * @return        Zero on success, -1 on error
+ */
+int fb_dump_ppm(const framebuffer_t *restrict fb, const char *restrict path);
+
+/**
+ * Calculate a fast, non-cryptographic, hash of the
+ * visible pixels of a framebuffer
+ * 
+ * The hash only depends on the pixels, not on the padding
+ * at the end of each line, so it can be used to compare
+ * renderings of the same size and pixel format
+ * 
+ * @param   fb  The framebuffer
+ * @return      The hash
+ */
+#ifdef __GNUC__
+__attribute__((__pure__))
+#endif
+uint64_t fb_hash(const framebuffer_t *restrict fb);
+
+/**
+ * Clip an area to the part of a framebuffer that may be drawn on
+ * 
+ * @param   fb      The framebuffer
+ * @param   x       The starting pixel on the X axis for the area, will be updated
+ * @param   y       The starting pixel on the Y axis for the area, will be updated
+ * @param   width   The width of the area, in pixels, will be updated
+ * @param   height  The height of the area, in pixels, will be updated
+ * @return          0 if nothing of the area remains, 1 otherwise
+ */
+static inline int
+fb_clip(const framebuffer_t *restrict fb, uint32_t *restrict x, uint32_t *restrict y,
+        uint32_t *restrict width, uint32_t *restrict height)
+{
+	if (*x >= fb->width || *y >= fb->clip_bottom || !*width || !*height)
+		return 0;
+	if (*y < fb->clip_top) {
+		if (*height <= fb->clip_top - *y)
+			return 0;
+		*height -= fb->clip_top - *y;
+		*y = fb->clip_top;
+	}
+	if (*width > fb->width - *x)
+		*width = fb->width - *x;
+	if (*height > fb->clip_bottom - *y)
+		*height = fb->clip_bottom - *y;
+	return 1;
+}
+
 /**
  * Draw a single on a framebuffer
  * 
@@ -267,12 +1315,113 @@ void fb_draw_vertical_line(framebuffer_t *restrict fb, uint32_t colour, uint32_t
 static inline void
 fb_draw_pixel(framebuffer_t *restrict fb, uint32_t colour, uint32_t x, uint32_t y)
 {
-	int8_t *mem = fb->mem + y * fb->line_length + x * fb->bytes_per_pixel;
-	*(uint32_t *)mem = colour;
+	if (x >= fb->width || y < fb->clip_top || y >= fb->clip_bottom)
+		return;
+	fb->fill_row(fb->mem + y * fb->line_length + x * fb->bytes_per_pixel, colour, 1);
+	fb_damage(fb, x, y, 1, 1);
 }
 
 
 
+/***** scene.c *****/
+
+/**
+ * Draw a list of rectangles on a framebuffer, with later
+ * rectangles on top of earlier rectangles
+ * 
+ * The rectangles are split at every horizontal and vertical edge
+ * into bands of lines with the same runs of colours, so that each
+ * pixel is written once, and only the first line of a band is filled,
+ * the other lines in the band are copies of it
+ * 
+ * @param  fb     The framebuffer
+ * @param  rects  The rectangles, bottom-most first
+ * @param  n      The number of elements in `rects`
+ */
+void scene_draw(framebuffer_t *restrict fb, const scene_rect_t *restrict rects, size_t n);
+
+
+
+/***** tile.c *****/
+
+/**
+ * Look up a tile in the cache, or allocate a new tile
+ * 
+ * The tile is described by `view`, which is a framebuffer
+ * whose memory is the tile's pixels and whose height is the
+ * number of lines in the tile. `view` can be drawn on using
+ * the regular framebuffer functions, and passed to `fb_draw_tile`.
+ * The tile remains valid until `tile_unpin` is called.
+ * 
+ * @param   fb         The framebuffer the tile will be drawn on
+ * @param   pattern    Non-zero identifier for the pattern
+ * @param   parameter  Pattern-specific parameter the tile depends on
+ * @param   rows       The number of lines in the tile
+ * @param   view       Output parameter for the tile
+ * @return             1 if the tile was cached, 0 if it was allocated
+ *                     and must be rendered by the caller, -1 on error
+ */
+int tile_get(const framebuffer_t *restrict fb, int pattern, uint32_t parameter,
+             uint32_t rows, framebuffer_t *restrict view);
+
+/**
+ * Allow all tiles returned by `tile_get` to be evicted
+ */
+void tile_unpin(void);
+
+/**
+ * Release all cached tiles
+ */
+void tile_clear(void);
+
+
+
+/***** pool.c *****/
+
+/**
+ * Configure the worker thread pool, the threads are
+ * started the first time they are needed
+ * 
+ * @param  threads  The number of threads to run jobs on,
+ *                  including the calling thread, 1 to run
+ *                  all jobs serially
+ */
+void pool_init(size_t threads);
+
+/**
+ * Stop the worker threads
+ */
+void pool_destroy(void);
+
+/**
+ * Run jobs on the worker threads and the calling
+ * thread, and wait for all of them to complete
+ * 
+ * @param  jobs  The number of jobs
+ * @param  func  Function to call for each job
+ * @param  data  Argument for `func`
+ */
+void pool_run(size_t jobs, pool_func_t *func, void *data);
+
+/**
+ * Redraw framebuffers, split into horizontal bands that
+ * are drawn in parallel, and flush them to the displays
+ * 
+ * The function is called once per band with a copy of the
+ * framebuffer that is clipped to the band. It must redraw
+ * the entire band, as the entire framebuffer is flushed.
+ * 
+ * @param  draw      Function that draws a band of a framebuffer, `NULL`
+ *                   to only flush the framebuffers again, for example
+ *                   after their colour lookup tables have changed
+ * @param  data      Argument for `draw`
+ * @param  selected  For each framebuffer, whether to draw it,
+ *                   `NULL` to draw all framebuffers
+ */
+void pool_draw(fb_draw_func_t *draw, void *data, const unsigned char *restrict selected);
+
+
+
 /***** state.c ******/
 
 /**
@@ -320,6 +1469,34 @@ extern double *restrict gammas[3];
  */
 extern size_t crtc_count;
 
+/**
+ * For each connected CRT controller, the channels whose settings have
+ * changed since its gamma ramps were last applied, as a bit mask
+ * where bit 0 is red, bit 1 is green, and bit 2 is blue
+ */
+extern unsigned char *restrict calibs_dirty;
+
+/**
+ * The worst residual of the analysed calibrations, see `gamma_fit`
+ */
+extern double calibs_residual;
+
+/**
+ * How long it took to analyse the calibrations, in nanoseconds
+ */
+extern unsigned long long int calibs_analyse_ns;
+
+/**
+ * The value of `drm_calls` when video control had been acquired
+ */
+extern unsigned long long int drm_startup_calls;
+
+/**
+ * The index in `framebuffers` of the framebuffer that each connected
+ * CRT controller shows, `framebuffer_count` if not known
+ */
+extern size_t *restrict crtc_framebuffers;
+
 /**
  * Acquire video control
  * 
@@ -332,10 +1509,94 @@ int acquire_video(void);
  */
 void release_video(void);
 
+/**
+ * Change a calibration setting, and mark the channel
+ * as changed if the value is different
+ * 
+ * @param  settings  `brightnesses`, `contrasts`, or `gammas`
+ * @param  crtc      The index of the CRT controller in `crtcs`
+ * @param  channel   The channel, 0 for red, 1 for green, 2 for blue
+ * @param  value     The new value of the setting
+ */
+void set_calib(double *restrict settings[3], size_t crtc, size_t channel, double value);
+
+/**
+ * Mark all channels on all CRT controllers as changed, so that
+ * all gamma ramps are generated and applied the next time
+ */
+void mark_calibs_dirty(void);
+
+/**
+ * Select the framebuffers that show a CRT controller
+ * 
+ * Framebuffers that are not known to be shown by any CRT controller
+ * are always selected, and if it is not known which framebuffer
+ * shows the CRT controller, all framebuffers are selected
+ * 
+ * @param  crtc      The index of the CRT controller in `crtcs`
+ * @param  selected  Output parameter, for each framebuffer, whether it is selected
+ */
+void select_framebuffers(size_t crtc, unsigned char *restrict selected);
+
+/**
+ * Apply the gamma ramps of a CRT controller
+ * 
+ * If the CRT controller has no gamma ramps, the ramps are instead
+ * applied in software to the framebuffer that shows it, but only
+ * if it is known which framebuffer that is and no other CRT
+ * controller shows it, and only if the framebuffer's pixel
+ * format is supported; otherwise nothing is done
+ * 
+ * @param   crtc   The index of the CRT controller in `crtcs`
+ * @param   flush  Output parameter, for each framebuffer, set to 1
+ *                 if it must be flushed again for the change to
+ *                 show, `NULL` to flush it immediately
+ * @return         Zero on success, -1 on error
+ */
+int set_gamma(size_t crtc, unsigned char *restrict flush);
+
+/**
+ * Apply the gamma ramps of multiple CRT controllers, with one
+ * atomic commit per graphics card where that is supported
+ * 
+ * Framebuffers that get new gamma ramps in software are
+ * flushed again once, after all ramps have been applied
+ * 
+ * @param   selected  For each CRT controller, whether to apply its
+ *                    gamma ramps, `NULL` to apply all of them
+ * @return            Zero on success, -1 on error
+ */
+int set_gammas(const unsigned char *restrict selected);
+
+/**
+ * Print performance statistics to standard error, if
+ * requested with the `CRT_CALIBRATOR_STATS` environment variable
+ */
+void report_stats(void);
+
+/**
+ * Get the current time
+ * 
+ * @return  The current time, in nanoseconds, on the monotonic clock
+ */
+static inline unsigned long long int
+clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long int)ts.tv_sec * 1000000000ULL + (unsigned long long int)ts.tv_nsec;
+}
+
 
 
 /***** drmgamma.c ******/
 
+/**
+ * The number of calls to libdrm functions that talk
+ * to the kernel, each is one or a few ioctls
+ */
+extern unsigned long long int drm_calls;
+
 /**
  * Figure out how many graphics cards there are on the system
  * 
@@ -379,6 +1640,8 @@ void drm_crtc_close(drm_crtc_t *restrict crtc);
 /**
  * Read the gamma ramps for a CRT controller
  * 
+ * Does nothing if the CRT controller has no gamma ramps
+ * 
  * @param   crtc  CRT controller information
  * @return        Zero on success, -1 on error 
  */
@@ -387,7 +1650,39 @@ int drm_get_gamma(drm_crtc_t *restrict crtc);
 /**
  * Apply gamma ramps for a CRT controller
  * 
+ * Does nothing if the CRT controller has no gamma
+ * ramps, use `set_gamma` to apply them in software
+ * 
  * @param   crtc  CRT controller information
  * @return        Zero on success, -1 on error
  */
 int drm_set_gamma(drm_crtc_t *restrict crtc);
+
+/**
+ * Queue gamma ramps for a CRT controller, to be applied together
+ * with the other CRT controllers on the graphics card by
+ * `drm_commit_gamma`
+ * 
+ * If the graphics card does not support atomic commits, the
+ * gamma ramps are applied immediately instead. Does nothing
+ * if the CRT controller has no gamma ramps, or if the gamma
+ * ramps have not changed since they were last committed
+ * 
+ * @param   crtc  CRT controller information
+ * @return        Zero on success, -1 on error
+ */
+int drm_queue_gamma(drm_crtc_t *restrict crtc);
+
+/**
+ * Apply the queued gamma ramps of a graphics
+ * card's CRT controllers in one atomic commit
+ * 
+ * If the driver rejects the commit, the legacy interface
+ * is used for the graphics card from then on, and the
+ * gamma ramps are applied with it instead; on other
+ * errors, the queued gamma ramps are discarded
+ * 
+ * @param   card  The graphics card information
+ * @return        Zero on success, -1 on error
+ */
+int drm_commit_gamma(drm_card_t *restrict card);
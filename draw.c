@@ -0,0 +1,474 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+/**
+ * Render the bars used for calibrating the contrast
+ * and brightness, used as `fb_draw_func_t`
+ * 
+ * @param  fb     The framebuffer
+ * @param  index  Not used
+ * @param  data   Not used
+ */
+static void
+render_contrast_brightness(framebuffer_t *restrict fb, size_t index, void *data)
+{
+	const int CONTRAST_BRIGHTNESS_LEVELS[21] = {
+		0, 17, 27, 38, 48, 59, 70, 82, 94, 106, 119, 131,
+		144, 158, 171, 185, 198, 212, 226, 241, 255
+	};
+	scene_rect_t rects[4 * 21], *restrict rect = rects;
+	uint32_t xs[21 + 1], ys[4 + 1];
+	uint32_t y, x;
+	int v;
+
+	(void) index;
+	(void) data;
+
+	for (x = 0; x <= 21; x++)
+		xs[x] = x * fb->width / 21;
+	for (y = 0; y <= 4; y++)
+		ys[y] = y * fb->height / 4;
+	for (y = 0; y < 4; y++) {
+		for (x = 0; x < 21; x++, rect++) {
+			v = CONTRAST_BRIGHTNESS_LEVELS[x];
+			rect->colour = fb_colour(fb, v * ((y == 1) | (y == 0)),
+			                             v * ((y == 2) | (y == 0)),
+			                             v * ((y == 3) | (y == 0)));
+			rect->x      = xs[x];
+			rect->y      = ys[y];
+			rect->width  = xs[x + 1] - xs[x];
+			rect->height = ys[y + 1] - ys[y];
+		}
+	}
+	scene_draw(fb, rects, sizeof(rects) / sizeof(*rects));
+}
+
+
+/**
+ * Draw bars in different shades of grey, red, green and blue
+ * used for calibrating the contrast and brightness
+ */
+void
+draw_contrast_brightness(void)
+{
+	pool_draw(render_contrast_brightness, NULL, NULL);
+}
+
+
+/**
+ * Draw a seven segment display
+ *
+ * @param  fb      The framebuffer to draw on
+ * @param  colour  The intensity of the least intense colour to use
+ * @param  x       The X component of the top left corner of the seven segment display
+ * @param  y       The Y component of the top left corner of the seven segment display
+ */
+static void
+draw_digit(framebuffer_t *restrict fb, int colour, uint32_t x, uint32_t y)
+{
+	uint32_t c;
+
+	c = fb_colour(fb, colour + 0, colour + 0, colour + 0);
+	fb_fill_rectangle(fb, c, x + 20, y, 80, 20);
+
+	c = fb_colour(fb, colour + 1, colour + 1, colour + 1);
+	fb_fill_rectangle(fb, c, x, y + 20, 20, 80);
+
+	c = fb_colour(fb, colour + 2, colour + 2, colour + 2);
+	fb_fill_rectangle(fb, c, x + 100, y + 20, 20, 80);
+
+	c = fb_colour(fb, colour + 3, colour + 3, colour + 3);
+	fb_fill_rectangle(fb, c, x + 20, y + 100, 80, 20);
+
+	c = fb_colour(fb, colour + 4, colour + 4, colour + 4);
+	fb_fill_rectangle(fb, c, x, y + 120, 20, 80);
+
+	c = fb_colour(fb, colour + 5, colour + 5, colour + 5);
+	fb_fill_rectangle(fb, c, x + 100, y + 120, 20, 80);
+
+	c = fb_colour(fb, colour + 6, colour + 6, colour + 6);
+	fb_fill_rectangle(fb, c, x + 20, y + 200, 80, 20);
+}
+
+
+/**
+ * Manipulate a CRT controllers gamma ramps to display a specific digit
+ * for one of the seven segment display on only that CRT controller's
+ * monitors
+ * 
+ * @param  crtc    The CRT controller information
+ * @param  colour  The intensity of the least intense colour in the seven segment display
+ * @param  value   The valud of the digit to display
+ */
+static void
+gamma_digit(drm_crtc_t *restrict crtc, int colour, size_t value)
+{
+#define __  0
+	const int DIGITS[11] = { 1  | 2  | 4  | __ | 16 | 32 | 64,  /* (0) */
+	                         __ | __ | 4  | __ | __ | 32 | __,  /* (1) */
+	                         1  | __ | 4  | 8  | 16 | __ | 64,  /* (2) */
+	                         1  | __ | 4  | 8  | __ | 32 | 64,  /* (3) */
+	                         __ | 2  | 4  | 8  | __ | 32 | __,  /* (4) */
+	                         1  | 2  | __ | 8  | __ | 32 | 64,  /* (5) */
+	                         1  | 2  | __ | 8  | 16 | 32 | 64,  /* (6) */
+	                         1  | __ | 4  | __ | __ | 32 | __,  /* (7) */
+	                         1  | 2  | 4  | 8  | 16 | 32 | 64,  /* (8) */
+	                         1  | 2  | 4  | 8  | __ | 32 | 64,  /* (9) */
+	                         __ | __ | __ | __ | __ | __ | __}; /* not visible */
+#undef __
+	int i, j, digit = DIGITS[value];
+	uint16_t c;
+  
+	for (i = 0; i < 7; i++) {
+		c = (digit & (1 << i)) ? 0xFFFF : 0;
+		j = i + colour;
+		crtc->red[j] = crtc->green[j] = crtc->blue[j] = c;
+	}
+}
+
+
+/**
+ * Render the seven segment displays used to show the
+ * monitors' indices, used as `fb_draw_func_t`
+ * 
+ * @param  fb     The framebuffer
+ * @param  index  Not used
+ * @param  data   Not used
+ */
+static void
+render_id(framebuffer_t *restrict fb, size_t index, void *data)
+{
+	(void) index;
+	(void) data;
+	fb_fill_rectangle(fb, fb_colour(fb, 0, 0, 0), 0, 0, fb->width, fb->height);
+	draw_digit(fb, 1, 40, 40);
+	draw_digit(fb, 8, 180, 40);
+}
+
+
+/**
+ * Draw an unique index on each monitor
+ * 
+ * @return  Zero on success, -1 on error
+ */
+int
+draw_id(void)
+{
+	size_t c, id = 0;
+	drm_crtc_t *restrict crtc;
+	pool_draw(render_id, NULL, NULL);
+	for (c = 0; c < crtc_count; c++) {
+		crtc = &crtcs[c];
+		if (drm_get_gamma(crtc) < 0)
+			return -1;
+		gamma_digit(crtc, 1, id < 10 ? 10 : (id / 10) % 10);
+		gamma_digit(crtc, 8,                (id /  1) % 10);
+		id++;
+	}
+	return set_gammas(NULL);
+}
+
+
+/**
+ * Fill in a rectangle for a scene
+ * 
+ * @param  rect    The rectangle to fill in
+ * @param  colour  The colour of the rectangle
+ * @param  x       The starting pixel on the X axis for the rectangle
+ * @param  y       The starting pixel on the Y axis for the rectangle
+ * @param  width   The width of the rectangle, in pixels
+ * @param  height  The height of the rectangle, in pixels
+ */
+static void
+set_rect(scene_rect_t *restrict rect, uint32_t colour, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+	rect->colour = colour;
+	rect->x      = x;
+	rect->y      = y;
+	rect->width  = width;
+	rect->height = height;
+}
+
+
+/**
+ * Render the squares used as reference when tweeking
+ * the gamma correction, used as `fb_draw_func_t`
+ * 
+ * @param  fb     The framebuffer
+ * @param  index  Not used
+ * @param  data   Not used
+ */
+static void
+render_gamma(framebuffer_t *restrict fb, size_t index, void *data)
+{
+	scene_rect_t rects[4 * (6 + 200)], *restrict rect = rects;
+	uint32_t x, y, background, average, high, low, xoff;
+	int r, g, b;
+	(void) index;
+	(void) data;
+	for (x = 0; x < 4; x++) {
+		r = (x == 1) || (x == 0);
+		g = (x == 2) || (x == 0);
+		b = (x == 3) || (x == 0);
+		background = fb_colour(fb, 128 * r, 128 * g, 128 * b);
+		average    = fb_colour(fb, 188 * r, 188 * g, 188 * b);
+		high       = fb_colour(fb, 255 * r, 255 * g, 255 * b);
+		low        = fb_colour(fb, 0, 0, 0);
+		xoff = x * fb->width / 4;
+		set_rect(rect++, background, xoff, 0, fb->width / 4, fb->height);
+		xoff += (fb->width / 4 - 200) / 2;
+		set_rect(rect++, high, xoff, 40, 200, 200);
+		set_rect(rect++, average, xoff + 50, 40, 100, 200);
+		set_rect(rect++, average, xoff, 280, 200, 200);
+		for (y = 0; y < 200; y += 2) {
+			set_rect(rect++, high, xoff + 50, 280 + y + 0, 100, 1);
+			set_rect(rect++, low , xoff + 50, 280 + y + 1, 100, 1);
+		}
+		set_rect(rect++, average, xoff, 520, 200, 200);
+		set_rect(rect++, high, xoff + 50, 520, 100, 200);
+	}
+	scene_draw(fb, rects, (size_t)(rect - rects));
+}
+
+
+/**
+ * Draw squares used as reference when tweeking the gamma correction
+ */
+void
+draw_gamma(void)
+{
+	pool_draw(render_gamma, NULL, NULL);
+}
+
+
+/**
+ * Identifiers for patterns that are cached with `tile_get`
+ */
+enum {
+	TILE_CONVERGENCE = 1,
+	TILE_MOIRE
+};
+
+
+/**
+ * Parameters for `render_moire`
+ */
+struct moire
+{
+	/**
+	 * The horizontal and vertical gap, in pixels, between the dots
+	 */
+	uint32_t gap;
+
+	/**
+	 * Whether to draw dots in a diagonal pattern
+	 */
+	int diagonal;
+
+	/**
+	 * The rendered tile for each framebuffer, `mem` is `NULL`
+	 * for framebuffers without a tile, `NULL` if none has
+	 */
+	framebuffer_t *tiles;
+};
+
+
+/**
+ * Get the first multiple of a number that is not less than another number
+ * 
+ * @param   y    The lower bound
+ * @param   gap  The number to get a multiple of
+ * @return       The least multiple of `gap` that is not less than `y`
+ */
+static uint32_t
+align_up(uint32_t y, uint32_t gap)
+{
+	return y + (gap - y % gap) % gap;
+}
+
+
+/**
+ * Draw the dots on one line of the pattern used when
+ * calibrating the convergence
+ * 
+ * @param  fb     The framebuffer or tile to render on
+ * @param  white  The colour of the dots
+ * @param  y      The line
+ */
+static void
+render_convergence_line(framebuffer_t *restrict fb, uint32_t white, uint32_t y)
+{
+	uint32_t x;
+	for (x = 0; x <= fb->width; x += 16) {
+		if (x == fb->width)
+			x = fb->width - 1;
+		fb_draw_pixel(fb, white, x, y);
+	}
+}
+
+
+/**
+ * Render the pattern used when calibrating the convergence,
+ * except for the extra line at the bottom
+ * 
+ * @param  fb  The framebuffer or tile to render on
+ */
+static void
+render_convergence_dots(framebuffer_t *restrict fb)
+{
+	uint32_t black = fb_colour(fb, 0, 0, 0);
+	uint32_t white = fb_colour(fb, 255, 255, 255);
+	uint32_t y;
+	fb_fill_rectangle(fb, black, 0, 0, fb->width, fb->height);
+	for (y = align_up(fb->clip_top, 16); y < fb->clip_bottom; y += 16)
+		render_convergence_line(fb, white, y);
+}
+
+
+/**
+ * Render the pattern used when calibrating the
+ * convergence, used as `fb_draw_func_t`
+ * 
+ * @param  fb     The framebuffer
+ * @param  index  The index of the framebuffer
+ * @param  data   The tile for each framebuffer, `framebuffer_t *`,
+ *                see `struct moire`.tiles
+ */
+static void
+render_convergence(framebuffer_t *restrict fb, size_t index, void *data)
+{
+	framebuffer_t *restrict tiles = data;
+	int tiled = tiles && tiles[index].mem;
+	if (tiled)
+		fb_draw_tile(fb, &tiles[index], 0, fb->height);
+	else
+		render_convergence_dots(fb);
+	/* The bottom line gets dots too if the last period ends on it. */
+	if (fb->height && !(fb->height % 16)) {
+		if (tiled)
+			fb_draw_tile(fb, &tiles[index], fb->height - 1, 1);
+		else
+			render_convergence_line(fb, fb_colour(fb, 255, 255, 255), fb->height - 1);
+	}
+}
+
+
+/**
+ * Print a pattern on the screen that can be used when
+ * calibrating the convergence
+ * 
+ * The pattern repeats every 16 lines, so only that many lines
+ * are rendered, the rest of the screen is copied from them
+ */
+void
+draw_convergence(void)
+{
+	framebuffer_t *restrict tiles = malloc(framebuffer_count * sizeof(*tiles));
+	size_t f;
+	for (f = 0; tiles && f < framebuffer_count; f++) {
+		switch (tile_get(&framebuffers[f], TILE_CONVERGENCE, 0, 16, &tiles[f])) {
+		case 0:
+			render_convergence_dots(&tiles[f]);
+			break;
+		case 1:
+			break;
+		default:
+			tiles[f].mem = NULL;
+			break;
+		}
+	}
+	pool_draw(render_convergence, tiles, NULL);
+	tile_unpin();
+	free(tiles);
+}
+
+
+/**
+ * Render the pattern used when calibrating the moiré cancellation
+ * 
+ * @param  fb        The framebuffer or tile to render on
+ * @param  gap       The horizontal and vertical gap, in pixels, between the dots
+ * @param  diagonal  Whether to draw dots in a diagonal pattern
+ */
+static void
+render_moire_dots(framebuffer_t *restrict fb, uint32_t gap, int diagonal)
+{
+	uint32_t black = fb_colour(fb, 0, 0, 0);
+	uint32_t white = fb_colour(fb, 255, 255, 255);
+	uint32_t x, y, gap2 = gap << 1;
+	gap += (uint32_t)!diagonal;
+	fb_fill_rectangle(fb, black, 0, 0, fb->width, fb->height);
+	if (diagonal) {
+		for (y = align_up(fb->clip_top, gap); y < fb->clip_bottom; y += gap)
+			for (x = (y % gap2); x < fb->width; x += gap2)
+				fb_draw_pixel(fb, white, x, y);
+	} else {
+		for (y = align_up(fb->clip_top, gap); y < fb->clip_bottom; y += gap)
+			for (x = 0; x < fb->width; x += gap)
+				fb_draw_pixel(fb, white, x, y);
+	}
+}
+
+
+/**
+ * Render the pattern used when calibrating the moiré
+ * cancellation, used as `fb_draw_func_t`
+ * 
+ * @param  fb     The framebuffer
+ * @param  index  The index of the framebuffer
+ * @param  data   The pattern's parameters, `struct moire *`
+ */
+static void
+render_moire(framebuffer_t *restrict fb, size_t index, void *data)
+{
+	struct moire *restrict moire = data;
+	if (moire->tiles && moire->tiles[index].mem)
+		fb_draw_tile(fb, &moire->tiles[index], 0, fb->height);
+	else
+		render_moire_dots(fb, moire->gap, moire->diagonal);
+}
+
+
+/**
+ * Print a pattern on the screen that can be used when
+ * calibrating the moiré cancellation
+ * 
+ * The pattern repeats every `gap * 2` lines if `diagonal`,
+ * otherwise every `gap + 1` lines, so only that many lines
+ * are rendered, the rest of the screen is copied from them
+ * 
+ * @param  gap       The horizontal and vertical gap, in pixels, between the dots
+ * @param  diagonal  Whether to draw dots in a diagonal pattern
+ * @param  selected  For each framebuffer, whether to draw the pattern
+ *                   on it, `NULL` to draw it on all framebuffers
+ */
+void
+draw_moire(uint32_t gap, int diagonal, const unsigned char *restrict selected)
+{
+	uint32_t rows = diagonal ? gap << 1 : gap + 1;
+	struct moire moire;
+	size_t f;
+	moire.gap = gap;
+	moire.diagonal = diagonal;
+	moire.tiles = malloc(framebuffer_count * sizeof(*moire.tiles));
+	for (f = 0; moire.tiles && f < framebuffer_count; f++) {
+		if (selected && !selected[f]) {
+			moire.tiles[f].mem = NULL;
+			continue;
+		}
+		switch (tile_get(&framebuffers[f], TILE_MOIRE, (gap << 1) | (uint32_t)!!diagonal, rows, &moire.tiles[f])) {
+		case 0:
+			render_moire_dots(&moire.tiles[f], gap, diagonal);
+			break;
+		case 1:
+			break;
+		default:
+			moire.tiles[f].mem = NULL;
+			break;
+		}
+	}
+	pool_draw(render_moire, &moire, selected);
+	tile_unpin();
+	free(moire.tiles);
+}
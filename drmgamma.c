@@ -2,11 +2,52 @@
 #include "common.h"
 
 
+/**
+ * The number of stops on the gamma ramps for
+ * CRT controllers that have no gamma ramps
+ */
+#ifndef DRM_SOFTWARE_GAMMA_STOPS
+# define DRM_SOFTWARE_GAMMA_STOPS  256
+#endif
+
+
+/**
+ * The directory with the graphics cards' device files
+ */
+#ifndef DRM_CARD_DIR
+# define DRM_CARD_DIR  DRM_DIR_NAME
+#endif
+
+
+/**
+ * If set to a non-empty value other than 0, gamma ramps are
+ * applied with the legacy interface even if the graphics
+ * card supports atomic commits
+ */
+#ifndef DRM_LEGACY_GAMMA_ENV
+# define DRM_LEGACY_GAMMA_ENV  "CRT_CALIBRATOR_LEGACY_GAMMA"
+#endif
+
+
 /**
  * The number of elements to allocates to a buffer for a DRM device pathname
  */
 #define DRM_DEV_NAME_MAX_LEN\
-	((sizeof(DRM_DEV_NAME) + sizeof(DRM_DIR_NAME)) / sizeof(char) + 3 * sizeof(int))
+	((sizeof(DRM_DEV_NAME) + sizeof(DRM_CARD_DIR)) / sizeof(char) + 3 * sizeof(int))
+
+/**
+ * Call a libdrm function that talks to the
+ * kernel, and count the call in `drm_calls`
+ */
+#define DRM_CALL(CALL)  (drm_calls++, (CALL))
+
+
+
+/**
+ * The number of calls to libdrm functions that talk
+ * to the kernel, each is one or a few ioctls
+ */
+unsigned long long int drm_calls = 0;
 
 
 
@@ -21,7 +62,7 @@ drm_card_count(void)
 	char buf[DRM_DEV_NAME_MAX_LEN];
 	size_t count = 0;
 	for (;; count++) {
-		sprintf(buf, DRM_DEV_NAME, DRM_DIR_NAME, (int)count);
+		sprintf(buf, DRM_DEV_NAME, DRM_CARD_DIR, (int)count);
 		if (access(buf, F_OK) < 0)
 			return count;
 	}
@@ -38,6 +79,7 @@ int
 drm_card_open(size_t index, drm_card_t *restrict card)
 {
 	char buf[DRM_DEV_NAME_MAX_LEN];
+	const char *env = getenv(DRM_LEGACY_GAMMA_ENV);
 	int old_errno;
 	size_t i, n;
 
@@ -46,13 +88,21 @@ drm_card_open(size_t index, drm_card_t *restrict card)
 	card->connectors = NULL;
 	card->encoders = NULL;
 	card->connector_count = 0;
-
-	sprintf(buf, DRM_DEV_NAME, DRM_DIR_NAME, (int)index);
+	card->atomic = 0;
+	card->crtc_props_resolved = 0;
+	card->gamma_lut_prop = 0;
+	card->gamma_lut_size_prop = 0;
+	card->edid_prop = 0;
+	card->request = NULL;
+	card->queued = NULL;
+	card->queued_count = 0;
+
+	sprintf(buf, DRM_DEV_NAME, DRM_CARD_DIR, (int)index);
 	card->fd = open(buf, O_RDWR);
 	if (card->fd < 0)
 		goto fail;
 
-	card->res = drmModeGetResources(card->fd);
+	card->res = DRM_CALL(drmModeGetResources(card->fd));
 	if (!card->res)
 		goto fail;
 
@@ -60,6 +110,12 @@ drm_card_open(size_t index, drm_card_t *restrict card)
 	card->connector_count = (size_t)(card->res->count_connectors);
 	n = card->connector_count;
 
+	card->queued = calloc(card->crtc_count + 1, sizeof(*card->queued));
+	if (!card->queued)
+		goto fail;
+	if (!env || !*env || !strcmp(env, "0"))
+		card->atomic = !DRM_CALL(drmSetClientCap(card->fd, DRM_CLIENT_CAP_ATOMIC, 1));
+
 	card->connectors = calloc(n, sizeof(drmModeConnector*));
 	if (!card->connectors)
 		goto fail;
@@ -68,12 +124,12 @@ drm_card_open(size_t index, drm_card_t *restrict card)
 		goto fail;
 
 	for (i = 0; i < n; i++) {
-		card->connectors[i] = drmModeGetConnector(card->fd, card->res->connectors[i]);
+		card->connectors[i] = DRM_CALL(drmModeGetConnector(card->fd, card->res->connectors[i]));
 		if (!card->connectors[i])
 			goto fail;
 
 		if (card->connectors[i]->encoder_id) {
-			card->encoders[i] = drmModeGetEncoder(card->fd, card->connectors[i]->encoder_id);
+			card->encoders[i] = DRM_CALL(drmModeGetEncoder(card->fd, card->connectors[i]->encoder_id));
 			if (!card->encoders[i])
 				goto fail;
 		}
@@ -98,6 +154,18 @@ drm_card_close(drm_card_t *restrict card)
 {
 	size_t i, n = card->connector_count;
 
+	if (card->request) {
+		for (i = 0; i < card->queued_count; i++) {
+			DRM_CALL(drmModeDestroyPropertyBlob(card->fd, card->queued[i]->queued_blob));
+			card->queued[i]->queued_blob = 0;
+		}
+		drmModeAtomicFree(card->request);
+		card->request = NULL;
+	}
+	free(card->queued);
+	card->queued = NULL;
+	card->queued_count = 0;
+
 	if (card->encoders) {
 		for (i = 0; i < n; i++)
 			if (card->encoders[i])
@@ -125,6 +193,73 @@ drm_card_close(drm_card_t *restrict card)
 }
 
 
+/**
+ * Look up the identifiers of the properties of the CRT
+ * controllers on a graphics card that are used to apply gamma
+ * ramps with atomic commits, the identifiers are the same for
+ * all CRT controllers on the graphics card, so this is only
+ * done for the first one
+ * 
+ * @param  card   The graphics card information
+ * @param  props  The properties of one of the graphics card's CRT controllers
+ */
+static void
+drm_resolve_crtc_props(drm_card_t *restrict card, const drmModeObjectProperties *restrict props)
+{
+	drmModePropertyRes *restrict prop;
+	uint32_t i;
+
+	card->crtc_props_resolved = 1;
+	for (i = 0; i < props->count_props; i++) {
+		prop = DRM_CALL(drmModeGetProperty(card->fd, props->props[i]));
+		if (!prop)
+			continue;
+		if (!strcmp(prop->name, "GAMMA_LUT"))
+			card->gamma_lut_prop = prop->prop_id;
+		else if (!strcmp(prop->name, "GAMMA_LUT_SIZE"))
+			card->gamma_lut_size_prop = prop->prop_id;
+		drmModeFreeProperty(prop);
+	}
+}
+
+
+/**
+ * Check whether gamma ramps can be applied to a CRT controller with
+ * atomic commits, and if so, allocate `crtc->lut`
+ * 
+ * The legacy interface is used for CRT controllers whose `GAMMA_LUT`
+ * has a different number of stops than their legacy gamma ramps,
+ * as the gamma ramps are read with the legacy interface
+ * 
+ * @param   card  The graphics card information
+ * @param   crtc  CRT controller information
+ * @return        Zero on success, -1 on error
+ */
+static int
+drm_crtc_open_lut(drm_card_t *restrict card, drm_crtc_t *restrict crtc)
+{
+	drmModeObjectProperties *restrict props;
+	uint64_t lut_size = 0;
+	uint32_t i;
+
+	props = DRM_CALL(drmModeObjectGetProperties(card->fd, crtc->id, DRM_MODE_OBJECT_CRTC));
+	if (!props)
+		return 0;
+	if (!card->crtc_props_resolved)
+		drm_resolve_crtc_props(card, props);
+	if (card->gamma_lut_prop && card->gamma_lut_size_prop)
+		for (i = 0; i < props->count_props; i++)
+			if (props->props[i] == card->gamma_lut_size_prop)
+				lut_size = props->prop_values[i];
+	drmModeFreeObjectProperties(props);
+
+	if (lut_size != (uint64_t)crtc->gamma_stops)
+		return 0;
+	crtc->lut = malloc(2 * crtc->gamma_stops * sizeof(*crtc->lut));
+	return crtc->lut ? 0 : -1;
+}
+
+
 /**
  * Acquire access to a CRT controller
  * 
@@ -139,14 +274,17 @@ drm_crtc_open(size_t index, drm_card_t *restrict card, drm_crtc_t *restrict crtc
 	drmModePropertyRes *restrict prop;
 	drmModePropertyBlobRes *restrict blob;
 	drmModeCrtc *restrict info;
-	size_t i, j;
+	size_t i;
 	int old_errno;
-	unsigned char c;
 
 	crtc->edid  = NULL;
+	crtc->edid_size = 0;
 	crtc->red   = NULL;
 	crtc->green = NULL;
 	crtc->blue  = NULL;
+	crtc->lut   = NULL;
+	crtc->lut_blob    = 0;
+	crtc->queued_blob = 0;
 
 	crtc->id = card->res->crtcs[index];
 	crtc->card = card;
@@ -164,11 +302,19 @@ drm_crtc_open(size_t index, drm_card_t *restrict card, drm_crtc_t *restrict crtc
 
 	crtc->connected = crtc->connector && crtc->connector->connection == DRM_MODE_CONNECTED;
 
-	info = drmModeGetCrtc(card->fd, crtc->id);
+	info = DRM_CALL(drmModeGetCrtc(card->fd, crtc->id));
 	if (!info)
 		return -1;
 	crtc->gamma_stops = (size_t)info->gamma_size;
+	crtc->software_gamma = !crtc->gamma_stops;
+	crtc->mode_valid  = !!info->mode_valid;
+	crtc->x           = crtc->mode_valid ? info->x : 0;
+	crtc->y           = crtc->mode_valid ? info->y : 0;
+	crtc->width       = crtc->mode_valid ? info->mode.hdisplay : 0;
+	crtc->height      = crtc->mode_valid ? info->mode.vdisplay : 0;
 	drmModeFreeCrtc(info);
+	if (crtc->software_gamma)
+		crtc->gamma_stops = DRM_SOFTWARE_GAMMA_STOPS;
 
 	/* `calloc` is for some reason required when reading the gamma ramps. */
 	crtc->red = calloc(3 * crtc->gamma_stops, sizeof(uint16_t));
@@ -176,46 +322,51 @@ drm_crtc_open(size_t index, drm_card_t *restrict card, drm_crtc_t *restrict crtc
 		return -1;
 	crtc->green = crtc->red   + crtc->gamma_stops;
 	crtc->blue  = crtc->green + crtc->gamma_stops;
+	if (crtc->software_gamma)
+		for (i = 0; i < crtc->gamma_stops; i++)
+			crtc->red[i] = crtc->green[i] = crtc->blue[i] = (uint16_t)(i * 0xFFFF / (crtc->gamma_stops - 1));
+
+	if (card->atomic && !crtc->software_gamma && drm_crtc_open_lut(card, crtc) < 0) {
+		free(crtc->red);
+		crtc->red = NULL;
+		return -1;
+	}
 
 	if (!crtc->connector)
 		return 0;
-	for (i = 0; i < (size_t)crtc->connector->count_props; i++) {
-		prop = drmModeGetProperty(card->fd, crtc->connector->props[i]);
+	for (i = 0; !card->edid_prop && i < (size_t)crtc->connector->count_props; i++) {
+		prop = DRM_CALL(drmModeGetProperty(card->fd, crtc->connector->props[i]));
 		if (!prop)
 			continue;
+		if (!strcmp(prop->name, "EDID"))
+			card->edid_prop = prop->prop_id;
+		drmModeFreeProperty(prop);
+	}
+	for (i = 0; card->edid_prop && i < (size_t)crtc->connector->count_props; i++)
+		if (crtc->connector->props[i] == card->edid_prop)
+			break;
+	if (!card->edid_prop || i == (size_t)crtc->connector->count_props)
+		return 0;
 
-		if (strcmp(prop->name, "EDID"))
-			goto free_prop;
-
-		blob = drmModeGetPropertyBlob(card->fd, (uint32_t)crtc->connector->prop_values[i]);
-		i = (size_t)crtc->connector->count_props;
-		if (!blob || !blob->data)
-			goto free_blob;
-
-		crtc->edid = malloc((blob->length * 2 + 1) * sizeof(char));
+	blob = DRM_CALL(drmModeGetPropertyBlob(card->fd, (uint32_t)crtc->connector->prop_values[i]));
+	if (!blob)
+		return 0;
+	if (blob->data && blob->length) {
+		crtc->edid = malloc(blob->length);
 		if (!crtc->edid) {
 			old_errno = errno;
 			drmModeFreePropertyBlob(blob);
-			drmModeFreeProperty(prop);
 			free(crtc->red);
+			free(crtc->lut);
 			crtc->red = NULL;
+			crtc->lut = NULL;
 			errno = old_errno;
 			return -1;
 		}
-		for (j = 0; j < blob->length; j++) {
-			c = ((unsigned char *)blob->data)[j];
-			crtc->edid[j * 2 + 0] = "0123456789ABCDEF"[(c >> 4) & 15];
-			crtc->edid[j * 2 + 1] = "0123456789ABCDEF"[(c >> 0) & 15];
-		}
-		crtc->edid[blob->length * 2] = '\0';
-
-	free_blob:
-		if (blob)
-			drmModeFreePropertyBlob(blob);
-
-	free_prop:
-		drmModeFreeProperty(prop);
+		memcpy(crtc->edid, blob->data, blob->length);
+		crtc->edid_size = (size_t)blob->length;
 	}
+	drmModeFreePropertyBlob(blob);
 
 	return 0;
 }
@@ -229,34 +380,208 @@ drm_crtc_open(size_t index, drm_card_t *restrict card, drm_crtc_t *restrict crtc
 void
 drm_crtc_close(drm_crtc_t *restrict crtc)
 {
+	/* The CRT controller keeps its own reference to the committed blob. */
+	if (crtc->lut_blob)
+		DRM_CALL(drmModeDestroyPropertyBlob(crtc->card->fd, crtc->lut_blob));
 	free(crtc->edid);
 	free(crtc->red);
+	free(crtc->lut);
 	crtc->edid = NULL;
+	crtc->edid_size = 0;
 	crtc->red = NULL;
+	crtc->lut = NULL;
+	crtc->lut_blob = 0;
 }
 
 
 /**
  * Read the gamma ramps for a CRT controller
  * 
+ * Does nothing if the CRT controller has no gamma ramps
+ * 
  * @param   crtc  CRT controller information
  * @return        Zero on success, -1 on error 
  */
 int
 drm_get_gamma(drm_crtc_t *restrict crtc)
 {
-	return -!!drmModeCrtcGetGamma(crtc->card->fd, crtc->id, (uint32_t)crtc->gamma_stops, crtc->red, crtc->green, crtc->blue);
+	size_t i;
+	if (crtc->software_gamma)
+		return 0;
+	/* The legacy interface does not see gamma ramps that are applied with `GAMMA_LUT`. */
+	if (crtc->card->atomic && crtc->lut_blob) {
+		for (i = 0; i < crtc->gamma_stops; i++) {
+			crtc->red[i]   = crtc->lut[i].red;
+			crtc->green[i] = crtc->lut[i].green;
+			crtc->blue[i]  = crtc->lut[i].blue;
+		}
+		return 0;
+	}
+	return -!!DRM_CALL(drmModeCrtcGetGamma(crtc->card->fd, crtc->id, (uint32_t)crtc->gamma_stops, crtc->red, crtc->green, crtc->blue));
+}
+
+
+/**
+ * Apply gamma ramps for a CRT controller with the legacy interface
+ * 
+ * @param   crtc  CRT controller information
+ * @return        Zero on success, -1 on error
+ */
+static int
+drm_set_gamma_legacy(drm_crtc_t *restrict crtc)
+{
+	return -!!DRM_CALL(drmModeCrtcSetGamma(crtc->card->fd, crtc->id, (uint32_t)crtc->gamma_stops, crtc->red, crtc->green, crtc->blue));
 }
 
 
 /**
  * Apply gamma ramps for a CRT controller
  * 
+ * Does nothing if the CRT controller has no gamma
+ * ramps, use `set_gamma` to apply them in software
+ * 
+ * Gamma ramps that have been queued for other CRT controllers
+ * on the same graphics card are applied as well
+ * 
  * @param   crtc  CRT controller information
  * @return        Zero on success, -1 on error
  */
 int
 drm_set_gamma(drm_crtc_t *restrict crtc)
 {
-	return -!!drmModeCrtcSetGamma(crtc->card->fd, crtc->id, (uint32_t)crtc->gamma_stops, crtc->red, crtc->green, crtc->blue);
+	if (crtc->software_gamma)
+		return 0;
+	if (drm_queue_gamma(crtc) < 0)
+		return -1;
+	return drm_commit_gamma(crtc->card);
+}
+
+
+/**
+ * Queue gamma ramps for a CRT controller, to be applied together
+ * with the other CRT controllers on the graphics card by
+ * `drm_commit_gamma`
+ * 
+ * If the graphics card does not support atomic commits, the
+ * gamma ramps are applied immediately instead. Does nothing
+ * if the CRT controller has no gamma ramps, or if the gamma
+ * ramps have not changed since they were last committed
+ * 
+ * @param   crtc  CRT controller information
+ * @return        Zero on success, -1 on error
+ */
+int
+drm_queue_gamma(drm_crtc_t *restrict crtc)
+{
+	drm_card_t *restrict card = crtc->card;
+	struct drm_color_lut *restrict lut;
+	size_t i, n = crtc->gamma_stops;
+	int r, old_errno;
+
+	if (crtc->software_gamma)
+		return 0;
+	if (!card->atomic || !crtc->lut)
+		return drm_set_gamma_legacy(crtc);
+
+	/* A CRT controller can only be queued once per commit. */
+	if (crtc->queued_blob && drm_commit_gamma(card) < 0)
+		return -1;
+	if (!card->atomic)
+		return drm_set_gamma_legacy(crtc);
+
+	lut = &crtc->lut[n];
+	for (i = 0; i < n; i++) {
+		lut[i].red      = crtc->red[i];
+		lut[i].green    = crtc->green[i];
+		lut[i].blue     = crtc->blue[i];
+		lut[i].reserved = 0;
+	}
+	if (crtc->lut_blob && !memcmp(crtc->lut, lut, n * sizeof(*lut)))
+		return 0;
+
+	if (DRM_CALL(drmModeCreatePropertyBlob(card->fd, lut, n * sizeof(*lut), &crtc->queued_blob)))
+		goto fail;
+	if (!card->request) {
+		card->request = drmModeAtomicAlloc();
+		if (!card->request)
+			goto fail;
+	}
+	r = drmModeAtomicAddProperty(card->request, crtc->id, card->gamma_lut_prop, crtc->queued_blob);
+	if (r < 0) {
+		errno = -r;
+		goto fail;
+	}
+	card->queued[card->queued_count++] = crtc;
+	return 0;
+
+fail:
+	old_errno = errno;
+	if (crtc->queued_blob)
+		DRM_CALL(drmModeDestroyPropertyBlob(card->fd, crtc->queued_blob));
+	crtc->queued_blob = 0;
+	errno = old_errno;
+	return -1;
+}
+
+
+/**
+ * Apply the queued gamma ramps of a graphics
+ * card's CRT controllers in one atomic commit
+ * 
+ * If the driver rejects the commit, the legacy interface
+ * is used for the graphics card from then on, and the
+ * gamma ramps are applied with it instead; on other
+ * errors, the queued gamma ramps are discarded
+ * 
+ * @param   card  The graphics card information
+ * @return        Zero on success, -1 on error
+ */
+int
+drm_commit_gamma(drm_card_t *restrict card)
+{
+	drm_crtc_t *restrict crtc;
+	size_t i, n = card->queued_count;
+	int r, ret = 0, old_errno;
+
+	if (!card->request)
+		return 0;
+	r = DRM_CALL(drmModeAtomicCommit(card->fd, card->request, 0, NULL));
+	old_errno = errno;
+	drmModeAtomicFree(card->request);
+	card->request = NULL;
+	card->queued_count = 0;
+
+	for (i = 0; i < n; i++) {
+		crtc = card->queued[i];
+		if (!r) {
+			if (crtc->lut_blob)
+				DRM_CALL(drmModeDestroyPropertyBlob(card->fd, crtc->lut_blob));
+			crtc->lut_blob = crtc->queued_blob;
+			memcpy(crtc->lut, &crtc->lut[crtc->gamma_stops], crtc->gamma_stops * sizeof(*crtc->lut));
+		} else {
+			DRM_CALL(drmModeDestroyPropertyBlob(card->fd, crtc->queued_blob));
+		}
+		crtc->queued_blob = 0;
+	}
+	if (!r)
+		return 0;
+
+	/* Other errors, such as not being the DRM master after a VT switch, may go away. */
+	if (old_errno != EINVAL && old_errno != ENOENT && old_errno != EOPNOTSUPP && old_errno != ENOSYS) {
+		errno = old_errno;
+		return -1;
+	}
+
+	/* The driver rejected the commit, so stop trying. */
+	card->atomic = 0;
+	for (i = 0; i < n; i++) {
+		crtc = card->queued[i];
+		if (crtc->lut_blob) {
+			DRM_CALL(drmModeDestroyPropertyBlob(card->fd, crtc->lut_blob));
+			crtc->lut_blob = 0;
+		}
+		if (drm_set_gamma_legacy(crtc) < 0)
+			ret = -1;
+	}
+	return ret;
 }
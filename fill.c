@@ -0,0 +1,543 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+/*
+ * On x86, kernels for any instruction set can be compiled with
+ * target attributes; which of them are used is decided at run
+ * time with `__builtin_cpu_supports`.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# include <immintrin.h>
+# define HAVE_X86_TARGETS
+#endif
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
+
+/*
+ * All kernels write, for each pixel, the first `bytes_per_pixel`
+ * bytes of `colour` as it is stored in memory, which is the same
+ * thing as storing `colour` as a 32-bit integer for each pixel in
+ * order, but without writing anything past the end of the run.
+ */
+
+
+
+/**
+ * Fill a run of pixels that are not supported, this
+ * is a no-operation
+ * 
+ * @param  mem     The first pixel in the run
+ * @param  colour  The colour of the pixels
+ * @param  n       The number of pixels in the run
+ */
+static void
+fill_row_none(int8_t *restrict mem, uint32_t colour, size_t n)
+{
+	(void) mem;
+	(void) colour;
+	(void) n;
+}
+
+
+/**
+ * Fill a run of 8-bit pixels
+ * 
+ * @param  mem     The first pixel in the run
+ * @param  colour  The colour of the pixels
+ * @param  n       The number of pixels in the run
+ */
+static void
+fill_row_8(int8_t *restrict mem, uint32_t colour, size_t n)
+{
+	int8_t c;
+	memcpy(&c, &colour, 1);
+	memset(mem, c, n);
+}
+
+
+/**
+ * Fill a run of 16-bit pixels
+ * 
+ * @param  mem     The first pixel in the run
+ * @param  colour  The colour of the pixels
+ * @param  n       The number of pixels in the run
+ */
+static void
+fill_row_16(int8_t *restrict mem, uint32_t colour, size_t n)
+{
+	uint16_t c;
+	uint32_t cc;
+	memcpy(&c, &colour, 2);
+	cc = (uint32_t)c | ((uint32_t)c << 16);
+	for (; n >= 2; n -= 2, mem += 4)
+		*(uint32_t *)mem = cc;
+	if (n)
+		*(uint16_t *)mem = c;
+}
+
+
+/**
+ * Fill a run of 24-bit pixels
+ * 
+ * @param  mem     The first pixel in the run
+ * @param  colour  The colour of the pixels
+ * @param  n       The number of pixels in the run
+ */
+static void
+fill_row_24(int8_t *restrict mem, uint32_t colour, size_t n)
+{
+	int8_t pattern[12];
+	uint32_t w0, w1, w2;
+	memcpy(pattern + 0, &colour, 3);
+	memcpy(pattern + 3, &colour, 3);
+	memcpy(pattern + 6, &colour, 3);
+	memcpy(pattern + 9, &colour, 3);
+	memcpy(&w0, pattern + 0, 4);
+	memcpy(&w1, pattern + 4, 4);
+	memcpy(&w2, pattern + 8, 4);
+	for (; n >= 4; n -= 4, mem += 12) {
+		((uint32_t *)mem)[0] = w0;
+		((uint32_t *)mem)[1] = w1;
+		((uint32_t *)mem)[2] = w2;
+	}
+	memcpy(mem, pattern, n * 3);
+}
+
+
+/**
+ * Fill a run of 32-bit pixels
+ * 
+ * @param  mem     The first pixel in the run
+ * @param  colour  The colour of the pixels
+ * @param  n       The number of pixels in the run
+ */
+static void
+fill_row_32(int8_t *restrict mem, uint32_t colour, size_t n)
+{
+	for (; n >= 2; n -= 2, mem += 8) {
+		((uint32_t *)mem)[0] = colour;
+		((uint32_t *)mem)[1] = colour;
+	}
+	if (n)
+		*(uint32_t *)mem = colour;
+}
+
+
+#ifdef __SSE2__
+
+/**
+ * Fill a run of 16-bit pixels, using SSE2
+ * 
+ * @param  mem     The first pixel in the run
+ * @param  colour  The colour of the pixels
+ * @param  n       The number of pixels in the run
+ */
+static void
+fill_row_16_sse2(int8_t *restrict mem, uint32_t colour, size_t n)
+{
+	__m128i v = _mm_set1_epi16((short)colour);
+	for (; n >= 8; n -= 8, mem += 16)
+		_mm_storeu_si128((__m128i *)mem, v);
+	fill_row_16(mem, colour, n);
+}
+
+
+/**
+ * Fill a run of 24-bit pixels, using SSE2
+ * 
+ * @param  mem     The first pixel in the run
+ * @param  colour  The colour of the pixels
+ * @param  n       The number of pixels in the run
+ */
+static void
+fill_row_24_sse2(int8_t *restrict mem, uint32_t colour, size_t n)
+{
+	int8_t pattern[48 + 1];
+	__m128i v0, v1, v2;
+	size_t i;
+	for (i = 0; i < 16; i++)
+		memcpy(pattern + i * 3, &colour, 4);
+	v0 = _mm_loadu_si128((const __m128i *)(pattern +  0));
+	v1 = _mm_loadu_si128((const __m128i *)(pattern + 16));
+	v2 = _mm_loadu_si128((const __m128i *)(pattern + 32));
+	for (; n >= 16; n -= 16, mem += 48) {
+		_mm_storeu_si128((__m128i *)(mem +  0), v0);
+		_mm_storeu_si128((__m128i *)(mem + 16), v1);
+		_mm_storeu_si128((__m128i *)(mem + 32), v2);
+	}
+	fill_row_24(mem, colour, n);
+}
+
+
+/**
+ * Fill a run of 32-bit pixels, using SSE2
+ * 
+ * @param  mem     The first pixel in the run
+ * @param  colour  The colour of the pixels
+ * @param  n       The number of pixels in the run
+ */
+static void
+fill_row_32_sse2(int8_t *restrict mem, uint32_t colour, size_t n)
+{
+	__m128i v = _mm_set1_epi32((int)colour);
+	for (; n >= 8; n -= 8, mem += 32) {
+		_mm_storeu_si128((__m128i *)(mem +  0), v);
+		_mm_storeu_si128((__m128i *)(mem + 16), v);
+	}
+	fill_row_32(mem, colour, n);
+}
+
+
+/**
+ * Fill a run of pixels using non-temporal SSE2 stores
+ * 
+ * @param  mem              The first pixel in the run
+ * @param  colour           The colour of the pixels
+ * @param  n                The number of pixels in the run
+ * @param  bytes_per_pixel  The number of bytes per pixel, 1, 2, 3 or 4
+ * @param  fill             Regular kernel for the pixels before the first
+ *                          aligned pixel and after the last whole block
+ */
+static inline void
+fill_row_stream(int8_t *restrict mem, uint32_t colour, size_t n, size_t bytes_per_pixel, fill_row_func_t *fill)
+{
+	int8_t pattern[48 + 4];
+	__m128i v0, v1, v2;
+	size_t i, head, block = 48 / bytes_per_pixel;
+
+	/* Streaming stores must be aligned to 16 bytes. */
+	for (head = 0; (uintptr_t)(mem + head * bytes_per_pixel) & 15; head++) {
+		if (head == 15 || head == n) {
+			fill(mem, colour, n);
+			return;
+		}
+	}
+	fill(mem, colour, head);
+	mem += head * bytes_per_pixel;
+	n -= head;
+
+	for (i = 0; i < 48; i += bytes_per_pixel)
+		memcpy(pattern + i, &colour, 4);
+	v0 = _mm_loadu_si128((const __m128i *)(pattern +  0));
+	v1 = _mm_loadu_si128((const __m128i *)(pattern + 16));
+	v2 = _mm_loadu_si128((const __m128i *)(pattern + 32));
+	for (; n >= block; n -= block, mem += 48) {
+		_mm_stream_si128((__m128i *)(mem +  0), v0);
+		_mm_stream_si128((__m128i *)(mem + 16), v1);
+		_mm_stream_si128((__m128i *)(mem + 32), v2);
+	}
+	fill(mem, colour, n);
+}
+
+
+/**
+ * Fill a run of 8-bit pixels, using non-temporal SSE2 stores
+ * 
+ * @param  mem     The first pixel in the run
+ * @param  colour  The colour of the pixels
+ * @param  n       The number of pixels in the run
+ */
+static void
+fill_row_8_stream(int8_t *restrict mem, uint32_t colour, size_t n)
+{
+	fill_row_stream(mem, colour, n, 1, fill_row_8);
+}
+
+
+/**
+ * Fill a run of 16-bit pixels, using non-temporal SSE2 stores
+ * 
+ * @param  mem     The first pixel in the run
+ * @param  colour  The colour of the pixels
+ * @param  n       The number of pixels in the run
+ */
+static void
+fill_row_16_stream(int8_t *restrict mem, uint32_t colour, size_t n)
+{
+	fill_row_stream(mem, colour, n, 2, fill_row_16_sse2);
+}
+
+
+/**
+ * Fill a run of 24-bit pixels, using non-temporal SSE2 stores
+ * 
+ * @param  mem     The first pixel in the run
+ * @param  colour  The colour of the pixels
+ * @param  n       The number of pixels in the run
+ */
+static void
+fill_row_24_stream(int8_t *restrict mem, uint32_t colour, size_t n)
+{
+	fill_row_stream(mem, colour, n, 3, fill_row_24_sse2);
+}
+
+
+/**
+ * Fill a run of 32-bit pixels, using non-temporal SSE2 stores
+ * 
+ * @param  mem     The first pixel in the run
+ * @param  colour  The colour of the pixels
+ * @param  n       The number of pixels in the run
+ */
+static void
+fill_row_32_stream(int8_t *restrict mem, uint32_t colour, size_t n)
+{
+	fill_row_stream(mem, colour, n, 4, fill_row_32_sse2);
+}
+
+#endif
+
+
+#ifdef HAVE_X86_TARGETS
+
+/**
+ * Fill a run of 16-bit pixels, using AVX2
+ * 
+ * @param  mem     The first pixel in the run
+ * @param  colour  The colour of the pixels
+ * @param  n       The number of pixels in the run
+ */
+__attribute__((__target__("avx2")))
+static void
+fill_row_16_avx2(int8_t *restrict mem, uint32_t colour, size_t n)
+{
+	__m256i v = _mm256_set1_epi16((short)colour);
+	for (; n >= 16; n -= 16, mem += 32)
+		_mm256_storeu_si256((__m256i *)mem, v);
+	fill_row_16(mem, colour, n);
+}
+
+
+/**
+ * Fill a run of 24-bit pixels, using AVX2
+ * 
+ * @param  mem     The first pixel in the run
+ * @param  colour  The colour of the pixels
+ * @param  n       The number of pixels in the run
+ */
+__attribute__((__target__("avx2")))
+static void
+fill_row_24_avx2(int8_t *restrict mem, uint32_t colour, size_t n)
+{
+	int8_t pattern[96 + 1];
+	__m256i v0, v1, v2;
+	size_t i;
+	for (i = 0; i < 32; i++)
+		memcpy(pattern + i * 3, &colour, 4);
+	v0 = _mm256_loadu_si256((const __m256i *)(pattern +  0));
+	v1 = _mm256_loadu_si256((const __m256i *)(pattern + 32));
+	v2 = _mm256_loadu_si256((const __m256i *)(pattern + 64));
+	for (; n >= 32; n -= 32, mem += 96) {
+		_mm256_storeu_si256((__m256i *)(mem +  0), v0);
+		_mm256_storeu_si256((__m256i *)(mem + 32), v1);
+		_mm256_storeu_si256((__m256i *)(mem + 64), v2);
+	}
+	fill_row_24(mem, colour, n);
+}
+
+
+/**
+ * Fill a run of 32-bit pixels, using AVX2
+ * 
+ * @param  mem     The first pixel in the run
+ * @param  colour  The colour of the pixels
+ * @param  n       The number of pixels in the run
+ */
+__attribute__((__target__("avx2")))
+static void
+fill_row_32_avx2(int8_t *restrict mem, uint32_t colour, size_t n)
+{
+	__m256i v = _mm256_set1_epi32((int)colour);
+	for (; n >= 16; n -= 16, mem += 64) {
+		_mm256_storeu_si256((__m256i *)(mem +  0), v);
+		_mm256_storeu_si256((__m256i *)(mem + 32), v);
+	}
+	fill_row_32(mem, colour, n);
+}
+
+#endif
+
+
+
+/**
+ * Select the fastest row-fill kernel for a pixel size
+ * 
+ * @param   bytes_per_pixel  The number of bytes per pixel
+ * @return                   The kernel, a no-operation if
+ *                           the pixel size is not supported
+ */
+fill_row_func_t *
+fill_select(uint32_t bytes_per_pixel)
+{
+#ifdef HAVE_X86_TARGETS
+	int avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+	switch (bytes_per_pixel) {
+	case 1:
+		return fill_row_8;
+	case 2:
+#ifdef HAVE_X86_TARGETS
+		if (avx2)
+			return fill_row_16_avx2;
+#endif
+#ifdef __SSE2__
+		return fill_row_16_sse2;
+#else
+		return fill_row_16;
+#endif
+	case 3:
+#ifdef HAVE_X86_TARGETS
+		if (avx2)
+			return fill_row_24_avx2;
+#endif
+#ifdef __SSE2__
+		return fill_row_24_sse2;
+#else
+		return fill_row_24;
+#endif
+	case 4:
+#ifdef HAVE_X86_TARGETS
+		if (avx2)
+			return fill_row_32_avx2;
+#endif
+#ifdef __SSE2__
+		return fill_row_32_sse2;
+#else
+		return fill_row_32;
+#endif
+	default:
+		return fill_row_none;
+	}
+}
+
+
+/**
+ * Select a row-fill kernel for a pixel size that uses
+ * non-temporal stores, for fills too large to be kept
+ * in the cache, `fill_fence` must be called before
+ * the filled memory is read by another thread
+ * 
+ * @param   bytes_per_pixel  The number of bytes per pixel
+ * @return                   The kernel, a no-operation if
+ *                           the pixel size is not supported
+ */
+fill_row_func_t *
+fill_select_stream(uint32_t bytes_per_pixel)
+{
+#ifdef __SSE2__
+	switch (bytes_per_pixel) {
+	case 1:
+		return fill_row_8_stream;
+	case 2:
+		return fill_row_16_stream;
+	case 3:
+		return fill_row_24_stream;
+	case 4:
+		return fill_row_32_stream;
+	default:
+		return fill_row_none;
+	}
+#else
+	return fill_select(bytes_per_pixel);
+#endif
+}
+
+
+#ifdef HAVE_X86_TARGETS
+
+/**
+ * Copy 64-byte blocks with non-temporal loads and stores,
+ * non-temporal loads are much faster than regular loads
+ * when reading from write-combining video memory
+ * 
+ * @param   dst  The destination, aligned to 16 bytes
+ * @param   src  The source, aligned to 16 bytes
+ * @param   n    The number of bytes to copy
+ * @return       The number of bytes copied
+ */
+__attribute__((__target__("sse4.1")))
+static size_t
+fill_copy_blocks_sse41(int8_t *restrict dst, const int8_t *restrict src, size_t n)
+{
+	size_t i;
+	__m128i v0, v1, v2, v3;
+	for (i = 0; i + 64 <= n; i += 64) {
+		v0 = _mm_stream_load_si128((__m128i *)(src + i +  0));
+		v1 = _mm_stream_load_si128((__m128i *)(src + i + 16));
+		v2 = _mm_stream_load_si128((__m128i *)(src + i + 32));
+		v3 = _mm_stream_load_si128((__m128i *)(src + i + 48));
+		_mm_stream_si128((__m128i *)(dst + i +  0), v0);
+		_mm_stream_si128((__m128i *)(dst + i + 16), v1);
+		_mm_stream_si128((__m128i *)(dst + i + 32), v2);
+		_mm_stream_si128((__m128i *)(dst + i + 48), v3);
+	}
+	return i;
+}
+
+#endif
+
+
+/**
+ * Copy memory using non-temporal stores, for bulk copies
+ * to or from video memory that should not evict the cache
+ * 
+ * The stores are globally visible when the function returns
+ * 
+ * @param  dst  The destination
+ * @param  src  The source
+ * @param  n    The number of bytes to copy
+ */
+void
+fill_copy_stream(int8_t *restrict dst, const int8_t *restrict src, size_t n)
+{
+#ifdef __SSE2__
+	size_t head = (16 - ((uintptr_t)dst & 15)) & 15, i = 0;
+	__m128i v0, v1, v2, v3;
+
+	if (n < 256) {
+		memcpy(dst, src, n);
+		return;
+	}
+
+	/* Streaming stores must be aligned to 16 bytes. */
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	n -= head;
+
+#ifdef HAVE_X86_TARGETS
+	if (!((uintptr_t)src & 15) && __builtin_cpu_supports("sse4.1"))
+		i = fill_copy_blocks_sse41(dst, src, n);
+#endif
+	for (; i + 64 <= n; i += 64) {
+		v0 = _mm_loadu_si128((const __m128i *)(src + i +  0));
+		v1 = _mm_loadu_si128((const __m128i *)(src + i + 16));
+		v2 = _mm_loadu_si128((const __m128i *)(src + i + 32));
+		v3 = _mm_loadu_si128((const __m128i *)(src + i + 48));
+		_mm_stream_si128((__m128i *)(dst + i +  0), v0);
+		_mm_stream_si128((__m128i *)(dst + i + 16), v1);
+		_mm_stream_si128((__m128i *)(dst + i + 32), v2);
+		_mm_stream_si128((__m128i *)(dst + i + 48), v3);
+	}
+	memcpy(dst + i, src + i, n - i);
+	_mm_sfence();
+#else
+	memcpy(dst, src, n);
+#endif
+}
+
+
+/**
+ * Wait until all non-temporal stores made by the
+ * calling thread are globally visible
+ */
+void
+fill_fence(void)
+{
+#ifdef __SSE2__
+	_mm_sfence();
+#endif
+}
@@ -16,6 +16,370 @@
 #define FB_DEVICE_MAX_LEN (sizeof(FB_DEVICE_PATTERN) / sizeof(char) + 3 * sizeof(size_t))
 
 
+/**
+ * The environment variable that, if set, replaces the framebuffer
+ * devices with virtual framebuffers, see `fb_virtual_parse`
+ */
+#ifndef FB_VIRTUAL_ENV
+# define FB_VIRTUAL_ENV  "CRT_CALIBRATOR_FB"
+#endif
+
+
+/**
+ * The environment variable that, if set to 0, stops framebuffers
+ * from being prefaulted when they are mapped
+ */
+#ifndef FB_PREFAULT_ENV
+# define FB_PREFAULT_ENV  "CRT_CALIBRATOR_PREFAULT"
+#endif
+
+
+/**
+ * The number of bytes from which writes to the display, by
+ * `fb_fill_rectangle` on framebuffers without a shadow buffer
+ * and by `fb_flush_lines`, use non-temporal stores, so that
+ * they do not evict everything in the cache; the display is
+ * never read back while drawing
+ */
+#ifndef FB_STREAM_MIN
+# define FB_STREAM_MIN  (1UL << 20)
+#endif
+
+/**
+ * The number of bytes from which `fb_fill_rectangle` uses
+ * non-temporal stores on the shadow buffer; smaller fills
+ * stay in the cache until the flush reads them back, but
+ * larger fills would be evicted before that anyway
+ */
+#ifndef FB_SHADOW_STREAM_MIN
+# define FB_SHADOW_STREAM_MIN  (1UL << 24)
+#endif
+
+
+/**
+ * Rescale an 8-bit colour component to a channel with
+ * a specific number of bits
+ * 
+ * @param   value   The component value from [0, 255]
+ * @param   length  The number of bits in the channel, at most 16
+ * @return          The component value scaled for the channel
+ */
+#define FB_SCALE(value, length)\
+	((length) == 8 ? (uint32_t)(value) :\
+	 (length) <  8 ? (uint32_t)(value) >> (8 - (length)) :\
+	 ((uint32_t)(value) << ((length) - 8)) | ((uint32_t)(value) >> (16 - (length))))
+
+
+/**
+ * Define a colour packer specialised for a pixel format
+ * 
+ * @param  NAME  The name of the pixel format
+ * @param  RO    The bit offset of the red channel
+ * @param  RL    The number of bits in the red channel
+ * @param  GO    The bit offset of the green channel
+ * @param  GL    The number of bits in the green channel
+ * @param  BO    The bit offset of the blue channel
+ * @param  BL    The number of bits in the blue channel
+ */
+#define FB_PACKER(NAME, RO, RL, GO, GL, BO, BL)\
+	static uint32_t\
+	fb_pack_##NAME(const fb_format_t *restrict format, int red, int green, int blue)\
+	{\
+		(void) format;\
+		return (FB_SCALE(red, RL) << RO) | (FB_SCALE(green, GL) << GO) | (FB_SCALE(blue, BL) << BO);\
+	}
+
+
+FB_PACKER(xrgb8888,    16,  8,  8,  8, 0,  8)
+FB_PACKER(xbgr8888,     0,  8,  8,  8, 16, 8)
+FB_PACKER(rgb565,      11,  5,  5,  6, 0,  5)
+FB_PACKER(xrgb1555,    10,  5,  5,  5, 0,  5)
+FB_PACKER(xrgb2101010, 20, 10, 10, 10, 0, 10)
+
+
+/**
+ * Pack a colour into any pixel format
+ * 
+ * @param   format  The pixel format
+ * @param   red     The red   component from [0, 255] sRGB
+ * @param   green   The green component from [0, 255] sRGB
+ * @param   blue    The blue  component from [0, 255] sRGB
+ * @return          The colour encoded as a pixel value
+ */
+static uint32_t
+fb_pack_generic(const fb_format_t *restrict format, int red, int green, int blue)
+{
+	return (FB_SCALE(red,   format->red_length)   << format->red_offset)   |
+	       (FB_SCALE(green, format->green_length) << format->green_offset) |
+	       (FB_SCALE(blue,  format->blue_length)  << format->blue_offset);
+}
+
+
+/**
+ * Fill in the pixel format information for a framebuffer
+ * and select the colour packer for it
+ * 
+ * Channels wider than 16 bits are narrowed to their 16 most
+ * significant bits, as that is all `FB_SCALE` can fill, and
+ * channels that do not fit in 32 bits are left out
+ * 
+ * @param  format    Pixel format information to fill in
+ * @param  var_info  The framebuffer's variable screen information
+ */
+static void
+fb_select_format(fb_format_t *restrict format, const struct fb_var_screeninfo *restrict var_info)
+{
+#define MATCH(RO, RL, GO, GL, BO, BL)\
+	(format->red_offset   == RO && format->red_length   == RL &&\
+	 format->green_offset == GO && format->green_length == GL &&\
+	 format->blue_offset  == BO && format->blue_length  == BL)
+
+#define CLAMP(CHANNEL)\
+	do {\
+		if (format->CHANNEL##_length > 16) {\
+			format->CHANNEL##_offset += format->CHANNEL##_length - 16;\
+			format->CHANNEL##_length = 16;\
+		}\
+		if (format->CHANNEL##_offset >= 32 || format->CHANNEL##_offset + format->CHANNEL##_length > 32)\
+			format->CHANNEL##_offset = format->CHANNEL##_length = 0;\
+	} while (0)
+
+	format->bits_per_pixel = var_info->bits_per_pixel;
+	format->red_offset     = var_info->red.offset;
+	format->red_length     = var_info->red.length;
+	format->green_offset   = var_info->green.offset;
+	format->green_length   = var_info->green.length;
+	format->blue_offset    = var_info->blue.offset;
+	format->blue_length    = var_info->blue.length;
+
+	if (!format->red_length && !format->green_length && !format->blue_length) {
+		/* The driver does not describe the format, assume XRGB */
+		format->red_offset   = 16, format->red_length   = 8;
+		format->green_offset = 8,  format->green_length = 8;
+		format->blue_offset  = 0,  format->blue_length  = 8;
+	}
+
+	CLAMP(red);
+	CLAMP(green);
+	CLAMP(blue);
+
+	if (MATCH(16, 8, 8, 8, 0, 8))
+		format->pack = fb_pack_xrgb8888;
+	else if (MATCH(0, 8, 8, 8, 16, 8))
+		format->pack = fb_pack_xbgr8888;
+	else if (MATCH(11, 5, 5, 6, 0, 5))
+		format->pack = fb_pack_rgb565;
+	else if (MATCH(10, 5, 5, 5, 0, 5))
+		format->pack = fb_pack_xrgb1555;
+	else if (MATCH(20, 10, 10, 10, 0, 10))
+		format->pack = fb_pack_xrgb2101010;
+	else
+		format->pack = fb_pack_generic;
+
+#undef MATCH
+#undef CLAMP
+}
+
+
+
+/**
+ * Pixel formats for virtual framebuffers
+ */
+static const struct fb_virtual_format
+{
+	/**
+	 * The name of the format
+	 */
+	const char *name;
+
+	/**
+	 * The number of bits per pixel
+	 */
+	uint32_t bits_per_pixel;
+
+	/**
+	 * The offset and length, in bits, of the red,
+	 * green and blue channels, in that order
+	 */
+	uint32_t bitfields[6];
+
+} fb_virtual_formats[] = {
+	{"xrgb8888",    32, {16,  8,  8,  8,  0,  8}},
+	{"xbgr8888",    32, { 0,  8,  8,  8, 16,  8}},
+	{"rgb888",      24, {16,  8,  8,  8,  0,  8}},
+	{"rgb565",      16, {11,  5,  5,  6,  0,  5}},
+	{"xrgb1555",    16, {10,  5,  5,  5,  0,  5}},
+	{"xrgb2101010", 32, {20, 10, 10, 10,  0, 10}}
+};
+
+
+/**
+ * Parse the description of a virtual framebuffer
+ * 
+ * `FB_VIRTUAL_ENV` is a comma-separated list of framebuffers,
+ * each on the form WIDTHxHEIGHT[:FORMAT[:LINE_LENGTH[:FILE]]],
+ * FORMAT defaults to xrgb8888, LINE_LENGTH, in bytes, defaults
+ * to the width of the lines, and if FILE is omitted, the
+ * framebuffer is backed by anonymous memory
+ * 
+ * @param   spec      The framebuffer's entry in `FB_VIRTUAL_ENV`
+ * @param   var_info  Output parameter for the framebuffer's geometry and pixel format
+ * @param   fix_info  Output parameter for the framebuffer's line length and size
+ * @param   path      Output parameter for the file to back the framebuffer with, `NULL`
+ *                    if none, must be freed by the caller
+ * @return            Zero on success, -1 on error
+ */
+static int
+fb_virtual_parse(const char *spec, struct fb_var_screeninfo *restrict var_info,
+                 struct fb_fix_screeninfo *restrict fix_info, char **restrict path)
+{
+	const struct fb_virtual_format *restrict format = &fb_virtual_formats[0];
+	unsigned long int width, height, line_length = 0;
+	size_t i, n;
+	char *end;
+
+	*path = NULL;
+	memset(var_info, 0, sizeof(*var_info));
+	memset(fix_info, 0, sizeof(*fix_info));
+
+	width = strtoul(spec, &end, 10);
+	if (end == spec || *end++ != 'x')
+		goto invalid;
+	spec = end;
+	height = strtoul(spec, &end, 10);
+	if (end == spec || !width || !height || width > 0x7FFF || height > 0x7FFF)
+		goto invalid;
+	spec = end;
+
+	if (*spec == ':') {
+		n = strcspn(++spec, ":,");
+		for (i = 0; n && i < sizeof(fb_virtual_formats) / sizeof(*fb_virtual_formats); i++)
+			if (strlen(fb_virtual_formats[i].name) == n && !strncmp(spec, fb_virtual_formats[i].name, n))
+				break;
+		if (i == sizeof(fb_virtual_formats) / sizeof(*fb_virtual_formats))
+			goto invalid;
+		if (n)
+			format = &fb_virtual_formats[i];
+		spec += n;
+	}
+
+	if (*spec == ':' && spec[1] != ':' && spec[1] != ',' && spec[1]) {
+		line_length = strtoul(++spec, &end, 10);
+		if (end == spec)
+			goto invalid;
+		spec = end;
+	} else if (*spec == ':') {
+		spec++;
+	}
+	if (!line_length)
+		line_length = width * (format->bits_per_pixel / 8);
+	else if (line_length < width * (format->bits_per_pixel / 8) || line_length > 0x7FFFF)
+		goto invalid;
+	/* The size must fit in `fix_info->smem_len`. */
+	if ((uint64_t)line_length * (uint64_t)height > UINT32_MAX)
+		goto invalid;
+
+	if (*spec == ':') {
+		n = strcspn(++spec, ",");
+		if (n) {
+			*path = malloc(n + 1);
+			if (!*path)
+				return -1;
+			memcpy(*path, spec, n);
+			(*path)[n] = '\0';
+		}
+		spec += n;
+	}
+	if (*spec && *spec != ',')
+		goto invalid;
+
+	var_info->xres = var_info->xres_virtual = (uint32_t)width;
+	var_info->yres = var_info->yres_virtual = (uint32_t)height;
+	var_info->bits_per_pixel = format->bits_per_pixel;
+	var_info->red.offset     = format->bitfields[0];
+	var_info->red.length     = format->bitfields[1];
+	var_info->green.offset   = format->bitfields[2];
+	var_info->green.length   = format->bitfields[3];
+	var_info->blue.offset    = format->bitfields[4];
+	var_info->blue.length    = format->bitfields[5];
+	fix_info->line_length = (uint32_t)line_length;
+	fix_info->smem_len = (uint32_t)(line_length * height);
+	return 0;
+
+invalid:
+	errno = EINVAL;
+	return -1;
+}
+
+
+/**
+ * Get the description of a virtual framebuffer
+ * 
+ * @param   index  The index of the framebuffer
+ * @return         The framebuffer's entry in `FB_VIRTUAL_ENV`,
+ *                 `NULL` if there is no such framebuffer or if
+ *                 virtual framebuffers are not used
+ */
+static const char *
+fb_virtual_spec(size_t index)
+{
+	const char *spec = getenv(FB_VIRTUAL_ENV);
+	if (!spec || !*spec)
+		return NULL;
+	for (; index; index--) {
+		spec = strchr(spec, ',');
+		if (!spec)
+			return NULL;
+		spec++;
+	}
+	return spec;
+}
+
+
+/**
+ * Open a virtual framebuffer
+ * 
+ * @param   spec      The framebuffer's entry in `FB_VIRTUAL_ENV`
+ * @param   fb        Framebuffer information to fill in the file descriptor in
+ * @param   var_info  Output parameter for the framebuffer's geometry and pixel format
+ * @param   fix_info  Output parameter for the framebuffer's line length and size
+ * @return            Zero on success, -1 on error
+ */
+static int
+fb_virtual_open(const char *spec, framebuffer_t *restrict fb,
+                struct fb_var_screeninfo *restrict var_info, struct fb_fix_screeninfo *restrict fix_info)
+{
+	char *path;
+	FILE *f;
+	int old_errno;
+
+	if (fb_virtual_parse(spec, var_info, fix_info, &path) < 0)
+		return -1;
+
+	if (path) {
+		fb->fd = open(path, O_RDWR | O_CREAT, 0666);
+		free(path);
+	} else {
+#ifdef SYS_memfd_create
+		fb->fd = (int)syscall(SYS_memfd_create, "crt-calibrator", 0);
+		if (fb->fd < 0 && errno == ENOSYS)
+#endif
+		{
+			f = tmpfile();
+			fb->fd = f ? dup(fileno(f)) : -1;
+			if (f) {
+				old_errno = errno;
+				fclose(f);
+				errno = old_errno;
+			}
+		}
+	}
+	if (fb->fd < 0)
+		return -1;
+
+	return ftruncate(fb->fd, (off_t)(fix_info->smem_len));
+}
+
 
 /**
  * Figure out how many framebuffers there are on the system
@@ -27,6 +391,12 @@ fb_count(void)
 {
 	char buf[FB_DEVICE_MAX_LEN];
 	size_t count = 0;
+
+	if (fb_virtual_spec(0)) {
+		while (fb_virtual_spec(count))
+			count++;
+		return count;
+	}
   
 	for (;; count++) {
 		sprintf(buf, FB_DEVICE_PATTERN, count);
@@ -36,6 +406,152 @@ fb_count(void)
 }
 
 
+/**
+ * Check whether framebuffers shall be prefaulted when they are mapped
+ * 
+ * @return  1 if framebuffers shall be prefaulted, 0 otherwise
+ */
+static int
+fb_prefault(void)
+{
+	const char *env = getenv(FB_PREFAULT_ENV);
+	return !env || strcmp(env, "0");
+}
+
+
+/**
+ * Get the offset of the visible area in a framebuffer's memory
+ * 
+ * @param   fix_info  The framebuffer's fixed screen information
+ * @param   var_info  The framebuffer's variable screen information
+ * @return            The offset, in bytes
+ */
+static size_t
+fb_visible_offset(const struct fb_fix_screeninfo *restrict fix_info, const struct fb_var_screeninfo *restrict var_info)
+{
+	return (size_t)var_info->yoffset * (size_t)fix_info->line_length +
+	       (size_t)var_info->xoffset * (size_t)(var_info->bits_per_pixel / 8);
+}
+
+
+/**
+ * Map the visible area of a framebuffer and allocate its shadow buffer
+ * 
+ * Only the pages that contain the visible area are mapped, rather
+ * than the entire framebuffer memory, which includes the area that
+ * can be panned to; and unless disabled with `FB_PREFAULT_ENV`, the
+ * pages are faulted in up front so that the first draw does not
+ * have to take the page faults
+ * 
+ * If the virtual resolution has room for a second screen above or
+ * below the visible area, that area is mapped as well and used as a
+ * back buffer that `fb_present` pans to, so that the display never
+ * shows a partially drawn image
+ * 
+ * @param   fb        The framebuffer, with `fd` and `is_virtual` set
+ * @param   fix_info  The framebuffer's fixed screen information
+ * @param   var_info  The framebuffer's variable screen information
+ * @return            Zero on success, -1 on error
+ */
+static int
+fb_map(framebuffer_t *restrict fb, const struct fb_fix_screeninfo *restrict fix_info,
+       const struct fb_var_screeninfo *restrict var_info)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t offset = fb_visible_offset(fix_info, var_info);
+	size_t back_offset = offset, top, base, size, i, shadow_size;
+	uint32_t yres = var_info->yres, screens = 1;
+	int prefault = fb_prefault(), flags = MAP_SHARED;
+
+	fb->var_info = *var_info;
+	fb->back_yoffset = var_info->yoffset;
+	if (!fb->is_virtual && yres) {
+		if (var_info->yoffset + 2 * yres <= var_info->yres_virtual)
+			fb->back_yoffset = var_info->yoffset + yres, screens = 2;
+		else if (var_info->yoffset >= yres)
+			fb->back_yoffset = var_info->yoffset - yres, screens = 2;
+	}
+	if (screens == 2) {
+		if (fb->back_yoffset > var_info->yoffset)
+			back_offset = offset + (size_t)yres * (size_t)fix_info->line_length;
+		else
+			back_offset = offset - (size_t)yres * (size_t)fix_info->line_length;
+	}
+
+	top = offset < back_offset ? offset : back_offset;
+	base = top - top % page;
+	size = top - base + (size_t)screens * (size_t)yres * (size_t)fix_info->line_length;
+	if (base >= (size_t)(fix_info->smem_len)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (size > (size_t)(fix_info->smem_len) - base)
+		size = (size_t)(fix_info->smem_len) - base;
+
+#ifdef MAP_POPULATE
+	if (prefault)
+		flags |= MAP_POPULATE;
+#endif
+	/* The mapping is read by `fb_save`, and by `fb_dump_ppm` for virtual framebuffers. */
+	fb->map = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fb->fd, (off_t)base);
+	if (fb->map == MAP_FAILED)
+		return -1;
+	fb->map_size = size;
+#ifndef MAP_POPULATE
+	if (prefault)
+		madvise(fb->map, size, MADV_WILLNEED);
+#endif
+
+	fb->visible_offset  = offset;
+	fb->front           = fb->map + (offset - base);
+	fb->device          = fb->front;
+	fb->width           = var_info->xres;
+	fb->height          = var_info->yres;
+	fb->clip_top        = 0;
+	fb->clip_bottom     = var_info->yres;
+	fb->bytes_per_pixel = var_info->bits_per_pixel / 8;
+	fb->line_length     = fix_info->line_length;
+	fb->fill_row        = fill_select(fb->bytes_per_pixel);
+	fb->fill_stream     = fill_select_stream(fb->bytes_per_pixel);
+	fb->damage_count    = 0;
+	fb->prev_damage_count = 0;
+	fb_select_format(&fb->format, var_info);
+
+	/* Without a shadow buffer we will simply draw directly on the display. */
+	shadow_size = (size_t)fb->height * (size_t)fb->line_length;
+	fb->shadow = calloc((size_t)fb->height, (size_t)fb->line_length);
+	if (fb->shadow && prefault)
+		for (i = 0; i < shadow_size; i += page)
+			fb->shadow[i] = 0;
+	fb->mem = fb->shadow ? fb->shadow : fb->device;
+
+	/* The back buffer is only kept up to date by copying from the shadow buffer. */
+	fb->double_buffered = screens == 2 && fb->shadow;
+	if (fb->double_buffered)
+		fb->device = fb->map + (back_offset - base);
+
+	return 0;
+}
+
+
+/**
+ * Unmap a framebuffer and release its shadow buffer
+ * 
+ * @param  fb  The framebuffer
+ */
+static void
+fb_unmap(framebuffer_t *restrict fb)
+{
+	free(fb->shadow);
+	fb->shadow = NULL;
+	if (fb->map != MAP_FAILED) {
+		munmap(fb->map, fb->map_size);
+		fb->map = fb->mem = fb->device = fb->front = MAP_FAILED;
+		fb->map_size = 0;
+	}
+}
+
+
 /**
  * Open a framebuffer
  * 
@@ -49,32 +565,42 @@ fb_open(size_t index, framebuffer_t *restrict fb)
 	char buf[FB_DEVICE_MAX_LEN];
 	struct fb_fix_screeninfo fix_info;
 	struct fb_var_screeninfo var_info;
+	const char *spec = fb_virtual_spec(index);
 	int old_errno;
 
+	fb->opened_at = clock_ns();
+	fb->open_ns = fb->first_draw_ns = fb->first_frame_ns = 0;
 	fb->fd = -1;
-	fb->mem = MAP_FAILED;
+	fb->is_virtual = !!spec;
+	fb->double_buffered = 0;
+	fb->vsync = 1;
+	fb->var_info.yoffset = fb->origin_yoffset = 0;
+	fb->mem = fb->device = fb->front = fb->map = MAP_FAILED;
+	fb->map_size = 0;
+	fb->shadow = NULL;
+	fb->lut = NULL;
+	fb->damage_count = 0;
+	fb->prev_damage_count = 0;
 
-	sprintf(buf, FB_DEVICE_PATTERN, index);
-	fb->fd = open(buf, O_RDWR);
-	if (fb->fd < 0)
-		goto fail;
+	if (spec) {
+		if (fb_virtual_open(spec, fb, &var_info, &fix_info) < 0)
+			goto fail;
+	} else {
+		sprintf(buf, FB_DEVICE_PATTERN, index);
+		fb->fd = open(buf, O_RDWR);
+		if (fb->fd < 0)
+			goto fail;
 
-	if (ioctl(fb->fd, (unsigned long int)FBIOGET_FSCREENINFO, &fix_info) ||
-	    ioctl(fb->fd, (unsigned long int)FBIOGET_VSCREENINFO, &var_info))
-		goto fail;
+		if (ioctl(fb->fd, (unsigned long int)FBIOGET_FSCREENINFO, &fix_info) ||
+		    ioctl(fb->fd, (unsigned long int)FBIOGET_VSCREENINFO, &var_info))
+			goto fail;
+	}
 
-	fb->mem = mmap(NULL, (size_t)(fix_info.smem_len), PROT_WRITE, MAP_SHARED, fb->fd, (off_t)0);
-	if (fb->mem == MAP_FAILED)
+	if (fb_map(fb, &fix_info, &var_info) < 0)
 		goto fail;
+	fb->origin_yoffset = var_info.yoffset;
 
-	fb->mem += var_info.xoffset * (var_info.bits_per_pixel / 8);
-	fb->mem += var_info.yoffset * fix_info.line_length;
-
-	fb->width           = var_info.xres;
-	fb->height          = var_info.yres;
-	fb->bytes_per_pixel = var_info.bits_per_pixel / 8;
-	fb->line_length     = fix_info.line_length;
-
+	fb->open_ns = clock_ns() - fb->opened_at;
 	return 0;
 fail:
 	old_errno = errno;
@@ -84,6 +610,106 @@ fail:
 }
 
 
+/**
+ * Copy the visible pixels of a framebuffer, as they are
+ * currently shown on the display, into a buffer
+ * 
+ * @param  fb   The framebuffer
+ * @param  buf  Output buffer, `fb->height` lines of `fb->width`
+ *              pixels, without padding
+ */
+void
+fb_save(const framebuffer_t *restrict fb, int8_t *restrict buf)
+{
+	size_t n = (size_t)fb->width * fb->bytes_per_pixel;
+	uint32_t y;
+	if (n == fb->line_length) {
+		fill_copy_stream(buf, fb->front, n * fb->height);
+	} else {
+		for (y = 0; y < fb->height; y++, buf += n)
+			fill_copy_stream(buf, fb->front + (size_t)y * fb->line_length, n);
+	}
+}
+
+
+/**
+ * Copy pixels saved with `fb_save` back to the part of
+ * a framebuffer that was shown when it was opened
+ * 
+ * The framebuffer must not have been resized since the
+ * pixels were saved
+ * 
+ * @param  fb   The framebuffer
+ * @param  buf  The saved pixels
+ */
+void
+fb_restore(framebuffer_t *restrict fb, const int8_t *restrict buf)
+{
+	size_t n = (size_t)fb->width * fb->bytes_per_pixel;
+	int8_t *restrict page;
+	uint32_t y;
+
+	/* `fb_close` pans back to the page that was shown when the framebuffer was opened. */
+	page = fb->var_info.yoffset == fb->origin_yoffset ? fb->front : fb->device;
+	if (n == fb->line_length) {
+		fill_copy_stream(page, buf, n * fb->height);
+	} else {
+		for (y = 0; y < fb->height; y++, buf += n)
+			fill_copy_stream(page + (size_t)y * fb->line_length, buf, n);
+	}
+}
+
+
+/**
+ * Update the mapping of a framebuffer if the display mode,
+ * or the panning, has changed since it was mapped
+ * 
+ * If the framebuffer cannot be remapped, its size is set
+ * to zero so that nothing is drawn on it
+ * 
+ * @param   fb  The framebuffer
+ * @return      Zero on success, -1 on error
+ */
+int
+fb_refresh(framebuffer_t *restrict fb)
+{
+	struct fb_fix_screeninfo fix_info;
+	struct fb_var_screeninfo var_info;
+	fb_format_t format;
+
+	if (fb->is_virtual)
+		return 0;
+
+	if (ioctl(fb->fd, (unsigned long int)FBIOGET_FSCREENINFO, &fix_info) ||
+	    ioctl(fb->fd, (unsigned long int)FBIOGET_VSCREENINFO, &var_info))
+		return -1;
+
+	fb_select_format(&format, &var_info);
+	if (fb->map != MAP_FAILED &&
+	    fb->width == var_info.xres && fb->height == var_info.yres &&
+	    fb->line_length == fix_info.line_length &&
+	    fb->var_info.yres_virtual == var_info.yres_virtual &&
+	    fb->visible_offset == fb_visible_offset(&fix_info, &var_info) &&
+	    fb_same_format(&fb->format, &format))
+		return 0;
+
+	if (!fb_same_format(&fb->format, &format)) {
+		/* The lookup table was built for the old pixel format. */
+		free(fb->lut);
+		fb->lut = NULL;
+	}
+	fb_unmap(fb);
+	if (fb_map(fb, &fix_info, &var_info) < 0) {
+		fb->width = fb->height = fb->clip_bottom = 0;
+		fb->damage_count = 0;
+		fb->prev_damage_count = 0;
+		fb->double_buffered = 0;
+		return -1;
+	}
+	return 0;
+}
+
+
 /**
  * Close a framebuffer
  * 
@@ -92,6 +718,14 @@ fail:
 void
 fb_close(framebuffer_t *restrict fb)
 {
+	if (fb->double_buffered || fb->var_info.yoffset != fb->origin_yoffset) {
+		/* Pan back to where the display was when it was opened, we may have panned in another process. */
+		fb->var_info.yoffset = fb->origin_yoffset;
+		ioctl(fb->fd, (unsigned long int)FBIOPAN_DISPLAY, &fb->var_info);
+	}
+	fb_unmap(fb);
+	free(fb->lut);
+	fb->lut = NULL;
 	if (fb->fd >= 0) {
 		close(fb->fd);
 		fb->fd = -1;
@@ -100,22 +734,73 @@ fb_close(framebuffer_t *restrict fb)
 
 
 /**
- * Construct an sRGB colour in 32-bit XRGB encoding to
- * use when specifying colours
+ * Set the gamma ramps to apply to a framebuffer in software,
+ * for displays whose gamma ramps cannot be set
+ * 
+ * The ramps are applied when the shadow buffer is flushed to
+ * the display, so what is drawn is unaffected; the framebuffer
+ * must be redrawn or reflushed for a change to take effect
+ * 
+ * @param   fb     The framebuffer
+ * @param   stops  The number of stops in each gamma ramp
+ * @param   red    The gamma ramp for the red channel, `NULL` to remove the ramps
+ * @param   green  The gamma ramp for the green channel
+ * @param   blue   The gamma ramp for the blue channel
+ * @return         Zero on success, -1 on error; `errno` is set to `ENOTSUP`
+ *                 if the framebuffer has no shadow buffer or its pixel
+ *                 format is not supported
+ */
+int
+fb_set_lut(framebuffer_t *restrict fb, size_t stops, const uint16_t *restrict red,
+           const uint16_t *restrict green, const uint16_t *restrict blue)
+{
+	lut_t *lut = NULL;
+	if (red) {
+		if (!fb->shadow) {
+			errno = ENOTSUP;
+			return -1;
+		}
+		lut = lut_create(&fb->format, stops, red, green, blue);
+		if (!lut)
+			return -1;
+	}
+	free(fb->lut);
+	fb->lut = lut;
+	return 0;
+}
+
+
+/**
+ * Check whether two pixel formats are identical
  * 
+ * @param   a  One of the formats
+ * @param   b  The other format
+ * @return     1 if the formats are identical, 0 otherwise
+ */
+int
+fb_same_format(const fb_format_t *restrict a, const fb_format_t *restrict b)
+{
+	return a->bits_per_pixel == b->bits_per_pixel &&
+	       a->red_offset   == b->red_offset   && a->red_length   == b->red_length   &&
+	       a->green_offset == b->green_offset && a->green_length == b->green_length &&
+	       a->blue_offset  == b->blue_offset  && a->blue_length  == b->blue_length;
+}
+
+
+/**
+ * Construct an sRGB colour in a framebuffer's pixel format
+ * to use when specifying colours
+ * 
+ * @param   fb     The framebuffer
  * @param   red    The red   component from [0, 255] sRGB
  * @param   green  The green component from [0, 255] sRGB
  * @param   blue   The blue  component from [0, 255] sRGB
  * @return         The colour as one 32-bit integer
  */
 uint32_t
-fb_colour(int red, int green, int blue)
+fb_colour(const framebuffer_t *restrict fb, int red, int green, int blue)
 {
-	uint32_t rc = 0;
-	rc |= (uint32_t)red,   rc <<= 8;
-	rc |= (uint32_t)green, rc <<= 8;
-	rc |= (uint32_t)blue;
-	return rc;
+	return fb->format.pack(&fb->format, red, green, blue);
 }
 
 
@@ -132,14 +817,18 @@ fb_colour(int red, int green, int blue)
 void
 fb_fill_rectangle(framebuffer_t *restrict fb, uint32_t colour, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
 {
-	int8_t *mem = fb->mem + y * fb->line_length;
-	size_t x1 = x * fb->bytes_per_pixel;
-	size_t x2 = (x + width) * fb->bytes_per_pixel;
-	size_t y2 = y + height;
-	size_t x_, y_;
-	for (y_ = y; y_ != y2; y_++, mem += fb->line_length)
-		for (x_ = x1; x_ != x2; x_ += fb->bytes_per_pixel)
-			*(uint32_t *)&mem[x_] = colour;
+	fill_row_func_t *fill;
+	int8_t *mem;
+	size_t y_, size;
+	if (!fb_clip(fb, &x, &y, &width, &height))
+		return;
+	mem = fb->mem + y * fb->line_length + x * fb->bytes_per_pixel;
+	/* The shadow buffer is read right back by the flush, so keep it in the cache if it fits. */
+	size = (size_t)width * height * fb->bytes_per_pixel;
+	fill = size >= (fb->shadow ? FB_SHADOW_STREAM_MIN : FB_STREAM_MIN) ? fb->fill_stream : fb->fill_row;
+	for (y_ = 0; y_ != height; y_++, mem += fb->line_length)
+		fill(mem, colour, width);
+	fb_damage(fb, x, y, width, height);
 }
 
 
@@ -155,12 +844,11 @@ fb_fill_rectangle(framebuffer_t *restrict fb, uint32_t colour, uint32_t x, uint3
 void
 fb_draw_horizontal_line(framebuffer_t *restrict fb, uint32_t colour, uint32_t x, uint32_t y, uint32_t length)
 {
-	int8_t *mem = fb->mem + y * fb->line_length;
-	size_t x1 = x * fb->bytes_per_pixel;
-	size_t x2 = (x + length) * fb->bytes_per_pixel;
-	size_t x_;
-	for (x_ = x1; x_ != x2; x_ += fb->bytes_per_pixel)
-		*(uint32_t *)&mem[x_] = colour;
+	uint32_t height = 1;
+	if (!fb_clip(fb, &x, &y, &length, &height))
+		return;
+	fb->fill_row(fb->mem + y * fb->line_length + x * fb->bytes_per_pixel, colour, length);
+	fb_damage(fb, x, y, length, 1);
 }
 
 
@@ -176,10 +864,366 @@ fb_draw_horizontal_line(framebuffer_t *restrict fb, uint32_t colour, uint32_t x,
 void
 fb_draw_vertical_line(framebuffer_t *restrict fb, uint32_t colour, uint32_t x, uint32_t y, uint32_t length)
 {
-	int8_t *mem = fb->mem + y * fb->line_length + x * fb->bytes_per_pixel;
-	size_t y2 = y + length;
+	int8_t *mem;
+	uint32_t width = 1;
 	size_t y_;
+	if (!fb_clip(fb, &x, &y, &width, &length))
+		return;
+	mem = fb->mem + y * fb->line_length + x * fb->bytes_per_pixel;
+	for (y_ = 0; y_ != length; y_++, mem += fb->line_length)
+		fb->fill_row(mem, colour, 1);
+	fb_damage(fb, x, y, 1, length);
+}
+
+
+/**
+ * Draw a tile repeatedly down a framebuffer
+ * 
+ * @param  fb      The framebuffer
+ * @param  tile    The tile, as returned by `tile_get` for `fb`
+ * @param  y       The line on which to draw the first line of the tile
+ * @param  height  The number of lines to draw, the tile starts
+ *                 over after each `tile->height` lines
+ */
+void
+fb_draw_tile(framebuffer_t *restrict fb, const framebuffer_t *restrict tile, uint32_t y, uint32_t height)
+{
+	int8_t *mem;
+	size_t n = fb->width * fb->bytes_per_pixel;
+	uint32_t x = 0, width = fb->width, top = y, y_, row;
+	if (!tile->height || !fb_clip(fb, &x, &y, &width, &height))
+		return;
+	row = (y - top) % tile->height;
+	mem = fb->mem + y * fb->line_length;
+	for (y_ = 0; y_ != height; y_++, mem += fb->line_length) {
+		memcpy(mem, tile->mem + row * tile->line_length, n);
+		if (++row == tile->height)
+			row = 0;
+	}
+	fb_damage(fb, 0, y, fb->width, height);
+}
+
+
+/**
+ * Mark an area of a framebuffer as changed so that
+ * it is copied to the display on the next flush
+ * 
+ * @param  fb      The framebuffer
+ * @param  x       The starting pixel on the X axis for the area
+ * @param  y       The starting pixel on the Y axis for the area
+ * @param  width   The width of the area, in pixels
+ * @param  height  The height of the area, in pixels
+ */
+void
+fb_damage(framebuffer_t *restrict fb, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+	fb_rect_t *restrict r;
+	uint32_t x2 = x + width, y2 = y + height, rx2, ry2;
+	size_t i;
+
+	if (!fb->shadow || !width || !height)
+		return;
+
+	for (i = 0; i < fb->damage_count; i++) {
+		r = &fb->damage[i];
+		if (r->x <= x && x2 <= r->x + r->width && r->y <= y && y2 <= r->y + r->height)
+			return;
+	}
+
+	/* Merge with every area that overlaps or touches the new area. */
+again:
+	for (i = 0; i < fb->damage_count; i++) {
+		r = &fb->damage[i];
+		rx2 = r->x + r->width;
+		ry2 = r->y + r->height;
+		if (x <= rx2 && r->x <= x2 && y <= ry2 && r->y <= y2) {
+			x  = x  < r->x ? x  : r->x;
+			y  = y  < r->y ? y  : r->y;
+			x2 = x2 > rx2  ? x2 : rx2;
+			y2 = y2 > ry2  ? y2 : ry2;
+			*r = fb->damage[--fb->damage_count];
+			goto again;
+		}
+	}
+
+	if (fb->damage_count == FB_DAMAGE_MAX) {
+		while (fb->damage_count) {
+			r = &fb->damage[--fb->damage_count];
+			rx2 = r->x + r->width;
+			ry2 = r->y + r->height;
+			x  = x  < r->x ? x  : r->x;
+			y  = y  < r->y ? y  : r->y;
+			x2 = x2 > rx2  ? x2 : rx2;
+			y2 = y2 > ry2  ? y2 : ry2;
+		}
+	}
+
+	r = &fb->damage[fb->damage_count++];
+	r->x = x;
+	r->y = y;
+	r->width = x2 - x;
+	r->height = y2 - y;
+}
+
+
+/**
+ * Copy all changed areas of a framebuffer to the display
+ * 
+ * @param  fb  The framebuffer
+ */
+void
+fb_flush(framebuffer_t *restrict fb)
+{
+	fb_flush_lines(fb, 0, fb->height);
+	fb_present(fb);
+}
+
+
+/**
+ * Show what has been flushed to a framebuffer, and mark
+ * the framebuffer as unchanged
+ * 
+ * For a double-buffered framebuffer, this waits for the
+ * vertical blank and pans the display to the back buffer,
+ * which then becomes the front buffer; the changed areas are
+ * moved to `prev_damage` so that the next flush copies them,
+ * once, to the new back buffer. If the driver cannot pan,
+ * the framebuffer falls back to a single buffer.
+ * 
+ * @param  fb  The framebuffer
+ */
+void
+fb_present(framebuffer_t *restrict fb)
+{
+	uint32_t yoffset, crtc = 0;
+	int8_t *page;
+
+	if (!fb->double_buffered) {
+		fb->damage_count = 0;
+		fb->prev_damage_count = 0;
+		return;
+	}
+
+	if (fb->vsync && ioctl(fb->fd, (unsigned long int)FBIO_WAITFORVSYNC, &crtc))
+		fb->vsync = 0;
+
+	yoffset = fb->var_info.yoffset;
+	fb->var_info.yoffset = fb->back_yoffset;
+	if (ioctl(fb->fd, (unsigned long int)FBIOPAN_DISPLAY, &fb->var_info)) {
+		fb->var_info.yoffset = yoffset;
+		fb->double_buffered = 0;
+		fb->device = fb->front;
+		fb_damage(fb, 0, 0, fb->width, fb->height);
+		fb_flush_lines(fb, 0, fb->height);
+		fb->damage_count = 0;
+		fb->prev_damage_count = 0;
+		return;
+	}
+
+	fb->back_yoffset = yoffset;
+	page = fb->front;
+	fb->front = fb->device;
+	fb->device = page;
+	if (fb->var_info.yoffset > yoffset)
+		fb->visible_offset += (size_t)fb->height * (size_t)fb->line_length;
+	else
+		fb->visible_offset -= (size_t)fb->height * (size_t)fb->line_length;
+
+	memcpy(fb->prev_damage, fb->damage, fb->damage_count * sizeof(*fb->damage));
+	fb->prev_damage_count = fb->damage_count;
+	fb->damage_count = 0;
+}
+
+
+/**
+ * Copy a list of areas, within a band of lines of a framebuffer,
+ * from the shadow buffer to the display, applying the framebuffer's
+ * colour lookup table if it has one
+ * 
+ * @param  fb      The framebuffer
+ * @param  rects   The areas
+ * @param  count   The number of elements in `rects`
+ * @param  y       The first line in the band
+ * @param  height  The number of lines in the band
+ */
+static void
+fb_flush_rects(const framebuffer_t *restrict fb, const fb_rect_t *restrict rects, size_t count, uint32_t y, uint32_t height)
+{
+	const fb_rect_t *restrict r;
+	size_t i, offset, n;
+	uint32_t top, bottom, y_;
+
+	for (i = 0; i < count; i++) {
+		r = &rects[i];
+		top = r->y > y ? r->y : y;
+		bottom = r->y + r->height < y + height ? r->y + r->height : y + height;
+		if (top >= bottom)
+			continue;
+		offset = top * fb->line_length + r->x * fb->bytes_per_pixel;
+		n = r->width * fb->bytes_per_pixel;
+		if (fb->lut) {
+			if (n == fb->line_length)
+				fb->lut->row(fb->lut, fb->device + offset, fb->shadow + offset, (size_t)r->width * (bottom - top));
+			else
+				for (y_ = top; y_ < bottom; y_++, offset += fb->line_length)
+					fb->lut->row(fb->lut, fb->device + offset, fb->shadow + offset, r->width);
+		} else if (n == fb->line_length) {
+			/* Whole lines are contiguous, copy them in one go. */
+			if (n * (bottom - top) >= FB_STREAM_MIN)
+				fill_copy_stream(fb->device + offset, fb->shadow + offset, n * (bottom - top));
+			else
+				memcpy(fb->device + offset, fb->shadow + offset, n * (bottom - top));
+		} else if (n * (bottom - top) >= FB_STREAM_MIN) {
+			for (y_ = top; y_ < bottom; y_++, offset += fb->line_length)
+				fill_copy_stream(fb->device + offset, fb->shadow + offset, n);
+		} else {
+			for (y_ = top; y_ < bottom; y_++, offset += fb->line_length)
+				memcpy(fb->device + offset, fb->shadow + offset, n);
+		}
+	}
+}
+
+
+/**
+ * Copy the changed areas within a band of lines of a framebuffer
+ * to the display, without marking them as unchanged, applying
+ * the framebuffer's colour lookup table if it has one
+ * 
+ * @param  fb      The framebuffer
+ * @param  y       The first line in the band
+ * @param  height  The number of lines in the band
+ */
+void
+fb_flush_lines(const framebuffer_t *restrict fb, uint32_t y, uint32_t height)
+{
+	/* Large fills bypass the cache, make sure they have landed before they are copied or shown. */
+	fill_fence();
+
+	fb_flush_rects(fb, fb->prev_damage, fb->prev_damage_count, y, height);
+	fb_flush_rects(fb, fb->damage, fb->damage_count, y, height);
+}
+
+
+/**
+ * Write the contents of a framebuffer to a file as
+ * an 8-bit binary portable pixmap (PPM)
+ * 
+ * @param   fb    The framebuffer
+ * @param   path  The file to write
+ * @return        Zero on success, -1 on error
+ */
+int
+fb_dump_ppm(const framebuffer_t *restrict fb, const char *restrict path)
+{
+	const fb_format_t *restrict format = &fb->format;
+	unsigned char *restrict row = NULL;
+	const int8_t *restrict mem;
+	uint32_t x, y, pixel, max[3];
+	FILE *f = NULL;
+	int old_errno;
+
+	max[0] = (1UL << format->red_length)   - 1;
+	max[1] = (1UL << format->green_length) - 1;
+	max[2] = (1UL << format->blue_length)  - 1;
+
+	row = malloc((size_t)fb->width * 3);
+	if (!row && fb->width)
+		goto fail;
+	f = fopen(path, "wb");
+	if (!f)
+		goto fail;
+	if (fprintf(f, "P6\n%"PRIu32" %"PRIu32"\n255\n", fb->width, fb->height) < 0)
+		goto fail;
+
+	for (y = 0; y < fb->height; y++) {
+		mem = fb->mem + y * fb->line_length;
+		for (x = 0; x < fb->width; x++, mem += fb->bytes_per_pixel) {
+			pixel = 0;
+			memcpy(&pixel, mem, fb->bytes_per_pixel < 4 ? fb->bytes_per_pixel : 4);
+#define CHANNEL(I, OFFSET)\
+			(max[I] ? (unsigned char)((((pixel >> format->OFFSET) & max[I]) * 255 + max[I] / 2) / max[I]) : 0)
+			row[3 * x + 0] = CHANNEL(0, red_offset);
+			row[3 * x + 1] = CHANNEL(1, green_offset);
+			row[3 * x + 2] = CHANNEL(2, blue_offset);
+#undef CHANNEL
+		}
+		if (fwrite(row, 3, fb->width, f) != fb->width)
+			goto fail;
+	}
+
+	free(row);
+	return fclose(f) ? -1 : 0;
+fail:
+	old_errno = errno;
+	free(row);
+	if (f)
+		fclose(f);
+	errno = old_errno;
+	return -1;
+}
+
+
+/**
+ * Mix a word into one lane of `fb_hash`
+ * 
+ * @param   lane  The lane's state
+ * @param   word  The word
+ * @return        The lane's new state
+ */
+static inline uint64_t
+fb_hash_round(uint64_t lane, uint64_t word)
+{
+	lane += word * UINT64_C(0xC2B2AE3D27D4EB4F);
+	lane = (lane << 31) | (lane >> 33);
+	return lane * UINT64_C(0x9E3779B185EBCA87);
+}
+
+
+/**
+ * Calculate a fast, non-cryptographic, hash of the
+ * visible pixels of a framebuffer
+ * 
+ * The hash only depends on the pixels, not on the padding
+ * at the end of each line, so it can be used to compare
+ * renderings of the same size and pixel format
+ * 
+ * @param   fb  The framebuffer
+ * @return      The hash
+ */
+uint64_t
+fb_hash(const framebuffer_t *restrict fb)
+{
+	uint64_t lane[4], word[4], h;
+	size_t n = (size_t)fb->width * fb->bytes_per_pixel, i, j;
+	const int8_t *restrict mem;
+	uint32_t y;
+
+	lane[0] = UINT64_C(0x60EA27EEADC0B5D6);
+	lane[1] = UINT64_C(0xC2B2AE3D27D4EB4F);
+	lane[2] = 0;
+	lane[3] = UINT64_C(0x61C8864E7A143579);
+
+	for (y = 0; y < fb->height; y++) {
+		mem = fb->mem + y * fb->line_length;
+		for (i = 0; i + 32 <= n; i += 32) {
+			memcpy(word, mem + i, 32);
+			for (j = 0; j < 4; j++)
+				lane[j] = fb_hash_round(lane[j], word[j]);
+		}
+		/* Pad the end of the line with zeroes, and include the line length. */
+		memset(word, 0, sizeof(word));
+		memcpy(word, mem + i, n - i);
+		for (j = 0; j < 4; j++)
+			lane[j] = fb_hash_round(lane[j], word[j] ^ (uint64_t)(n - i));
+	}
 
-	for (y_ = y; y_ != y2; y_++, mem += fb->line_length)
-		*(uint32_t *)mem = colour;
+	h = ((lane[0] << 1) | (lane[0] >> 63)) + ((lane[1] << 7)  | (lane[1] >> 57)) +
+	    ((lane[2] << 12) | (lane[2] >> 52)) + ((lane[3] << 18) | (lane[3] >> 46));
+	h ^= (uint64_t)fb->width << 32 | fb->height;
+	h ^= h >> 33;
+	h *= UINT64_C(0xFF51AFD7ED558CCD);
+	h ^= h >> 33;
+	h *= UINT64_C(0xC4CEB9FE1A85EC53);
+	h ^= h >> 33;
+	return h;
 }
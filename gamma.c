@@ -1,5 +1,183 @@
 /* See LICENSE file for copyright and license details. */
 #include "common.h"
+#include "gammatab.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# include <immintrin.h>
+# define HAVE_X86_TARGETS
+#endif
+
+
+/**
+ * Environment variable that, unless set to 0 or empty,
+ * makes `gamma_generate` use libm's `pow`, as a reference
+ * for validating the vectorised approximation
+ */
+#ifndef GAMMA_REFERENCE_ENV
+# define GAMMA_REFERENCE_ENV  "CRT_CALIBRATOR_GAMMA_REFERENCE"
+#endif
+
+/**
+ * The maximum number of generated gamma ramps to keep in the cache
+ */
+#ifndef GAMMA_CACHE_MAX
+# define GAMMA_CACHE_MAX  64
+#endif
+
+/**
+ * The maximum number of iterations of `gamma_fit`
+ */
+#ifndef GAMMA_FIT_ITERATIONS
+# define GAMMA_FIT_ITERATIONS  16
+#endif
+
+/**
+ * The reduction of the mean squared residual, in squared
+ * 16-bit units, below which `gamma_fit` stops iterating
+ */
+#ifndef GAMMA_FIT_TOLERANCE
+# define GAMMA_FIT_TOLERANCE  0.01
+#endif
+
+/**
+ * The least normalised value of a stop for it to be
+ * included in the log-domain fit in `gamma_fit`
+ */
+#ifndef GAMMA_FIT_MIN
+# define GAMMA_FIT_MIN  (1. / 256)
+#endif
+
+
+
+/**
+ * A cached gamma ramp
+ */
+typedef struct gamma_cached
+{
+	/**
+	 * The number of stops in the gamma ramp, 0 if the slot is unused
+	 */
+	size_t stops;
+
+	/**
+	 * The gamma the gamma ramp was generated with
+	 */
+	double gamma;
+
+	/**
+	 * The contrast the gamma ramp was generated with
+	 */
+	double contrast;
+
+	/**
+	 * The brightness the gamma ramp was generated with
+	 */
+	double brightness;
+
+	/**
+	 * The gamma ramp
+	 */
+	uint16_t *ramp;
+
+	/**
+	 * The number of stops allocated to `ramp`
+	 */
+	size_t size;
+
+	/**
+	 * When the gamma ramp was last used, for eviction
+	 */
+	unsigned long long int last_used;
+
+} gamma_cached_t;
+
+
+/**
+ * Sums accumulated over the stops of a gamma ramp by
+ * `gamma_fit_pass`, for the least-squares fits
+ */
+typedef struct gamma_fit_sums
+{
+	/**
+	 * The number of stops that are not clipped
+	 */
+	double n;
+
+	/**
+	 * The sum of the weights of the stops in the log-domain
+	 * fit, which are their squared normalised output values
+	 */
+	double w;
+
+	/**
+	 * The weighted sum of the logarithms of the input values
+	 */
+	double lx;
+
+	/**
+	 * The weighted sum of the logarithms of the normalised output values
+	 */
+	double ly;
+
+	/**
+	 * The weighted sum of the logarithms of the input values
+	 * multiplied by the logarithms of the normalised output values
+	 */
+	double lxly;
+
+	/**
+	 * The weighted sum of the squared logarithms of the input values
+	 */
+	double lxlx;
+
+	/**
+	 * The sum of the input values raised to the reciprocal of the gamma
+	 */
+	double u;
+
+	/**
+	 * The sum of the squares of the summands of `u`
+	 */
+	double uu;
+
+	/**
+	 * The sum of the output values
+	 */
+	double y;
+
+	/**
+	 * The sum of the output values multiplied by the summands of `u`
+	 */
+	double yu;
+
+	/**
+	 * The sum of the squared differences, in 16-bit units, between
+	 * the gamma ramp and the gamma ramp given by the parameters
+	 */
+	double ee;
+
+} gamma_fit_sums_t;
+
+
+/**
+ * The cached gamma ramps
+ */
+static gamma_cached_t gamma_cache[GAMMA_CACHE_MAX];
+
+/**
+ * Counter used to set `gamma_cached_t.last_used`
+ */
+static unsigned long long int gamma_clock = 0;
+
+/**
+ * The number of gamma ramps that have been found in the cache
+ */
+unsigned long long int gamma_cache_hits = 0;
+
+/**
+ * The number of gamma ramps that have had to be generated
+ */
+unsigned long long int gamma_cache_misses = 0;
 
 
 /**
@@ -30,9 +208,303 @@ gamma_analyse(size_t stops, const uint16_t *restrict ramp, double *restrict gamm
 }
 
 
+/**
+ * Calculate a stop of a gamma ramp using `pow`
+ * 
+ * @param   i           The index of the stop
+ * @param   stops       The number of stops in the gamma ramp
+ * @param   gamma_      The reciprocal of the gamma
+ * @param   diff        The contrast minus the brightness
+ * @param   brightness  The brightness
+ * @return              The value of the stop
+ */
+static inline uint16_t
+gamma_stop(size_t i, size_t stops, double gamma_, double diff, double brightness)
+{
+	int32_t y;
+	double y_;
+	y_ = (double)i / (double)stops;
+	y_ = pow(y_, gamma_) * diff + brightness;
+	y = (int32_t)(y_ * 0xFFFF);
+	if (y < 0x0000)  y = 0x0000;
+	if (y > 0xFFFF)  y = 0xFFFF;
+	return (uint16_t)y;
+}
+
+
+/**
+ * Generate a gamma ramp using fixed-point arithmetic and the
+ * tables generated by mkgammatab, without any floating-point
+ * arithmetic except to convert the parameters, so that the
+ * result is the same on all platforms with the same tables
+ * 
+ * The result differs by at most 1 from the result using `pow`,
+ * as the error before the values are truncated is less than 0.3
+ * in 16-bit output units, and less than 0.05 for gammas of at
+ * least 0.1; tests/gamma-fixed checks this over the whole range
+ * of parameters that the function accepts
+ * 
+ * The function is inlined for each supported number of stops
+ * so that it is specialised for it
+ * 
+ * @param  stops       The number of stops in the gamma ramp, must
+ *                     be a divisor of `GAMMA_TABLE_STOPS`
+ * @param  ramp        Memory area to where to write the gamma ramp
+ * @param  gamma_      The reciprocal of the gamma, must be in [0.01, 100]
+ * @param  diff        The contrast minus the brightness, must be in [-4, 4]
+ * @param  brightness  The brightness, must be in [-4, 4]
+ */
+static inline void
+gamma_generate_fixed(size_t stops, uint16_t *restrict ramp, double gamma_, double diff, double brightness)
+{
+	const uint64_t mask = ((uint64_t)1 << GAMMA_EXP2_BITS) - 1;
+	uint64_t g = (uint64_t)(gamma_ * 16777216.);                            /* 24 fractional bits */
+	int64_t d = (int64_t)(diff * 16777216.);                                /* 24 fractional bits */
+	int64_t b = (int64_t)(brightness * 16777216.) * ((int64_t)1 << 31);    /* 55 fractional bits */
+	size_t i, step = GAMMA_TABLE_STOPS / stops;
+	uint64_t t, y;
+	int64_t v;
+	unsigned int k;
+
+	for (i = 0; i < stops; i++) {
+		if (!i) {
+			y = 0;
+		} else {
+			/* t = -log2(i / stops) / gamma, with 32 fractional bits */
+			t = ((gamma_log2_table[i * step] >> 8) * g) >> 16;
+
+			/* y = 2^-t, with 31 fractional bits, the fraction of t is looked up a few bits at a time */
+			y = (uint64_t)1 << 31;
+			for (k = 0; k < GAMMA_EXP2_TABLES; k++)
+				y = (y * gamma_exp2_table[k][(t >> (32 - GAMMA_EXP2_BITS * (k + 1))) & mask]) >> 31;
+			y = (t >> 32) < 32 ? y >> (t >> 32) : 0;
+		}
+
+		/* v = y * diff + brightness, with 55 fractional bits */
+		v = (int64_t)y * d + b;
+		if (v <= 0) {
+			ramp[i] = 0;
+		} else {
+			v = ((v >> 16) * 0xFFFF) >> 39;
+			ramp[i] = v > 0xFFFF ? 0xFFFF : (uint16_t)v;
+		}
+	}
+}
+
+
+#ifdef HAVE_X86_TARGETS
+
+/**
+ * Calculate the base-2 logarithm of positive, normal, numbers
+ * 
+ * The relative error is less than 1e-15
+ * 
+ * @param   x  The numbers
+ * @return     The base-2 logarithms of the numbers
+ */
+__attribute__((__target__("avx2,fma")))
+static inline __m256d
+gamma_log2(__m256d x)
+{
+	const __m256d sqrt2 = _mm256_set1_pd(1.4142135623730951);
+	const __m256d one = _mm256_set1_pd(1);
+	const __m256d magic = _mm256_set1_pd(4503599627370496.); /* 2^52, for converting integers */
+	__m256i bits = _mm256_castpd_si256(x);
+	__m256d e, m, s, s2, p, big;
+
+	/* x = m * 2^e, where 1 <= m < 2, then adjusted so that sqrt(1/2) <= m < sqrt(2), which makes |s| small. */
+	e = _mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(bits, 52), _mm256_castpd_si256(magic)));
+	e = _mm256_sub_pd(e, _mm256_add_pd(magic, _mm256_set1_pd(1023)));
+	m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi64x(0x000FFFFFFFFFFFFFLL)),
+	                                        _mm256_castpd_si256(one)));
+	big = _mm256_cmp_pd(m, sqrt2, _CMP_GE_OQ);
+	m = _mm256_blendv_pd(m, _mm256_mul_pd(m, _mm256_set1_pd(0.5)), big);
+	e = _mm256_add_pd(e, _mm256_and_pd(big, one));
+
+	/* ln m = 2 artanh s = 2(s + s^3/3 + s^5/5 + ...), where s = (m - 1)/(m + 1) and |s| < 0.172 */
+	s = _mm256_div_pd(_mm256_sub_pd(m, one), _mm256_add_pd(m, one));
+	s2 = _mm256_mul_pd(s, s);
+	p = _mm256_set1_pd(1. / 23);
+	p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1. / 21));
+	p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1. / 19));
+	p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1. / 17));
+	p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1. / 15));
+	p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1. / 13));
+	p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1. / 11));
+	p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1. / 9));
+	p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1. / 7));
+	p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1. / 5));
+	p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1. / 3));
+	p = _mm256_fmadd_pd(p, s2, one);
+
+	/* log2 x = e + ln m / ln 2 */
+	return _mm256_add_pd(e, _mm256_mul_pd(_mm256_mul_pd(s, p), _mm256_set1_pd(2 / 0.69314718055994530942)));
+}
+
+
+/**
+ * Calculate 2 to the power of numbers
+ * 
+ * Numbers less than -1022 are treated as -1022, numbers
+ * must not be greater than 1023; the relative error is
+ * less than 1e-15 plus the error of the input multiplied
+ * by ln 2
+ * 
+ * @param   t  The numbers
+ * @return     2 to the power of each number
+ */
+__attribute__((__target__("avx2,fma")))
+static inline __m256d
+gamma_exp2(__m256d t)
+{
+	const __m256d one = _mm256_set1_pd(1);
+	__m256d n, f, p;
+	__m256i scale;
+
+	/* 2^t = 2^n * e^f, where n is an integer and |f| <= (ln 2)/2 */
+	t = _mm256_max_pd(t, _mm256_set1_pd(-1022));
+	n = _mm256_round_pd(t, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	f = _mm256_mul_pd(_mm256_sub_pd(t, n), _mm256_set1_pd(0.69314718055994530942));
+
+	/* Taylor series, the first omitted term is less than 1e-17 */
+	p = _mm256_set1_pd(1. / 6227020800.);
+	p = _mm256_fmadd_pd(p, f, _mm256_set1_pd(1. / 479001600.));
+	p = _mm256_fmadd_pd(p, f, _mm256_set1_pd(1. / 39916800.));
+	p = _mm256_fmadd_pd(p, f, _mm256_set1_pd(1. / 3628800.));
+	p = _mm256_fmadd_pd(p, f, _mm256_set1_pd(1. / 362880.));
+	p = _mm256_fmadd_pd(p, f, _mm256_set1_pd(1. / 40320.));
+	p = _mm256_fmadd_pd(p, f, _mm256_set1_pd(1. / 5040.));
+	p = _mm256_fmadd_pd(p, f, _mm256_set1_pd(1. / 720.));
+	p = _mm256_fmadd_pd(p, f, _mm256_set1_pd(1. / 120.));
+	p = _mm256_fmadd_pd(p, f, _mm256_set1_pd(1. / 24.));
+	p = _mm256_fmadd_pd(p, f, _mm256_set1_pd(1. / 6.));
+	p = _mm256_fmadd_pd(p, f, _mm256_set1_pd(1. / 2.));
+	p = _mm256_fmadd_pd(p, f, one);
+	p = _mm256_fmadd_pd(p, f, one);
+
+	/* 2^n, constructed from its bits */
+	scale = _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(n));
+	scale = _mm256_slli_epi64(_mm256_add_epi64(scale, _mm256_set1_epi64x(1023)), 52);
+	return _mm256_mul_pd(p, _mm256_castsi256_pd(scale));
+}
+
+
+/**
+ * Generate a gamma ramp, four stops at a time, using
+ * an approximation of `pow`
+ * 
+ * The approximation of `pow` has a relative error of less than
+ * 1e-12 for gammas of at least 0.01, which is less than 1e-7 in
+ * 16-bit output units before the values are truncated. The result
+ * could thus differ by 1 from the result with `pow` if a value lands
+ * within 1e-7 of an integer, so such stops are recalculated with
+ * `pow`, making the output identical to that of `pow`
+ * 
+ * @param  stops       The number of stops in the gamma ramp
+ * @param  ramp        Memory area to where to write the gamma ramp
+ * @param  gamma_      The reciprocal of the gamma, must be positive and finite
+ * @param  diff        The contrast minus the brightness
+ * @param  brightness  The brightness
+ */
+__attribute__((__target__("avx2,fma")))
+static void
+gamma_generate_avx2(size_t stops, uint16_t *restrict ramp, double gamma_, double diff, double brightness)
+{
+	const __m256d zero = _mm256_setzero_pd();
+	__m256d i = _mm256_set_pd(3, 2, 1, 0), y, near;
+	__m128i v;
+	size_t j, k;
+	uint16_t tail[4];
+	int recalculate;
+
+	for (j = 0; j < stops; j += 4) {
+		y = _mm256_div_pd(i, _mm256_set1_pd((double)stops));
+		y = _mm256_andnot_pd(_mm256_cmp_pd(y, zero, _CMP_EQ_OQ),
+		                     gamma_exp2(_mm256_mul_pd(gamma_log2(y), _mm256_set1_pd(gamma_))));
+		y = _mm256_add_pd(_mm256_mul_pd(y, _mm256_set1_pd(diff)), _mm256_set1_pd(brightness));
+		y = _mm256_mul_pd(y, _mm256_set1_pd(0xFFFF));
+		near = _mm256_sub_pd(y, _mm256_round_pd(y, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+		near = _mm256_andnot_pd(_mm256_set1_pd(-0.), near);
+		recalculate = _mm256_movemask_pd(_mm256_cmp_pd(near, _mm256_set1_pd(1e-6), _CMP_LT_OQ));
+		y = _mm256_min_pd(_mm256_max_pd(y, zero), _mm256_set1_pd(0xFFFF));
+		v = _mm_packus_epi32(_mm256_cvttpd_epi32(y), _mm_setzero_si128());
+		if (stops - j >= 4) {
+			_mm_storel_epi64((__m128i *)&ramp[j], v);
+		} else {
+			_mm_storel_epi64((__m128i *)tail, v);
+			memcpy(&ramp[j], tail, (stops - j) * sizeof(*ramp));
+		}
+		for (k = 0; recalculate; k++, recalculate >>= 1)
+			if ((recalculate & 1) && j + k < stops)
+				ramp[j + k] = gamma_stop(j + k, stops, gamma_, diff, brightness);
+		i = _mm256_add_pd(i, _mm256_set1_pd(4));
+	}
+}
+
+#endif
+
+
+/**
+ * Calculate a gamma ramp, without using the cache
+ * 
+ * Unless the `CRT_CALIBRATOR_GAMMA_REFERENCE` environment variable
+ * is set, gamma ramps with 256, 1024, or 4096 stops, and parameters
+ * that `gamma_generate_fixed` accepts, are generated with fixed-point
+ * arithmetic, and other gamma ramps with a vectorised approximation
+ * of `pow` when the CPU supports it, see `gamma_generate_avx2`
+ * 
+ * @param  stops       The number of stops in the gamma ramp
+ * @param  ramp        Memory area to where to write the gamma ramp
+ * @param  gamma       The gamma
+ * @param  contrast    The contrast
+ * @param  brightness  The brightness
+ */
+static void
+gamma_calculate(size_t stops, uint16_t *restrict ramp, double gamma, double contrast, double brightness)
+{
+	double diff = contrast - brightness;
+	double gamma_ = (double)1 / gamma;
+	const char *env = getenv(GAMMA_REFERENCE_ENV);
+	size_t i;
+
+	/* Outside this range, defer to `pow` for its handling of the corner cases. */
+	if ((!env || !*env || !strcmp(env, "0")) && gamma_ > 0 && gamma_ <= 100 &&
+	    diff >= -16 && diff <= 16 && brightness >= -16 && brightness <= 16) {
+		/* The range that tests/gamma-fixed checks the fixed-point generator over. */
+		switch (gamma_ >= 0.01 && diff >= -4 && diff <= 4 && brightness >= -4 && brightness <= 4 ? stops : 0) {
+		case 256:
+			gamma_generate_fixed(256, ramp, gamma_, diff, brightness);
+			return;
+		case 1024:
+			gamma_generate_fixed(1024, ramp, gamma_, diff, brightness);
+			return;
+		case 4096:
+			gamma_generate_fixed(4096, ramp, gamma_, diff, brightness);
+			return;
+		default:
+			break;
+		}
+#ifdef HAVE_X86_TARGETS
+		if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+			gamma_generate_avx2(stops, ramp, gamma_, diff, brightness);
+			return;
+		}
+#endif
+	}
+
+	for (i = 0; i < stops; i++)
+		ramp[i] = gamma_stop(i, stops, gamma_, diff, brightness);
+}
+
+
 /**
  * Generate a gamma ramp
  * 
+ * The most recently generated gamma ramps are cached, keyed
+ * by the exact parameters, so that going back to a previous
+ * setting, or giving several monitors the same setting,
+ * only copies the gamma ramp
+ * 
  * @param  stops       The number of stops in the gamma ramp
  * @param  ramp        Memory area to where to write the gamma ramp
  * @param  gamma       The gamma
@@ -42,18 +514,681 @@ gamma_analyse(size_t stops, const uint16_t *restrict ramp, double *restrict gamm
 void
 gamma_generate(size_t stops, uint16_t *restrict ramp, double gamma, double contrast, double brightness)
 {
-	double diff = contrast - brightness;
-	double gamma_ = (double)1 / gamma;
+	gamma_cached_t *restrict entry = NULL;
+	uint16_t *new;
 	size_t i;
+
+	for (i = 0; i < GAMMA_CACHE_MAX; i++) {
+		if (gamma_cache[i].stops == stops && gamma_cache[i].gamma == gamma &&
+		    gamma_cache[i].contrast == contrast && gamma_cache[i].brightness == brightness) {
+			entry = &gamma_cache[i];
+			entry->last_used = ++gamma_clock;
+			memcpy(ramp, entry->ramp, stops * sizeof(*ramp));
+			gamma_cache_hits++;
+			return;
+		}
+	}
+
+	gamma_cache_misses++;
+	gamma_calculate(stops, ramp, gamma, contrast, brightness);
+
+	/* Replace an unused slot, or else the least recently used gamma ramp. */
+	for (i = 0; i < GAMMA_CACHE_MAX; i++)
+		if (!entry || !gamma_cache[i].stops || (entry->stops && gamma_cache[i].last_used < entry->last_used))
+			entry = &gamma_cache[i];
+	if (entry->size < stops) {
+		new = realloc(entry->ramp, stops * sizeof(*ramp));
+		if (!new) {
+			/* Not caching the gamma ramp is harmless. */
+			entry->stops = 0;
+			return;
+		}
+		entry->ramp = new;
+		entry->size = stops;
+	}
+	memcpy(entry->ramp, ramp, stops * sizeof(*ramp));
+	entry->stops = stops;
+	entry->gamma = gamma;
+	entry->contrast = contrast;
+	entry->brightness = brightness;
+	entry->last_used = ++gamma_clock;
+}
+
+
+/**
+ * Release all cached gamma ramps
+ */
+void
+gamma_clear(void)
+{
+	size_t i;
+	for (i = 0; i < GAMMA_CACHE_MAX; i++) {
+		free(gamma_cache[i].ramp);
+		gamma_cache[i].ramp = NULL;
+		gamma_cache[i].size = 0;
+		gamma_cache[i].stops = 0;
+	}
+	gamma_clock = 0;
+}
+
+
+/**
+ * Reset a gamma ramp pipeline to the default stages,
+ * which generate the same gamma ramps as `gamma_generate`
+ * 
+ * @param  pipeline    The pipeline
+ * @param  gamma       The gamma
+ * @param  contrast    The contrast
+ * @param  brightness  The brightness
+ */
+void
+gamma_pipeline_init(gamma_pipeline_t *restrict pipeline, double gamma, double contrast, double brightness)
+{
+	pipeline->op_count = 0;
+	gamma_pipeline_add(pipeline, GAMMA_STAGE_GAMMA, gamma, 0);
+	gamma_pipeline_add(pipeline, GAMMA_STAGE_LEVELS, contrast, brightness);
+}
+
+
+/**
+ * Add a stage to the end of a gamma ramp pipeline
+ * 
+ * The stage is merged into the last operation if it is of
+ * the same kind, so that the pipeline is always compiled
+ * 
+ * @param   pipeline  The pipeline
+ * @param   stage     The stage
+ * @param   value     The gamma for `GAMMA_STAGE_GAMMA`, the contrast for
+ *                    `GAMMA_STAGE_LEVELS`, the factor for `GAMMA_STAGE_SCALE`,
+ *                    or the offset for `GAMMA_STAGE_OFFSET`
+ * @param   value2    The brightness for `GAMMA_STAGE_LEVELS`, otherwise unused
+ * @return            Zero on success, -1 on error
+ */
+int
+gamma_pipeline_add(gamma_pipeline_t *restrict pipeline, gamma_stage_t stage, double value, double value2)
+{
+	gamma_op_t *restrict op = pipeline->op_count ? &pipeline->ops[pipeline->op_count - 1] : NULL;
+	double low = 0, high = 1;
+
+	switch (stage) {
+	case GAMMA_STAGE_GAMMA:
+		/* (x^(1/a))^(1/b) = x^(1/ab) as x is not negative */
+		if (op && op->power) {
+			op->gamma *= value;
+			return 0;
+		}
+		break;
+	case GAMMA_STAGE_LEVELS:
+		low = value2;
+		high = value;
+		goto linear;
+	case GAMMA_STAGE_SCALE:
+		low = 0;
+		high = value;
+		goto linear;
+	case GAMMA_STAGE_OFFSET:
+		low = value;
+		high = 1 + value;
+	linear:
+		/* A linear map of a linear map is a linear map, given by where 0 and 1 end up. */
+		if (op && !op->power) {
+			if (stage == GAMMA_STAGE_LEVELS) {
+				op->low = op->low * (value - value2) + value2;
+				op->high = op->high * (value - value2) + value2;
+			} else if (stage == GAMMA_STAGE_SCALE) {
+				op->low *= value;
+				op->high *= value;
+			} else {
+				op->low += value;
+				op->high += value;
+			}
+			return 0;
+		}
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (pipeline->op_count == GAMMA_PIPELINE_MAX) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	op = &pipeline->ops[pipeline->op_count++];
+	op->power = stage == GAMMA_STAGE_GAMMA;
+	op->gamma = value;
+	op->low = low;
+	op->high = high;
+	return 0;
+}
+
+
+/**
+ * Generate a gamma ramp with a gamma ramp pipeline
+ * 
+ * Every stop is passed through all operations before it is
+ * quantised, once. If the pipeline is equivalent to the
+ * default stages, the gamma ramp is generated exactly like
+ * by `gamma_generate`, with the same speed
+ * 
+ * @param  pipeline  The pipeline
+ * @param  stops     The number of stops in the gamma ramp
+ * @param  ramp      Memory area to where to write the gamma ramp
+ * @param  cached    Whether the gamma ramp may be taken from and
+ *                   added to the cache, which must not be used
+ *                   from multiple threads at the same time
+ */
+void
+gamma_pipeline_generate(const gamma_pipeline_t *restrict pipeline, size_t stops, uint16_t *restrict ramp, int cached)
+{
+	const gamma_op_t *restrict ops = pipeline->ops;
+	size_t i, j, n = pipeline->op_count;
+	double gamma = 1, contrast = 1, brightness = 0, y_;
+	double gamma_[GAMMA_PIPELINE_MAX];
 	int32_t y;
-	double y_;
 
+	/* The default stages, or a subset of them, have fast paths. */
+	if (n < 2 || (n == 2 && ops[0].power)) {
+		for (j = 0; j < n; j++) {
+			if (ops[j].power) {
+				gamma = ops[j].gamma;
+			} else {
+				contrast = ops[j].high;
+				brightness = ops[j].low;
+			}
+		}
+		if (cached)
+			gamma_generate(stops, ramp, gamma, contrast, brightness);
+		else
+			gamma_calculate(stops, ramp, gamma, contrast, brightness);
+		return;
+	}
+
+	for (j = 0; j < n; j++)
+		gamma_[j] = (double)1 / ops[j].gamma;
 	for (i = 0; i < stops; i++) {
 		y_ = (double)i / (double)stops;
-		y_ = pow(y_, gamma_) * diff + brightness;
+		for (j = 0; j < n; j++) {
+			if (ops[j].power)
+				y_ = pow(y_ > 0 ? y_ : 0, gamma_[j]);
+			else
+				y_ = y_ * (ops[j].high - ops[j].low) + ops[j].low;
+		}
 		y = (int32_t)(y_ * 0xFFFF);
 		if (y < 0x0000)  y = 0x0000;
 		if (y > 0xFFFF)  y = 0xFFFF;
 		ramp[i] = (uint16_t)y;
 	}
 }
+
+
+/**
+ * Evaluate a gamma ramp pipeline at all points of a master curve
+ * 
+ * @param  pipeline  The pipeline
+ * @param  curve     Output buffer for the master curve
+ */
+static void
+gamma_curve_calculate(const gamma_pipeline_t *restrict pipeline, float *restrict curve)
+{
+	const gamma_op_t *restrict ops = pipeline->ops;
+	size_t i, j, n = pipeline->op_count;
+	double y;
+
+	for (i = 0; i <= GAMMA_CURVE_STOPS; i++) {
+		y = (double)i / GAMMA_CURVE_STOPS;
+		for (j = 0; j < n; j++) {
+			if (ops[j].power)
+				y = pow(y > 0 ? y : 0, (double)1 / ops[j].gamma);
+			else
+				y = y * (ops[j].high - ops[j].low) + ops[j].low;
+		}
+		curve[i] = (float)y;
+	}
+}
+
+
+/**
+ * Resample a master curve to a number of stops and quantise it
+ * 
+ * @param  curve  The master curve
+ * @param  stops  The number of stops in the gamma ramp
+ * @param  ramp   Memory area to where to write the gamma ramp
+ */
+static void
+gamma_curve_resample(const float *restrict curve, size_t stops, uint16_t *restrict ramp)
+{
+	double x, y, step = (double)GAMMA_CURVE_STOPS / (double)stops;
+	size_t i, k;
+	int32_t v;
+
+	for (i = 0; i < stops; i++) {
+		x = (double)i * step;
+		k = (size_t)x;
+		y = (double)curve[k] + ((double)curve[k + 1] - (double)curve[k]) * (x - (double)k);
+		v = y <= 0 ? 0 : y >= 1 ? 0xFFFF : (int32_t)(y * 0xFFFF);
+		ramp[i] = (uint16_t)(v > 0xFFFF ? 0xFFFF : v);
+	}
+}
+
+
+#ifdef HAVE_X86_TARGETS
+
+/**
+ * Evaluate a gamma ramp pipeline at all points of a master
+ * curve, four points at a time, using an approximation of
+ * `pow` with a relative error of less than 1e-12
+ * 
+ * @param  pipeline  The pipeline
+ * @param  curve     Output buffer for the master curve
+ */
+__attribute__((__target__("avx2,fma")))
+static void
+gamma_curve_calculate_avx2(const gamma_pipeline_t *restrict pipeline, float *restrict curve)
+{
+	const gamma_op_t *restrict ops = pipeline->ops;
+	__m256d i = _mm256_set_pd(3, 2, 1, 0), y, positive;
+	size_t j, k, n = pipeline->op_count;
+	float tail[4];
+
+	for (k = 0; k <= GAMMA_CURVE_STOPS; k += 4) {
+		y = _mm256_mul_pd(i, _mm256_set1_pd(1. / GAMMA_CURVE_STOPS));
+		for (j = 0; j < n; j++) {
+			if (ops[j].power) {
+				/* Zero, negative and subnormal values become 0, and the result must fit in a double. */
+				positive = _mm256_cmp_pd(y, _mm256_set1_pd(2.2250738585072014e-308), _CMP_GE_OQ);
+				y = gamma_log2(_mm256_blendv_pd(_mm256_set1_pd(1), y, positive));
+				y = _mm256_min_pd(_mm256_mul_pd(y, _mm256_set1_pd((double)1 / ops[j].gamma)), _mm256_set1_pd(1023));
+				y = _mm256_and_pd(positive, gamma_exp2(y));
+			} else {
+				y = _mm256_fmadd_pd(y, _mm256_set1_pd(ops[j].high - ops[j].low), _mm256_set1_pd(ops[j].low));
+			}
+		}
+		if (GAMMA_CURVE_STOPS + 1 - k >= 4) {
+			_mm_storeu_ps(&curve[k], _mm256_cvtpd_ps(y));
+		} else {
+			_mm_storeu_ps(tail, _mm256_cvtpd_ps(y));
+			memcpy(&curve[k], tail, (GAMMA_CURVE_STOPS + 1 - k) * sizeof(*curve));
+		}
+		i = _mm256_add_pd(i, _mm256_set1_pd(4));
+	}
+}
+
+
+/**
+ * Resample a master curve to a number of stops and
+ * quantise it, four stops at a time
+ * 
+ * @param  curve  The master curve
+ * @param  stops  The number of stops in the gamma ramp
+ * @param  ramp   Memory area to where to write the gamma ramp
+ */
+__attribute__((__target__("avx2,fma")))
+static void
+gamma_curve_resample_avx2(const float *restrict curve, size_t stops, uint16_t *restrict ramp)
+{
+	const __m256d zero = _mm256_setzero_pd(), max = _mm256_set1_pd(0xFFFF);
+	__m256d i = _mm256_set_pd(3, 2, 1, 0), x, a, b, y;
+	__m128i k, v;
+	uint16_t tail[4];
+	size_t j;
+
+	for (j = 0; j < stops; j += 4) {
+		/* Stops past the end, which are not stored, must not read past the end of the curve. */
+		x = _mm256_min_pd(_mm256_mul_pd(i, _mm256_set1_pd((double)GAMMA_CURVE_STOPS / (double)stops)),
+		                  _mm256_set1_pd(GAMMA_CURVE_STOPS - 1e-6));
+		k = _mm256_cvttpd_epi32(x);
+		a = _mm256_cvtps_pd(_mm_i32gather_ps(curve, k, sizeof(*curve)));
+		b = _mm256_cvtps_pd(_mm_i32gather_ps(&curve[1], k, sizeof(*curve)));
+		y = _mm256_fmadd_pd(_mm256_sub_pd(b, a), _mm256_sub_pd(x, _mm256_cvtepi32_pd(k)), a);
+		y = _mm256_min_pd(_mm256_max_pd(_mm256_mul_pd(y, max), zero), max);
+		v = _mm_packus_epi32(_mm256_cvttpd_epi32(y), _mm_setzero_si128());
+		if (stops - j >= 4) {
+			_mm_storel_epi64((__m128i *)&ramp[j], v);
+		} else {
+			_mm_storel_epi64((__m128i *)tail, v);
+			memcpy(&ramp[j], tail, (stops - j) * sizeof(*ramp));
+		}
+		i = _mm256_add_pd(i, _mm256_set1_pd(4));
+	}
+}
+
+#endif
+
+
+/**
+ * Evaluate a gamma ramp pipeline into a master curve
+ * 
+ * A master curve holds the unquantised values of a gamma ramp
+ * at `GAMMA_CURVE_STOPS + 1` evenly spaced points from 0 to 1,
+ * inclusive, so that it can be resampled to any number of stops
+ * with `gamma_curve_quantise`
+ * 
+ * @param  pipeline  The pipeline
+ * @param  curve     Output buffer for the master curve
+ */
+void
+gamma_pipeline_curve(const gamma_pipeline_t *restrict pipeline, float *restrict curve)
+{
+	const char *env = getenv(GAMMA_REFERENCE_ENV);
+#ifdef HAVE_X86_TARGETS
+	if ((!env || !*env || !strcmp(env, "0")) && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		gamma_curve_calculate_avx2(pipeline, curve);
+		return;
+	}
+#else
+	(void) env;
+#endif
+	gamma_curve_calculate(pipeline, curve);
+}
+
+
+/**
+ * Resample a master curve, with linear interpolation, to the
+ * number of stops of a gamma ramp, and quantise it
+ * 
+ * If the number of stops is a divisor of `GAMMA_CURVE_STOPS`,
+ * no interpolation is needed, and the gamma ramp differs by
+ * at most 1 from the gamma ramp that `gamma_pipeline_generate`
+ * would generate; otherwise the difference is greatest at the
+ * steepest parts of the gamma ramp, a few units for gamma ramps
+ * with fewer stops than the master curve, but more for the first
+ * stops of gamma ramps with more stops and a high gamma
+ * 
+ * @param  curve  The master curve
+ * @param  stops  The number of stops in the gamma ramp
+ * @param  ramp   Memory area to where to write the gamma ramp
+ */
+void
+gamma_curve_quantise(const float *restrict curve, size_t stops, uint16_t *restrict ramp)
+{
+#ifdef HAVE_X86_TARGETS
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		gamma_curve_resample_avx2(curve, stops, ramp);
+		return;
+	}
+#endif
+	gamma_curve_resample(curve, stops, ramp);
+}
+
+
+/**
+ * Generate a gamma ramp with a gamma ramp pipeline, as it is
+ * applied, by quantising the pipeline's master curve to the
+ * number of stops of the gamma ramp
+ * 
+ * If the pipeline is equivalent to the default stages and the
+ * gamma ramp has 256, 1024, or 4096 stops, the gamma ramp is
+ * instead generated like by `gamma_generate`, with fixed-point
+ * arithmetic, so that the gamma ramps applied to these common
+ * stop counts are the same with every compiler, and the master
+ * curve is not calculated; otherwise the master curve is
+ * calculated with `gamma_pipeline_curve` and resampled
+ * with `gamma_curve_quantise`
+ * 
+ * @param  pipeline  The pipeline
+ * @param  curve     Buffer for the pipeline's master curve, with
+ *                   `GAMMA_CURVE_STOPS + 1` points; its contents
+ *                   are unspecified afterwards
+ * @param  stops     The number of stops in the gamma ramp
+ * @param  ramp      Memory area to where to write the gamma ramp
+ * @param  cached    Whether the gamma ramp may be taken from and
+ *                   added to the cache, which must not be used
+ *                   from multiple threads at the same time
+ */
+void
+gamma_pipeline_quantise(const gamma_pipeline_t *restrict pipeline, float *restrict curve, size_t stops,
+                        uint16_t *restrict ramp, int cached)
+{
+	size_t n = pipeline->op_count;
+	if ((n < 2 || (n == 2 && pipeline->ops[0].power)) && (stops == 256 || stops == 1024 || stops == 4096)) {
+		gamma_pipeline_generate(pipeline, stops, ramp, cached);
+	} else {
+		gamma_pipeline_curve(pipeline, curve);
+		gamma_curve_quantise(curve, stops, ramp);
+	}
+}
+
+
+/**
+ * Accumulate the sums for one iteration of `gamma_fit`
+ * 
+ * Stops that are clipped to 0 or 0xFFFF are left out of the
+ * fits, as are, from the log-domain fit, the first stop and
+ * stops whose normalised value is too small for its logarithm
+ * to be meaningful; they are all included in the residual
+ * 
+ * @param  stops       The number of stops in the gamma ramp
+ * @param  ramp        The gamma ramp
+ * @param  gamma_      The reciprocal of the current gamma
+ * @param  diff        The current contrast minus the current brightness
+ * @param  brightness  The current brightness
+ * @param  sums        Output parameter for the sums
+ */
+static void
+gamma_fit_pass(size_t stops, const uint16_t *restrict ramp, double gamma_, double diff,
+               double brightness, gamma_fit_sums_t *restrict sums)
+{
+	double x, lx, ly, y, v, w, u, e;
+	size_t i;
+
+	memset(sums, 0, sizeof(*sums));
+	for (i = 0; i < stops; i++) {
+		x = (double)i / (double)stops;
+		u = i ? pow(x, gamma_) : 0;
+		e = (u * diff + brightness) * 0xFFFF;
+		e = (e < 0 ? 0 : e > 0xFFFF ? 0xFFFF : e) - (double)ramp[i];
+		sums->ee += e * e;
+		if (!ramp[i] || ramp[i] == 0xFFFF)
+			continue;
+
+		/* The stop was truncated, so its value was on average half a unit greater. */
+		y = ((double)ramp[i] + 0.5) / 0xFFFF;
+		sums->n  += 1;
+		sums->u  += u;
+		sums->uu += u * u;
+		sums->y  += y;
+		sums->yu += y * u;
+
+		v = (y - brightness) / diff;
+		if (!i || !(v > GAMMA_FIT_MIN))
+			continue;
+		lx = log2(x);
+		ly = log2(v);
+		w = v * v;
+		sums->w    += w;
+		sums->lx   += w * lx;
+		sums->ly   += w * ly;
+		sums->lxly += w * lx * ly;
+		sums->lxlx += w * lx * lx;
+	}
+}
+
+
+#ifdef HAVE_X86_TARGETS
+
+
+/**
+ * Accumulate the sums for one iteration of `gamma_fit`,
+ * four stops at a time, see `gamma_fit_pass`
+ * 
+ * @param  stops       The number of stops in the gamma ramp
+ * @param  ramp        The gamma ramp
+ * @param  gamma_      The reciprocal of the current gamma
+ * @param  diff        The current contrast minus the current brightness
+ * @param  brightness  The current brightness
+ * @param  sums        Output parameter for the sums
+ */
+__attribute__((__target__("avx2,fma")))
+static void
+gamma_fit_pass_avx2(size_t stops, const uint16_t *restrict ramp, double gamma_, double diff,
+                    double brightness, gamma_fit_sums_t *restrict sums)
+{
+	const __m256d zero = _mm256_setzero_pd(), one = _mm256_set1_pd(1), max = _mm256_set1_pd(0xFFFF);
+	__m256d n = zero, sw = zero, slx = zero, sly = zero, lxly = zero, lxlx = zero;
+	__m256d su = zero, uu = zero, sy = zero, yu = zero, ee = zero;
+	__m256d i = _mm256_set_pd(3, 2, 1, 0), x, lx, ly, r, y, v, w, u, e, fit, logged;
+	double lanes[11][4];
+	uint16_t tail[4];
+	size_t j, k;
+
+	for (j = 0; j < stops; j += 4) {
+		if (stops - j >= 4) {
+			memcpy(tail, &ramp[j], sizeof(tail));
+		} else {
+			/* Padding with 0 excludes the stops from the fits and the residual. */
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, &ramp[j], (stops - j) * sizeof(*ramp));
+		}
+		r = _mm256_cvtepi32_pd(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)tail)));
+
+		x = _mm256_mul_pd(i, _mm256_set1_pd((double)1 / (double)stops));
+		logged = _mm256_cmp_pd(x, zero, _CMP_GT_OQ);
+		lx = gamma_log2(_mm256_blendv_pd(one, x, logged));
+		u = _mm256_and_pd(logged, gamma_exp2(_mm256_mul_pd(lx, _mm256_set1_pd(gamma_))));
+
+		e = _mm256_fmadd_pd(u, _mm256_set1_pd(diff), _mm256_set1_pd(brightness));
+		e = _mm256_min_pd(_mm256_max_pd(_mm256_mul_pd(e, max), zero), max);
+		e = _mm256_and_pd(_mm256_cmp_pd(i, _mm256_set1_pd((double)stops), _CMP_LT_OQ), _mm256_sub_pd(e, r));
+		ee = _mm256_fmadd_pd(e, e, ee);
+
+		fit = _mm256_and_pd(_mm256_cmp_pd(r, zero, _CMP_GT_OQ), _mm256_cmp_pd(r, max, _CMP_LT_OQ));
+		y = _mm256_and_pd(fit, _mm256_mul_pd(_mm256_add_pd(r, _mm256_set1_pd(0.5)), _mm256_set1_pd(1. / 0xFFFF)));
+		u = _mm256_and_pd(fit, u);
+		n = _mm256_add_pd(n, _mm256_and_pd(fit, one));
+		su = _mm256_add_pd(su, u);
+		uu = _mm256_fmadd_pd(u, u, uu);
+		sy = _mm256_add_pd(sy, y);
+		yu = _mm256_fmadd_pd(y, u, yu);
+
+		v = _mm256_mul_pd(_mm256_sub_pd(y, _mm256_set1_pd(brightness)), _mm256_set1_pd((double)1 / diff));
+		logged = _mm256_and_pd(_mm256_and_pd(logged, fit), _mm256_cmp_pd(v, _mm256_set1_pd(GAMMA_FIT_MIN), _CMP_GT_OQ));
+		w = _mm256_and_pd(logged, _mm256_mul_pd(v, v));
+		ly = gamma_log2(_mm256_blendv_pd(one, v, logged));
+		sw = _mm256_add_pd(sw, w);
+		slx = _mm256_fmadd_pd(w, lx, slx);
+		sly = _mm256_fmadd_pd(w, ly, sly);
+		w = _mm256_mul_pd(w, lx);
+		lxly = _mm256_fmadd_pd(w, ly, lxly);
+		lxlx = _mm256_fmadd_pd(w, lx, lxlx);
+
+		i = _mm256_add_pd(i, _mm256_set1_pd(4));
+	}
+
+	_mm256_storeu_pd(lanes[0], n);
+	_mm256_storeu_pd(lanes[1], sw);
+	_mm256_storeu_pd(lanes[2], slx);
+	_mm256_storeu_pd(lanes[3], sly);
+	_mm256_storeu_pd(lanes[4], lxly);
+	_mm256_storeu_pd(lanes[5], lxlx);
+	_mm256_storeu_pd(lanes[6], su);
+	_mm256_storeu_pd(lanes[7], uu);
+	_mm256_storeu_pd(lanes[8], sy);
+	_mm256_storeu_pd(lanes[9], yu);
+	_mm256_storeu_pd(lanes[10], ee);
+	memset(sums, 0, sizeof(*sums));
+	for (k = 0; k < 4; k++) {
+		sums->n    += lanes[0][k];
+		sums->w    += lanes[1][k];
+		sums->lx   += lanes[2][k];
+		sums->ly   += lanes[3][k];
+		sums->lxly += lanes[4][k];
+		sums->lxlx += lanes[5][k];
+		sums->u    += lanes[6][k];
+		sums->uu   += lanes[7][k];
+		sums->y    += lanes[8][k];
+		sums->yu   += lanes[9][k];
+		sums->ee   += lanes[10][k];
+	}
+}
+
+#endif
+
+
+/**
+ * Analyse a gamma ramp by fitting the gamma, contrast, and
+ * brightness to all of its stops
+ * 
+ * Starting from the result of `gamma_analyse`, iterations
+ * alternate between fitting the contrast and brightness by
+ * linear least squares, and the reciprocal of the gamma by
+ * weighted least squares in the log domain, so that a gamma
+ * ramp that is not exactly of the form generated by
+ * `gamma_generate`, for example one left by another program,
+ * gives the parameters of the closest such ramp
+ * 
+ * The parameters with the least residual found are returned,
+ * so the result is never worse than that of `gamma_analyse`
+ * 
+ * @param   stops       The number of stops in the gamma ramp
+ * @param   ramp        The gamma ramp
+ * @param   gamma       Output parameter for the gamma
+ * @param   contrast    Output parameter for the contrast
+ * @param   brightness  Output parameter for the brightness
+ * @return              The root mean square of the difference between
+ *                      `ramp` and the gamma ramp given by the parameters,
+ *                      in 16-bit units
+ */
+double
+gamma_fit(size_t stops, const uint16_t *restrict ramp, double *restrict gamma,
+          double *restrict contrast, double *restrict brightness)
+{
+	void (*pass)(size_t, const uint16_t *restrict, double, double, double, gamma_fit_sums_t *restrict);
+	double gamma_, diff, bright, best, det, new_gamma_, new_diff, new_bright;
+	gamma_fit_sums_t sums;
+	double ee[2] = {HUGE_VAL, HUGE_VAL};
+	int iteration;
+
+	pass = gamma_fit_pass;
+#ifdef HAVE_X86_TARGETS
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		pass = gamma_fit_pass_avx2;
+#endif
+
+	gamma_analyse(stops, ramp, gamma, contrast, brightness);
+	gamma_ = (double)1 / *gamma;
+	bright = *brightness;
+	diff = *contrast - bright;
+	if (!(gamma_ > 0 && gamma_ <= 100) || !(fabs(diff) > (double)1 / 0xFFFF)) {
+		/* Not a gamma ramp that can be fitted, such as a constant ramp. */
+		gamma_ = 1;
+		*gamma = 1;
+	}
+	best = HUGE_VAL;
+
+	for (iteration = 0;; iteration++) {
+		pass(stops, ramp, gamma_, diff, bright, &sums);
+		if (sums.ee < best) {
+			best = sums.ee;
+			*gamma = (double)1 / gamma_;
+			*contrast = bright + diff;
+			*brightness = bright;
+		}
+		/* Stop when a round of both fits no longer reduces the residual noticeably. */
+		if (iteration == GAMMA_FIT_ITERATIONS || sums.ee > ee[iteration % 2] - GAMMA_FIT_TOLERANCE * (double)stops)
+			break;
+		ee[iteration % 2] = sums.ee;
+
+		/* Updating all parameters from the same pass can oscillate, so alternate. */
+		if (iteration % 2) {
+			/* The intercept of the log-domain fit absorbs any error in the contrast. */
+			det = sums.w * sums.lxlx - sums.lx * sums.lx;
+			new_gamma_ = (sums.w * sums.lxly - sums.lx * sums.ly) / det;
+			if (!(new_gamma_ > 0 && new_gamma_ <= 100))
+				break;
+			gamma_ = new_gamma_;
+		} else {
+			det = sums.n * sums.uu - sums.u * sums.u;
+			if (!(fabs(det) > 1e-9))
+				break;
+			new_diff = (sums.n * sums.yu - sums.u * sums.y) / det;
+			new_bright = (sums.y * sums.uu - sums.u * sums.yu) / det;
+			if (!(fabs(new_diff) > (double)1 / 0xFFFF))
+				break;
+			diff = new_diff;
+			bright = new_bright;
+		}
+	}
+
+	return sqrt(best / (double)(stops ? stops : 1));
+}
@@ -0,0 +1,216 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# include <immintrin.h>
+# define HAVE_X86_TARGETS
+#endif
+
+
+
+/**
+ * Look up a pixel in a colour lookup table
+ * 
+ * @param   lut    The lookup table
+ * @param   pixel  The pixel value
+ * @return         The transformed pixel value
+ */
+static inline uint32_t
+lut_pixel(const lut_t *restrict lut, uint32_t pixel)
+{
+	return (pixel & lut->keep) |
+	       lut->red[(pixel >> lut->red_offset) & lut->red_mask] |
+	       lut->green[(pixel >> lut->green_offset) & lut->green_mask] |
+	       lut->blue[(pixel >> lut->blue_offset) & lut->blue_mask];
+}
+
+
+/**
+ * Transform a run of 16-bit pixels
+ * 
+ * @param  lut  The lookup table
+ * @param  dst  Output buffer for the transformed pixels
+ * @param  src  The pixels to transform
+ * @param  n    The number of pixels
+ */
+static void
+lut_row_16(const lut_t *restrict lut, int8_t *restrict dst, const int8_t *restrict src, size_t n)
+{
+	uint16_t pixel;
+	for (; n--; src += 2, dst += 2) {
+		memcpy(&pixel, src, 2);
+		pixel = (uint16_t)lut_pixel(lut, pixel);
+		memcpy(dst, &pixel, 2);
+	}
+}
+
+
+/**
+ * Transform a run of 24-bit pixels
+ * 
+ * @param  lut  The lookup table
+ * @param  dst  Output buffer for the transformed pixels
+ * @param  src  The pixels to transform
+ * @param  n    The number of pixels
+ */
+static void
+lut_row_24(const lut_t *restrict lut, int8_t *restrict dst, const int8_t *restrict src, size_t n)
+{
+	const uint8_t *restrict s = (const uint8_t *)src;
+	uint8_t *restrict d = (uint8_t *)dst;
+	uint32_t pixel;
+	for (; n--; s += 3, d += 3) {
+		pixel = (uint32_t)s[0] | ((uint32_t)s[1] << 8) | ((uint32_t)s[2] << 16);
+		pixel = lut_pixel(lut, pixel);
+		d[0] = (uint8_t)(pixel >> 0);
+		d[1] = (uint8_t)(pixel >> 8);
+		d[2] = (uint8_t)(pixel >> 16);
+	}
+}
+
+
+/**
+ * Transform a run of 32-bit pixels
+ * 
+ * @param  lut  The lookup table
+ * @param  dst  Output buffer for the transformed pixels
+ * @param  src  The pixels to transform
+ * @param  n    The number of pixels
+ */
+static void
+lut_row_32(const lut_t *restrict lut, int8_t *restrict dst, const int8_t *restrict src, size_t n)
+{
+	uint32_t pixel;
+	for (; n--; src += 4, dst += 4) {
+		memcpy(&pixel, src, 4);
+		pixel = lut_pixel(lut, pixel);
+		memcpy(dst, &pixel, 4);
+	}
+}
+
+
+#ifdef HAVE_X86_TARGETS
+
+/**
+ * Transform a run of 32-bit pixels, using AVX2 gathers
+ * 
+ * @param  lut  The lookup table
+ * @param  dst  Output buffer for the transformed pixels
+ * @param  src  The pixels to transform
+ * @param  n    The number of pixels
+ */
+__attribute__((__target__("avx2")))
+static void
+lut_row_32_avx2(const lut_t *restrict lut, int8_t *restrict dst, const int8_t *restrict src, size_t n)
+{
+	__m128i red_offset   = _mm_cvtsi32_si128((int)lut->red_offset);
+	__m128i green_offset = _mm_cvtsi32_si128((int)lut->green_offset);
+	__m128i blue_offset  = _mm_cvtsi32_si128((int)lut->blue_offset);
+	__m256i red_mask     = _mm256_set1_epi32((int)lut->red_mask);
+	__m256i green_mask   = _mm256_set1_epi32((int)lut->green_mask);
+	__m256i blue_mask    = _mm256_set1_epi32((int)lut->blue_mask);
+	__m256i keep         = _mm256_set1_epi32((int)lut->keep);
+	__m256i pixels, red, green, blue;
+
+	for (; n >= 8; n -= 8, src += 32, dst += 32) {
+		pixels = _mm256_loadu_si256((const __m256i *)src);
+		red    = _mm256_and_si256(_mm256_srl_epi32(pixels, red_offset),   red_mask);
+		green  = _mm256_and_si256(_mm256_srl_epi32(pixels, green_offset), green_mask);
+		blue   = _mm256_and_si256(_mm256_srl_epi32(pixels, blue_offset),  blue_mask);
+		red    = _mm256_i32gather_epi32((const int *)lut->red,   red,   4);
+		green  = _mm256_i32gather_epi32((const int *)lut->green, green, 4);
+		blue   = _mm256_i32gather_epi32((const int *)lut->blue,  blue,  4);
+		pixels = _mm256_and_si256(pixels, keep);
+		pixels = _mm256_or_si256(_mm256_or_si256(pixels, red), _mm256_or_si256(green, blue));
+		_mm256_storeu_si256((__m256i *)dst, pixels);
+	}
+	lut_row_32(lut, dst, src, n);
+}
+
+#endif
+
+
+/**
+ * Fill in the lookup table for one channel
+ * 
+ * @param  table   The channel's table
+ * @param  offset  The bit offset of the channel in a pixel
+ * @param  length  The number of bits in the channel
+ * @param  stops   The number of stops in `ramp`
+ * @param  ramp    The channel's gamma ramp
+ */
+static void
+lut_fill(uint32_t *restrict table, uint32_t offset, uint32_t length, size_t stops, const uint16_t *restrict ramp)
+{
+	uint32_t value, max = ((uint32_t)1 << length) - 1;
+	size_t i;
+	if (!max) {
+		table[0] = 0;
+		return;
+	}
+	for (value = 0; value <= max; value++) {
+		i = ((size_t)value * (stops - 1) + max / 2) / max;
+		table[value] = (((uint32_t)ramp[i] * max + 0x7FFF) / 0xFFFF) << offset;
+	}
+}
+
+
+/**
+ * Create a colour lookup table that applies gamma ramps to
+ * the pixels of a framebuffer
+ * 
+ * @param   format  The framebuffer's pixel format
+ * @param   stops   The number of stops in each gamma ramp, at least 1
+ * @param   red     The gamma ramp for the red channel
+ * @param   green   The gamma ramp for the green channel
+ * @param   blue    The gamma ramp for the blue channel
+ * @return          The lookup table, free with `free`, `NULL` on error;
+ *                  `errno` is set to `ENOTSUP` if the pixel format
+ *                  is not supported
+ */
+lut_t *
+lut_create(const fb_format_t *restrict format, size_t stops, const uint16_t *restrict red,
+           const uint16_t *restrict green, const uint16_t *restrict blue)
+{
+	lut_t *restrict lut;
+
+	if (format->red_length > LUT_BITS || format->green_length > LUT_BITS || format->blue_length > LUT_BITS ||
+	    format->bits_per_pixel < 16 || format->bits_per_pixel > 32 || format->bits_per_pixel % 8 || !stops) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+
+	lut = malloc(sizeof(*lut));
+	if (!lut)
+		return NULL;
+
+	lut->red_offset   = format->red_offset;
+	lut->green_offset = format->green_offset;
+	lut->blue_offset  = format->blue_offset;
+	lut->red_mask     = ((uint32_t)1 << format->red_length)   - 1;
+	lut->green_mask   = ((uint32_t)1 << format->green_length) - 1;
+	lut->blue_mask    = ((uint32_t)1 << format->blue_length)  - 1;
+	lut->keep = ~((lut->red_mask << lut->red_offset) | (lut->green_mask << lut->green_offset) |
+	              (lut->blue_mask << lut->blue_offset));
+	lut_fill(lut->red,   format->red_offset,   format->red_length,   stops, red);
+	lut_fill(lut->green, format->green_offset, format->green_length, stops, green);
+	lut_fill(lut->blue,  format->blue_offset,  format->blue_length,  stops, blue);
+
+	switch (format->bits_per_pixel) {
+	case 16:
+		lut->row = lut_row_16;
+		break;
+	case 24:
+		lut->row = lut_row_24;
+		break;
+	default:
+		lut->row = lut_row_32;
+#ifdef HAVE_X86_TARGETS
+		if (__builtin_cpu_supports("avx2"))
+			lut->row = lut_row_32_avx2;
+#endif
+		break;
+	}
+
+	return lut;
+}
@@ -0,0 +1,69 @@
+/* See LICENSE file for copyright and license details. */
+#include <math.h>
+#include <stdio.h>
+
+
+/**
+ * The largest number of stops that the tables support,
+ * all supported numbers of stops must divide this number
+ */
+#define TABLE_STOPS  4096
+
+/**
+ * The number of bits of the exponent that
+ * each exponentiation table covers
+ */
+#define EXP2_BITS  8
+
+/**
+ * The number of exponentiation tables, together they
+ * cover 24 fractional bits of the exponent, the
+ * remaining bits change the result by less than 1e-7
+ */
+#define EXP2_TABLES  (24 / EXP2_BITS)
+
+
+
+/**
+ * Print the tables used by the fixed-point gamma ramp
+ * generator in gamma.c, as a C header
+ * 
+ * The tables are generated when the program is built
+ * rather than when it runs, so that generating gamma
+ * ramps does not call `log2` and `exp2`; the tables
+ * are calculated with the build host's `log2`, `exp2`
+ * and `pow`, so a libm that rounds differently could
+ * produce slightly different tables
+ * 
+ * @return  0 on success, 1 on error
+ */
+int
+main(void)
+{
+	unsigned long int i, j;
+
+	printf("/* Generated by mkgammatab, do not edit. */\n\n");
+	printf("#define GAMMA_TABLE_STOPS  %i\n", TABLE_STOPS);
+	printf("#define GAMMA_EXP2_BITS  %i\n", EXP2_BITS);
+	printf("#define GAMMA_EXP2_TABLES  %i\n\n", EXP2_TABLES);
+
+	/* -log2(i / TABLE_STOPS), 32 fractional bits; 0 for i = 0, which is special-cased */
+	printf("static const uint64_t gamma_log2_table[%i] = {\n\tUINT64_C(0)", TABLE_STOPS);
+	for (i = 1; i < TABLE_STOPS; i++)
+		printf(",%sUINT64_C(%.0f)", i % 4 ? " " : "\n\t",
+		       floor(-log2((double)i / TABLE_STOPS) * 4294967296. + 0.5));
+	printf("\n};\n\n");
+
+	/* 2^-(j / 2^(EXP2_BITS(i + 1))), 31 fractional bits */
+	printf("static const uint32_t gamma_exp2_table[%i][%i] = {", EXP2_TABLES, 1 << EXP2_BITS);
+	for (i = 0; i < EXP2_TABLES; i++) {
+		printf("%s\n\t{", i ? "," : "");
+		for (j = 0; j < 1UL << EXP2_BITS; j++)
+			printf("%s%s%.0f", j ? "," : "", j % 8 ? " " : "\n\t\t",
+			       floor(exp2(-(double)j / pow(2, (double)(EXP2_BITS * (i + 1)))) * 2147483648. + 0.5));
+		printf("\n\t}");
+	}
+	printf("\n};\n");
+
+	return ferror(stdout) || fflush(stdout) ? 1 : 0;
+}
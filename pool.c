@@ -0,0 +1,392 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+#include <pthread.h>
+
+
+/**
+ * The minimum number of lines in a band when a
+ * framebuffer is split between threads
+ */
+#ifndef POOL_MIN_BAND
+# define POOL_MIN_BAND  64
+#endif
+
+
+
+/**
+ * A band of a framebuffer to draw
+ */
+typedef struct pool_band
+{
+	/**
+	 * The index of the framebuffer
+	 */
+	size_t index;
+
+	/**
+	 * The first line in the band
+	 */
+	uint32_t top;
+
+	/**
+	 * The line after the last line in the band
+	 */
+	uint32_t bottom;
+
+} pool_band_t;
+
+
+/**
+ * Argument for `pool_draw_band`
+ */
+typedef struct pool_draw_job
+{
+	/**
+	 * The bands to draw
+	 */
+	pool_band_t *bands;
+
+	/**
+	 * The function that draws the bands
+	 */
+	fb_draw_func_t *draw;
+
+	/**
+	 * Argument for `draw`
+	 */
+	void *data;
+
+} pool_draw_job_t;
+
+
+
+/**
+ * The number of threads, including the calling
+ * thread, to run jobs on
+ */
+static size_t pool_size = 1;
+
+/**
+ * The worker threads
+ */
+static pthread_t *pool_threads = NULL;
+
+/**
+ * The number of elements in `pool_threads`
+ */
+static size_t pool_thread_count = 0;
+
+/**
+ * The process that created `pool_threads`,
+ * threads are not inherited by child processes
+ */
+static pid_t pool_owner = 0;
+
+/**
+ * Mutex that protects all below
+ */
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Condition signalled when jobs are posted or the pool is stopped
+ */
+static pthread_cond_t pool_work_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Condition signalled when the last job is completed
+ */
+static pthread_cond_t pool_done_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Incremented each time jobs are posted
+ */
+static unsigned long long int pool_generation = 0;
+
+/**
+ * Whether the worker threads shall exit
+ */
+static int pool_stopping = 0;
+
+/**
+ * The function to run for each job
+ */
+static pool_func_t *pool_func;
+
+/**
+ * Argument for `pool_func`
+ */
+static void *pool_data;
+
+/**
+ * The number of posted jobs
+ */
+static size_t pool_jobs = 0;
+
+/**
+ * The next job to start
+ */
+static size_t pool_next_job = 0;
+
+/**
+ * The number of completed jobs
+ */
+static size_t pool_done_jobs = 0;
+
+
+
+/**
+ * Run posted jobs until there are none left,
+ * `pool_mutex` must be held by the caller
+ */
+static void
+pool_work(void)
+{
+	pool_func_t *func = pool_func;
+	void *data = pool_data;
+	size_t job;
+	while (pool_next_job < pool_jobs) {
+		job = pool_next_job++;
+		pthread_mutex_unlock(&pool_mutex);
+		func(job, data);
+		pthread_mutex_lock(&pool_mutex);
+		if (++pool_done_jobs == pool_jobs)
+			pthread_cond_signal(&pool_done_cond);
+	}
+}
+
+
+/**
+ * The main function for the worker threads
+ * 
+ * @param   data  Not used
+ * @return        `NULL`
+ */
+static void *
+pool_worker(void *data)
+{
+	unsigned long long int seen = 0;
+	(void) data;
+	pthread_mutex_lock(&pool_mutex);
+	for (;;) {
+		while (seen == pool_generation && !pool_stopping)
+			pthread_cond_wait(&pool_work_cond, &pool_mutex);
+		if (pool_stopping)
+			break;
+		seen = pool_generation;
+		pool_work();
+	}
+	pthread_mutex_unlock(&pool_mutex);
+	return NULL;
+}
+
+
+/**
+ * Start the worker threads unless this process has already done so
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int
+pool_start(void)
+{
+	pid_t pid = getpid();
+	int err;
+
+	if (pool_owner == pid)
+		return 0;
+
+	/* The threads, if any, belong to our parent process. */
+	pthread_mutex_init(&pool_mutex, NULL);
+	pthread_cond_init(&pool_work_cond, NULL);
+	pthread_cond_init(&pool_done_cond, NULL);
+	free(pool_threads);
+	pool_thread_count = 0;
+	pool_stopping = 0;
+	pool_owner = pid;
+
+	pool_threads = malloc((pool_size - 1) * sizeof(*pool_threads));
+	if (!pool_threads)
+		return -1;
+	while (pool_thread_count < pool_size - 1) {
+		err = pthread_create(&pool_threads[pool_thread_count], NULL, pool_worker, NULL);
+		if (err) {
+			/* Make do with the threads that we got. */
+			pool_size = pool_thread_count + 1;
+			break;
+		}
+		pool_thread_count++;
+	}
+	return 0;
+}
+
+
+/**
+ * Configure the worker thread pool, the threads are
+ * started the first time they are needed
+ * 
+ * @param  threads  The number of threads to run jobs on,
+ *                  including the calling thread, 1 to run
+ *                  all jobs serially
+ */
+void
+pool_init(size_t threads)
+{
+	pool_size = threads ? threads : 1;
+}
+
+
+/**
+ * Stop the worker threads
+ */
+void
+pool_destroy(void)
+{
+	size_t i;
+	if (pool_owner == getpid()) {
+		pthread_mutex_lock(&pool_mutex);
+		pool_stopping = 1;
+		pthread_cond_broadcast(&pool_work_cond);
+		pthread_mutex_unlock(&pool_mutex);
+		for (i = 0; i < pool_thread_count; i++)
+			pthread_join(pool_threads[i], NULL);
+	}
+	free(pool_threads);
+	pool_threads = NULL;
+	pool_thread_count = 0;
+	pool_owner = 0;
+	pool_size = 1;
+}
+
+
+/**
+ * Run jobs on the worker threads and the calling
+ * thread, and wait for all of them to complete
+ * 
+ * @param  jobs  The number of jobs
+ * @param  func  Function to call for each job
+ * @param  data  Argument for `func`
+ */
+void
+pool_run(size_t jobs, pool_func_t *func, void *data)
+{
+	size_t i;
+
+	if (pool_size <= 1 || jobs <= 1 || pool_start() < 0 || !pool_thread_count) {
+		for (i = 0; i < jobs; i++)
+			func(i, data);
+		return;
+	}
+
+	pthread_mutex_lock(&pool_mutex);
+	pool_func = func;
+	pool_data = data;
+	pool_jobs = jobs;
+	pool_next_job = 0;
+	pool_done_jobs = 0;
+	pool_generation++;
+	pthread_cond_broadcast(&pool_work_cond);
+	pool_work();
+	while (pool_done_jobs < pool_jobs)
+		pthread_cond_wait(&pool_done_cond, &pool_mutex);
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+
+/**
+ * Draw a band of a framebuffer and flush it, used as `pool_func_t`
+ * 
+ * @param  job   The index of the band
+ * @param  data  The job, `pool_draw_job_t *`
+ */
+static void
+pool_draw_band(size_t job, void *data)
+{
+	pool_draw_job_t *restrict draw_job = data;
+	pool_band_t *restrict band = &draw_job->bands[job];
+	framebuffer_t view = framebuffers[band->index];
+	view.clip_top = band->top;
+	view.clip_bottom = band->bottom;
+	if (draw_job->draw)
+		draw_job->draw(&view, band->index, draw_job->data);
+	fb_flush_lines(&view, band->top, band->bottom - band->top);
+}
+
+
+/**
+ * Redraw framebuffers, split into horizontal bands that
+ * are drawn in parallel, and flush them to the displays
+ * 
+ * The function is called once per band with a copy of the
+ * framebuffer that is clipped to the band. It must redraw
+ * the entire band, as the entire framebuffer is flushed.
+ * 
+ * @param  draw      Function that draws a band of a framebuffer, `NULL`
+ *                   to only flush the framebuffers again, for example
+ *                   after their colour lookup tables have changed
+ * @param  data      Argument for `draw`
+ * @param  selected  For each framebuffer, whether to draw it,
+ *                   `NULL` to draw all framebuffers
+ */
+void
+pool_draw(fb_draw_func_t *draw, void *data, const unsigned char *restrict selected)
+{
+	pool_draw_job_t job;
+	pool_band_t *restrict bands;
+	framebuffer_t *restrict fb;
+	size_t f, i, n, count = 0;
+	unsigned long long int start = clock_ns(), end;
+
+	/* A framebuffer that cannot be remapped gets a size of zero and is skipped. */
+	for (f = 0; f < framebuffer_count; f++)
+		if (!selected || selected[f])
+			fb_refresh(&framebuffers[f]);
+
+	bands = malloc(framebuffer_count * pool_size * sizeof(*bands));
+	if (!bands) {
+		for (f = 0; f < framebuffer_count; f++) {
+			if (!selected || selected[f]) {
+				if (draw)
+					draw(&framebuffers[f], f, data);
+				else
+					fb_damage(&framebuffers[f], 0, 0, framebuffers[f].width, framebuffers[f].height);
+				fb_flush(&framebuffers[f]);
+			}
+		}
+		goto out;
+	}
+
+	for (f = 0; f < framebuffer_count; f++) {
+		if (selected && !selected[f])
+			continue;
+		fb = &framebuffers[f];
+		/* Damage everything up front, drawing will then never modify the damage list. */
+		fb_damage(fb, 0, 0, fb->width, fb->height);
+		n = fb->height / POOL_MIN_BAND;
+		n = n < 1 ? 1 : n > pool_size ? pool_size : n;
+		for (i = 0; i < n; i++, count++) {
+			bands[count].index = f;
+			bands[count].top = (uint32_t)(i * fb->height / n);
+			bands[count].bottom = (uint32_t)((i + 1) * fb->height / n);
+		}
+	}
+
+	job.bands = bands;
+	job.draw = draw;
+	job.data = data;
+	pool_run(count, pool_draw_band, &job);
+
+	for (f = 0; f < framebuffer_count; f++)
+		if (!selected || selected[f])
+			fb_present(&framebuffers[f]);
+	free(bands);
+
+out:
+	end = clock_ns();
+	for (f = 0; f < framebuffer_count; f++) {
+		fb = &framebuffers[f];
+		if ((!selected || selected[f]) && !fb->first_draw_ns) {
+			fb->first_draw_ns = end - start;
+			fb->first_frame_ns = end - fb->opened_at;
+		}
+	}
+}
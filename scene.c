@@ -0,0 +1,176 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+
+/**
+ * A run of pixels on a line of a scene
+ */
+typedef struct scene_span
+{
+	/**
+	 * The first pixel in the run
+	 */
+	uint32_t x;
+
+	/**
+	 * The number of pixels in the run
+	 */
+	uint32_t width;
+
+	/**
+	 * The colour of the pixels
+	 */
+	uint32_t colour;
+
+} scene_span_t;
+
+
+
+/**
+ * Compare two coordinates, for `qsort`
+ * 
+ * @param   a  One of the coordinates
+ * @param   b  The other coordinate
+ * @return     Negative if `a` is less than `b`, positive if
+ *             `a` is greater than `b`, zero otherwise
+ */
+static int
+scene_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+/**
+ * Sort a list of coordinates and remove duplicates
+ * 
+ * @param   edges  The coordinates
+ * @param   n      The number of elements in `edges`
+ * @return         The number of unique coordinates
+ */
+static size_t
+scene_unique(uint32_t *restrict edges, size_t n)
+{
+	size_t i, j = 0;
+	qsort(edges, n, sizeof(*edges), scene_cmp);
+	for (i = 0; i < n; i++)
+		if (!j || edges[j - 1] != edges[i])
+			edges[j++] = edges[i];
+	return j;
+}
+
+
+/**
+ * Draw a list of rectangles on a framebuffer, with later
+ * rectangles on top of earlier rectangles
+ * 
+ * The rectangles are split at every horizontal and vertical edge
+ * into bands of lines with the same runs of colours, so that each
+ * pixel is written once, and only the first line of a band is filled,
+ * the other lines in the band are copies of it
+ * 
+ * @param  fb     The framebuffer
+ * @param  rects  The rectangles, bottom-most first
+ * @param  n      The number of elements in `rects`
+ */
+void
+scene_draw(framebuffer_t *restrict fb, const scene_rect_t *restrict rects, size_t n)
+{
+	scene_rect_t *restrict clipped = NULL;
+	const scene_rect_t **restrict active = NULL;
+	scene_span_t *restrict spans = NULL;
+	uint32_t *restrict ys = NULL, *restrict xs = NULL;
+	size_t i, j, k, m = 0, nys, nxs, nactive, nspans;
+	uint32_t ya, yb, xa, y, run;
+	int8_t *first, *mem;
+	const scene_rect_t *restrict r;
+
+	clipped = malloc(n * sizeof(*clipped));
+	active  = malloc(n * sizeof(*active));
+	spans   = malloc(2 * n * sizeof(*spans));
+	ys      = malloc(2 * n * sizeof(*ys));
+	xs      = malloc(2 * n * sizeof(*xs));
+	if (!clipped || !active || !spans || !ys || !xs) {
+		/* Fall back to drawing the rectangles one by one. */
+		for (i = 0; i < n; i++)
+			fb_fill_rectangle(fb, rects[i].colour, rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+		goto done;
+	}
+
+	for (i = 0; i < n; i++) {
+		clipped[m] = rects[i];
+		if (!fb_clip(fb, &clipped[m].x, &clipped[m].y, &clipped[m].width, &clipped[m].height))
+			continue;
+		ys[2 * m + 0] = clipped[m].y;
+		ys[2 * m + 1] = clipped[m].y + clipped[m].height;
+		m++;
+	}
+	nys = scene_unique(ys, 2 * m);
+
+	for (i = 0; i + 1 < nys; i++) {
+		ya = ys[i];
+		yb = ys[i + 1];
+
+		/* Every rectangle covering the first line of the band covers the whole band. */
+		nactive = nxs = 0;
+		for (j = 0; j < m; j++) {
+			if (clipped[j].y <= ya && ya < clipped[j].y + clipped[j].height) {
+				active[nactive++] = &clipped[j];
+				xs[nxs++] = clipped[j].x;
+				xs[nxs++] = clipped[j].x + clipped[j].width;
+			}
+		}
+		if (!nactive)
+			continue;
+		nxs = scene_unique(xs, nxs);
+
+		/* Resolve the top-most colour between each pair of vertical edges. */
+		nspans = 0;
+		for (j = 0; j + 1 < nxs; j++) {
+			xa = xs[j];
+			for (r = NULL, k = nactive; k-- && !r;)
+				if (active[k]->x <= xa && xa < active[k]->x + active[k]->width)
+					r = active[k];
+			if (!r)
+				continue;
+			if (nspans && spans[nspans - 1].x + spans[nspans - 1].width == xa &&
+			    spans[nspans - 1].colour == r->colour) {
+				spans[nspans - 1].width += xs[j + 1] - xa;
+			} else {
+				spans[nspans].x = xa;
+				spans[nspans].width = xs[j + 1] - xa;
+				spans[nspans].colour = r->colour;
+				nspans++;
+			}
+		}
+
+		first = fb->mem + ya * fb->line_length;
+		for (j = 0; j < nspans; j++)
+			fb->fill_row(first + spans[j].x * fb->bytes_per_pixel, spans[j].colour, spans[j].width);
+
+		/* Copy each gapless run of spans to the rest of the band. */
+		for (j = 0; j < nspans; j = k) {
+			for (k = j + 1; k < nspans; k++)
+				if (spans[k - 1].x + spans[k - 1].width != spans[k].x)
+					break;
+			run = spans[k - 1].x + spans[k - 1].width - spans[j].x;
+			mem = first;
+			for (y = ya + 1; y < yb; y++) {
+				mem += fb->line_length;
+				memcpy(mem + spans[j].x * fb->bytes_per_pixel,
+				       first + spans[j].x * fb->bytes_per_pixel,
+				       run * fb->bytes_per_pixel);
+			}
+			fb_damage(fb, spans[j].x, ya, run, yb - ya);
+		}
+	}
+
+done:
+	free(clipped);
+	free(active);
+	free(spans);
+	free(ys);
+	free(xs);
+}
@@ -1,6 +1,10 @@
 /* See LICENSE file for copyright and license details. */
 #include "common.h"
 
+#ifndef MAP_POPULATE
+# define MAP_POPULATE 0
+#endif
+
 
 /**
  * The framebuffers on the system
@@ -47,6 +51,205 @@ double *restrict gammas[3];
  */
 size_t crtc_count = 0;
 
+/**
+ * For each connected CRT controller, the channels whose settings have
+ * changed since its gamma ramps were last applied, as a bit mask
+ * where bit 0 is red, bit 1 is green, and bit 2 is blue
+ */
+unsigned char *restrict calibs_dirty = NULL;
+
+/**
+ * The worst residual of the analysed calibrations, see `gamma_fit`
+ */
+double calibs_residual = 0;
+
+/**
+ * How long it took to analyse the calibrations, in nanoseconds
+ */
+unsigned long long int calibs_analyse_ns = 0;
+
+/**
+ * The value of `drm_calls` when video control had been acquired
+ */
+unsigned long long int drm_startup_calls = 0;
+
+
+
+/**
+ * The index in `framebuffers` of the framebuffer that each connected
+ * CRT controller shows, `framebuffer_count` if not known
+ */
+size_t *restrict crtc_framebuffers = NULL;
+
+/**
+ * The visible pixels of all framebuffers as they were when video
+ * control was acquired, one framebuffer after the other
+ */
+static int8_t *restrict snapshot = NULL;
+
+/**
+ * The number of bytes in `snapshot` for each framebuffer
+ */
+static size_t *restrict snapshot_sizes = NULL;
+
+/**
+ * The number of bytes in `snapshot`
+ */
+static size_t snapshot_size = 0;
+
+/**
+ * How long it took to save `snapshot`, in nanoseconds
+ */
+static unsigned long long int snapshot_save_ns = 0;
+
+/**
+ * How long it took to restore `snapshot`, in nanoseconds
+ */
+static unsigned long long int snapshot_restore_ns = 0;
+
+/**
+ * The number of bytes that were in `snapshot` when it was restored
+ */
+static size_t snapshot_restore_size = 0;
+
+
+
+/**
+ * Get the device, in sysfs, behind a character device
+ * 
+ * @param   fd  File descriptor for the character device
+ * @return      The canonical sysfs path of the device, must be freed
+ *              by the caller, `NULL` if not a character device or
+ *              on error
+ */
+static char *
+device_path(int fd)
+{
+	char buf[sizeof("/sys/dev/char/:/device") + 2 * 3 * sizeof(unsigned int)];
+	struct stat attr;
+	if (fstat(fd, &attr) || !S_ISCHR(attr.st_mode))
+		return NULL;
+	sprintf(buf, "/sys/dev/char/%u:%u/device", major(attr.st_rdev), minor(attr.st_rdev));
+	return realpath(buf, NULL);
+}
+
+
+/**
+ * Figure out which framebuffer each connected CRT controller shows
+ * 
+ * A framebuffer is shown by a CRT controller if they belong to the
+ * same graphics card, and the area the CRT controller shows fits
+ * in the framebuffer's virtual resolution
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int
+associate_framebuffers(void)
+{
+	char **restrict fb_devices = NULL, *card_device;
+	const framebuffer_t *restrict fb;
+	const drm_crtc_t *restrict crtc;
+	size_t f, c;
+
+	crtc_framebuffers = malloc((crtc_count + 1) * sizeof(*crtc_framebuffers));
+	fb_devices = calloc(framebuffer_count + 1, sizeof(*fb_devices));
+	if (!crtc_framebuffers || !fb_devices) {
+		free(fb_devices);
+		return -1;
+	}
+
+	for (f = 0; f < framebuffer_count; f++)
+		fb_devices[f] = framebuffers[f].is_virtual ? NULL : device_path(framebuffers[f].fd);
+
+	for (c = 0; c < crtc_count; c++) {
+		crtc = &crtcs[c];
+		crtc_framebuffers[c] = framebuffer_count;
+		card_device = crtc->mode_valid ? device_path(crtc->card->fd) : NULL;
+		for (f = 0; card_device && f < framebuffer_count; f++) {
+			fb = &framebuffers[f];
+			if (fb_devices[f] && !strcmp(fb_devices[f], card_device) &&
+			    crtc->x + crtc->width  <= fb->var_info.xres_virtual &&
+			    crtc->y + crtc->height <= fb->var_info.yres_virtual) {
+				crtc_framebuffers[c] = f;
+				break;
+			}
+		}
+		free(card_device);
+	}
+
+	for (f = 0; f < framebuffer_count; f++)
+		free(fb_devices[f]);
+	free(fb_devices);
+	return 0;
+}
+
+
+/**
+ * Save the visible pixels of all framebuffers so that
+ * they can be restored by `restore_framebuffers`
+ * 
+ * If there is not enough memory, nothing is saved and
+ * the framebuffers will not be restored
+ */
+static void
+save_framebuffers(void)
+{
+	unsigned long long int start = clock_ns();
+	const framebuffer_t *restrict fb;
+	size_t f, offset = 0;
+
+	snapshot_sizes = malloc((framebuffer_count + 1) * sizeof(*snapshot_sizes));
+	if (!snapshot_sizes)
+		return;
+	for (f = 0; f < framebuffer_count; f++) {
+		fb = &framebuffers[f];
+		snapshot_sizes[f] = (size_t)fb->height * (size_t)fb->width * (size_t)fb->bytes_per_pixel;
+		snapshot_size += snapshot_sizes[f];
+	}
+
+	/* One buffer for all framebuffers, populated up front as faulting it in page by page is slow. */
+	snapshot = mmap(NULL, snapshot_size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (snapshot == MAP_FAILED) {
+		snapshot = NULL;
+		free(snapshot_sizes);
+		snapshot_sizes = NULL;
+		snapshot_size = 0;
+		return;
+	}
+	for (f = 0; f < framebuffer_count; offset += snapshot_sizes[f++])
+		fb_save(&framebuffers[f], &snapshot[offset]);
+
+	snapshot_save_ns = clock_ns() - start;
+}
+
+
+/**
+ * Restore the pixels saved by `save_framebuffers`,
+ * except on framebuffers that have been resized
+ */
+static void
+restore_framebuffers(void)
+{
+	unsigned long long int start = clock_ns();
+	const framebuffer_t *restrict fb;
+	size_t f, offset = 0;
+
+	if (!snapshot)
+		return;
+	for (f = 0; f < framebuffer_count; offset += snapshot_sizes[f++]) {
+		fb = &framebuffers[f];
+		if (snapshot_sizes[f] == (size_t)fb->height * (size_t)fb->width * (size_t)fb->bytes_per_pixel)
+			fb_restore(&framebuffers[f], &snapshot[offset]);
+	}
+	snapshot_restore_ns = clock_ns() - start;
+	snapshot_restore_size = snapshot_size;
+
+	munmap(snapshot, snapshot_size + 1);
+	free(snapshot_sizes);
+	snapshot = NULL;
+	snapshot_sizes = NULL;
+	snapshot_size = 0;
+}
 
 
 /**
@@ -58,9 +261,14 @@ int
 acquire_video(void)
 {
 	size_t f, c, i, fn = fb_count(), cn = drm_card_count();
+	const char *threads = getenv("CRT_CALIBRATOR_THREADS");
 	drm_crtc_t *restrict old_crtcs, crtc;
 	drm_card_t card;
 	framebuffer_t fb;
+	long n;
+
+	n = (threads && *threads) ? strtol(threads, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+	pool_init(n > 0 ? (size_t)n : 1);
 
 	framebuffers = malloc(fn * sizeof(framebuffer_t));
 	if (!framebuffers)
@@ -71,6 +279,7 @@ acquire_video(void)
 			return -1;
 		framebuffers[framebuffer_count++] = fb;
 	}
+	save_framebuffers();
 
 	cards = malloc(cn * sizeof(drm_card_t));
 	if (!cards)
@@ -109,8 +318,12 @@ acquire_video(void)
 		if (!gammas[c])
 			return -1;
 	}
+	calibs_dirty = calloc(crtc_count + 1, sizeof(*calibs_dirty));
+	if (!calibs_dirty)
+		return -1;
 
-	return 0;
+	drm_startup_calls = drm_calls;
+	return associate_framebuffers();
 }
 
 
@@ -121,6 +334,10 @@ void
 release_video(void)
 {
 	size_t i;
+	tile_clear();
+	gamma_clear();
+	pool_destroy();
+	restore_framebuffers();
 	while (crtc_count)
 		drm_crtc_close(&crtcs[--crtc_count]);
 	while (card_count)
@@ -135,10 +352,204 @@ release_video(void)
 		contrasts[i] = NULL;
 		gammas[i] = NULL;
 	}
+	free(calibs_dirty);
+	free(crtc_framebuffers);
 	free(crtcs);
 	free(cards);
 	free(framebuffers);
+	calibs_dirty = NULL;
+	crtc_framebuffers = NULL;
 	crtcs = NULL;
 	cards = NULL;
 	framebuffers = NULL;
 }
+
+
+/**
+ * Change a calibration setting, and mark the channel
+ * as changed if the value is different
+ * 
+ * @param  settings  `brightnesses`, `contrasts`, or `gammas`
+ * @param  crtc      The index of the CRT controller in `crtcs`
+ * @param  channel   The channel, 0 for red, 1 for green, 2 for blue
+ * @param  value     The new value of the setting
+ */
+void
+set_calib(double *restrict settings[3], size_t crtc, size_t channel, double value)
+{
+	if (settings[channel][crtc] != value) {
+		settings[channel][crtc] = value;
+		calibs_dirty[crtc] |= (unsigned char)(1 << channel);
+	}
+}
+
+
+/**
+ * Mark all channels on all CRT controllers as changed, so that
+ * all gamma ramps are generated and applied the next time
+ */
+void
+mark_calibs_dirty(void)
+{
+	memset(calibs_dirty, 7, crtc_count);
+}
+
+
+/**
+ * Select the framebuffers that show a CRT controller
+ * 
+ * Framebuffers that are not known to be shown by any CRT controller
+ * are always selected, and if it is not known which framebuffer
+ * shows the CRT controller, all framebuffers are selected
+ * 
+ * @param  crtc      The index of the CRT controller in `crtcs`
+ * @param  selected  Output parameter, for each framebuffer, whether it is selected
+ */
+void
+select_framebuffers(size_t crtc, unsigned char *restrict selected)
+{
+	size_t f, c, shown = crtc < crtc_count ? crtc_framebuffers[crtc] : framebuffer_count;
+	for (f = 0; f < framebuffer_count; f++) {
+		selected[f] = shown == framebuffer_count || shown == f;
+		for (c = 0; !selected[f] && c < crtc_count; c++)
+			if (crtc_framebuffers[c] == f)
+				break;
+		if (c == crtc_count)
+			selected[f] = 1;
+	}
+}
+
+
+/**
+ * Apply the gamma ramps of a CRT controller
+ * 
+ * If the CRT controller has no gamma ramps, the ramps are instead
+ * applied in software to the framebuffer that shows it, but only
+ * if it is known which framebuffer that is and no other CRT
+ * controller shows it, and only if the framebuffer's pixel
+ * format is supported; otherwise nothing is done
+ * 
+ * @param   crtc   The index of the CRT controller in `crtcs`
+ * @param   flush  Output parameter, for each framebuffer, set to 1
+ *                 if it must be flushed again for the change to
+ *                 show, `NULL` to flush it immediately
+ * @return         Zero on success, -1 on error
+ */
+int
+set_gamma(size_t crtc, unsigned char *restrict flush)
+{
+	drm_crtc_t *restrict c = &crtcs[crtc];
+	unsigned char *restrict selected;
+	size_t f = crtc_framebuffers[crtc], other;
+
+	if (!c->software_gamma)
+		return drm_set_gamma(c);
+
+	if (f == framebuffer_count)
+		return 0;
+	for (other = 0; other < crtc_count; other++)
+		if (other != crtc && crtc_framebuffers[other] == f)
+			return 0;
+
+	if (fb_set_lut(&framebuffers[f], c->gamma_stops, c->red, c->green, c->blue) < 0)
+		return errno == ENOTSUP ? 0 : -1;
+
+	if (flush) {
+		flush[f] = 1;
+		return 0;
+	}
+	selected = calloc(framebuffer_count + 1, 1);
+	if (!selected)
+		return -1;
+	selected[f] = 1;
+	pool_draw(NULL, NULL, selected);
+	free(selected);
+	return 0;
+}
+
+
+/**
+ * Apply the gamma ramps of multiple CRT controllers, with one
+ * atomic commit per graphics card where that is supported
+ * 
+ * Framebuffers that get new gamma ramps in software are
+ * flushed again once, after all ramps have been applied
+ * 
+ * @param   selected  For each CRT controller, whether to apply its
+ *                    gamma ramps, `NULL` to apply all of them
+ * @return            Zero on success, -1 on error
+ */
+int
+set_gammas(const unsigned char *restrict selected)
+{
+	unsigned char *restrict flush;
+	size_t c, f;
+	int ret = 0, old_errno = 0;
+
+	flush = calloc(framebuffer_count + 1, 1);
+	if (!flush)
+		return -1;
+
+	for (c = 0; c < crtc_count; c++) {
+		if (selected && !selected[c])
+			continue;
+		if ((crtcs[c].software_gamma ? set_gamma(c, flush) : drm_queue_gamma(&crtcs[c])) < 0) {
+			ret = -1;
+			old_errno = errno;
+			break;
+		}
+	}
+
+	/* Apply what was queued even on failure, so that nothing is left pending. */
+	for (c = 0; c < card_count; c++) {
+		if (drm_commit_gamma(&cards[c]) < 0 && !ret) {
+			ret = -1;
+			old_errno = errno;
+		}
+	}
+
+	for (f = 0; f < framebuffer_count && !flush[f]; f++);
+	if (f < framebuffer_count)
+		pool_draw(NULL, NULL, flush);
+	free(flush);
+
+	if (ret)
+		errno = old_errno;
+	return ret;
+}
+
+
+/**
+ * Print performance statistics to standard error, if
+ * requested with the `CRT_CALIBRATOR_STATS` environment variable
+ */
+void
+report_stats(void)
+{
+	const char *env = getenv("CRT_CALIBRATOR_STATS");
+	const framebuffer_t *restrict fb;
+	size_t f;
+
+	if (!env || !*env || !strcmp(env, "0"))
+		return;
+
+	for (f = 0; f < framebuffer_count; f++) {
+		fb = &framebuffers[f];
+		fprintf(stderr, "fb%zu: %"PRIu32"x%"PRIu32", %zu bytes mapped, "
+		        "open %llu ns, first draw %llu ns, open to first frame %llu ns\n",
+		        f, fb->width, fb->height, fb->map_size,
+		        fb->open_ns, fb->first_draw_ns, fb->first_frame_ns);
+	}
+	if (crtc_count && (gamma_cache_hits || gamma_cache_misses))
+		fprintf(stderr, "gamma ramp cache: %llu hits, %llu misses\n", gamma_cache_hits, gamma_cache_misses);
+	if (card_count)
+		fprintf(stderr, "drm: %llu libdrm calls to open %zu cards with %zu monitors, %llu in total\n",
+		        drm_startup_calls, card_count, crtc_count, drm_calls);
+	if (crtc_count && calibs_analyse_ns)
+		fprintf(stderr, "gamma ramp fit: %zu ramps in %llu ns, worst residual %.3f\n",
+		        3 * crtc_count, calibs_analyse_ns, calibs_residual);
+	if (framebuffer_count && snapshot)
+		fprintf(stderr, "snapshot: %zu bytes, saved in %llu ns\n", snapshot_size, snapshot_save_ns);
+	if (snapshot_restore_ns)
+		fprintf(stderr, "snapshot: %zu bytes, restored in %llu ns\n", snapshot_restore_size, snapshot_restore_ns);
+}
@@ -0,0 +1,176 @@
+/* See LICENSE file for copyright and license details. */
+#define DRM_CARD_DIR  "tests/dri"
+#include "../drmgamma.c"
+#include "libdrm.h"
+
+
+/**
+ * Check a condition, and report it if it does not hold
+ * 
+ * @param  COND  The condition
+ */
+#define CHECK(COND)  check(!!(COND), #COND, __LINE__)
+
+
+
+/**
+ * The number of conditions that did not hold
+ */
+static size_t failures = 0;
+
+
+
+/**
+ * Report a condition if it does not hold
+ * 
+ * @param  holds      Whether the condition holds
+ * @param  condition  The condition, as written
+ * @param  line       The line the condition is checked on
+ */
+static void
+check(int holds, const char *condition, int line)
+{
+	if (!holds) {
+		fprintf(stderr, "%s:%i: %s\n", __FILE__, line, condition);
+		failures++;
+	}
+}
+
+
+/**
+ * Create or remove the device files for the mock graphics cards
+ * 
+ * @param   create  1 to create the device files, 0 to remove them
+ * @return          Zero on success, -1 on error
+ */
+static int
+device_files(int create)
+{
+	char path[sizeof(DRM_CARD_DIR) + 3 * sizeof(int) + 8];
+	int fd, k;
+
+	if (create && mkdir(DRM_CARD_DIR, 0700) < 0 && errno != EEXIST)
+		return -1;
+	for (k = 0; k < MOCK_CARDS; k++) {
+		sprintf(path, "%s/card%i", DRM_CARD_DIR, k);
+		if (!create) {
+			unlink(path);
+			continue;
+		}
+		fd = open(path, O_RDWR | O_CREAT, 0600);
+		if (fd < 0)
+			return -1;
+		close(fd);
+	}
+	if (!create)
+		rmdir(DRM_CARD_DIR);
+	return 0;
+}
+
+
+/**
+ * Change the gamma ramps of a CRT controller
+ * 
+ * @param  crtc   The index of the CRT controller in `crtcs`
+ * @param  value  The new value of the second stop on the red gamma ramp
+ */
+static void
+change_gamma(size_t crtc, uint16_t value)
+{
+	crtcs[crtc].red[1] = value;
+}
+
+
+/**
+ * Check that the atomic backend applies the gamma ramps of all
+ * CRT controllers on a graphics card in one commit, does not
+ * upload gamma ramps that have not changed, and falls back to
+ * the legacy interface when, but only when, the driver
+ * rejects the commit
+ * 
+ * @return  0 if all checks pass, 1 otherwise
+ */
+int
+main(void)
+{
+	size_t c, k;
+
+	setenv("CRT_CALIBRATOR_FB", "64x64", 1);
+	setenv("CRT_CALIBRATOR_THREADS", "1", 1);
+	unsetenv(DRM_LEGACY_GAMMA_ENV);
+	if (device_files(1) < 0 || acquire_video() < 0) {
+		perror("tests/atomic");
+		device_files(0);
+		return 1;
+	}
+
+	CHECK(card_count == MOCK_CARDS);
+	CHECK(crtc_count == MOCK_CARDS * MOCK_CRTCS);
+	for (k = 0; k < card_count; k++)
+		CHECK(cards[k].atomic);
+	for (c = 0; c < crtc_count; c++)
+		CHECK(crtcs[c].lut && crtcs[c].edid && crtcs[c].edid_size == 128);
+
+	/* Every changed CRT controller on a graphics card is applied in one commit. */
+	mock_reset();
+	for (c = 0; c < crtc_count; c++)
+		change_gamma(c, 1);
+	CHECK(!set_gammas(NULL));
+	for (k = 0; k < MOCK_CARDS; k++) {
+		CHECK(mock_cards[k].commits == 1);
+		CHECK(mock_cards[k].blobs_created == MOCK_CRTCS);
+		CHECK(mock_cards[k].blobs_destroyed == 0);
+		CHECK(mock_cards[k].legacy_sets == 0);
+	}
+	for (c = 0; c < crtc_count; c++)
+		CHECK(crtcs[c].lut_blob && mock_cards[c / MOCK_CRTCS].gamma_lut[c % MOCK_CRTCS] == crtcs[c].lut_blob);
+
+	/* Gamma ramps that have not changed are not uploaded again. */
+	mock_reset();
+	CHECK(!set_gammas(NULL));
+	for (k = 0; k < MOCK_CARDS; k++)
+		CHECK(!mock_cards[k].commits && !mock_cards[k].blobs_created);
+
+	/* Only the graphics card with a changed CRT controller gets a commit. */
+	mock_reset();
+	change_gamma(0, 2);
+	CHECK(!set_gammas(NULL));
+	CHECK(mock_cards[0].commits == 1 && mock_cards[0].blobs_created == 1 && mock_cards[0].blobs_destroyed == 1);
+	CHECK(mock_cards[1].commits == 0 && mock_cards[1].blobs_created == 0);
+
+	/* Committed gamma ramps are read back without the legacy interface. */
+	change_gamma(0, 3);
+	CHECK(!drm_get_gamma(&crtcs[0]) && crtcs[0].red[1] == 2);
+
+	/* Errors other than rejections are reported, and the atomic interface is kept. */
+	mock_reset();
+	mock_commit_errno = EACCES;
+	for (c = 0; c < crtc_count; c++)
+		change_gamma(c, 4);
+	CHECK(set_gammas(NULL) < 0 && errno == EACCES);
+	for (k = 0; k < MOCK_CARDS; k++) {
+		CHECK(cards[k].atomic);
+		CHECK(mock_cards[k].commits == 1 && !mock_cards[k].legacy_sets);
+		CHECK(mock_cards[k].blobs_created == mock_cards[k].blobs_destroyed);
+	}
+
+	/* A rejected commit falls back to the legacy interface for good. */
+	mock_reset();
+	mock_commit_errno = EINVAL;
+	CHECK(!set_gammas(NULL));
+	for (k = 0; k < MOCK_CARDS; k++) {
+		CHECK(!cards[k].atomic);
+		CHECK(mock_cards[k].commits == 1 && mock_cards[k].legacy_sets == MOCK_CRTCS);
+	}
+	mock_reset();
+	mock_commit_errno = 0;
+	change_gamma(0, 5);
+	CHECK(!set_gammas(NULL));
+	CHECK(!mock_cards[0].commits && !mock_cards[0].blobs_created && mock_cards[0].legacy_sets == MOCK_CRTCS);
+
+	release_video();
+	device_files(0);
+
+	printf("atomic: %zu checks failed\n", failures);
+	return !!failures;
+}
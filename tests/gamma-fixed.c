@@ -0,0 +1,77 @@
+/* See LICENSE file for copyright and license details. */
+#include "../gamma.c"
+
+
+/**
+ * The gammas to test are `GAMMA_STEPS + 1` gammas from
+ * `GAMMA_MIN` to `GAMMA_MAX`, evenly spaced on a log scale,
+ * which is the whole range `gamma_generate_fixed` accepts
+ */
+#define GAMMA_MIN     0.01
+#define GAMMA_MAX   100.0
+#define GAMMA_STEPS  200
+
+/**
+ * The contrasts minus brightnesses to test, including the
+ * ends of the range `gamma_generate_fixed` accepts
+ */
+static const double test_diffs[] = {-4, -1, -0.5, 0.0, 0.25, 0.5, 0.75, 0.9, 1.0, 1.1, 1.5, 4};
+
+/**
+ * The brightnesses to test, including the ends
+ * of the range `gamma_generate_fixed` accepts
+ */
+static const double test_brightnesses[] = {-4, -0.25, -0.05, 0.0, 0.02, 0.1, 0.5, 1.0, 4};
+
+/**
+ * The stop counts that `gamma_generate_fixed` is specialised for
+ */
+static const size_t test_stop_counts[] = {256, 1024, 4096};
+
+
+
+/**
+ * Check that `gamma_generate_fixed` generates gamma ramps
+ * that differ by at most 1 in each stop from gamma ramps
+ * calculated with `pow`, over a grid of gammas, contrasts,
+ * and brightnesses covering the parameters that it accepts,
+ * for each of the stop counts that it is used for
+ * 
+ * @return  0 if all gamma ramps are within 1, 1 otherwise
+ */
+int
+main(void)
+{
+	static uint16_t ramp[GAMMA_TABLE_STOPS];
+	double gamma, diff, brightness;
+	size_t s, g, d, b, i, stops, failures = 0, ramps = 0;
+	int e, worst = 0;
+
+	for (s = 0; s < sizeof(test_stop_counts) / sizeof(*test_stop_counts); s++) {
+		stops = test_stop_counts[s];
+		for (g = 0; g <= GAMMA_STEPS; g++) {
+			gamma = GAMMA_MIN * pow(GAMMA_MAX / GAMMA_MIN, (double)g / GAMMA_STEPS);
+			for (d = 0; d < sizeof(test_diffs) / sizeof(*test_diffs); d++) {
+				for (b = 0; b < sizeof(test_brightnesses) / sizeof(*test_brightnesses); b++) {
+					diff = test_diffs[d];
+					brightness = test_brightnesses[b];
+					gamma_generate_fixed(stops, ramp, 1 / gamma, diff, brightness);
+					for (i = 0; i < stops; i++) {
+						e = abs((int)ramp[i] - (int)gamma_stop(i, stops, 1 / gamma, diff, brightness));
+						worst = e > worst ? e : worst;
+						if (e > 1) {
+							fprintf(stderr, "%zu stops, gamma %f, contrast %f, brightness %f: "
+							        "stop %zu differs by %i\n", stops, gamma, diff + brightness, brightness, i, e);
+							failures++;
+							break;
+						}
+					}
+					ramps++;
+				}
+			}
+		}
+	}
+
+	printf("gamma-fixed: %zu gamma ramps, largest difference %i, %zu failed\n", ramps, worst, failures);
+	return !!failures;
+}
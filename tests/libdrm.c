@@ -0,0 +1,509 @@
+/* See LICENSE file for copyright and license details. */
+#include "libdrm.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+
+/**
+ * The CRT controllers' `GAMMA_LUT` property
+ */
+#define MOCK_PROP_GAMMA_LUT  50
+
+/**
+ * The CRT controllers' `GAMMA_LUT_SIZE` property
+ */
+#define MOCK_PROP_GAMMA_LUT_SIZE  51
+
+/**
+ * The CRT controllers' `ACTIVE` property
+ */
+#define MOCK_PROP_ACTIVE  52
+
+/**
+ * The connectors' `DPMS` property
+ */
+#define MOCK_PROP_DPMS  60
+
+/**
+ * The connectors' `EDID` property
+ */
+#define MOCK_PROP_EDID  61
+
+/**
+ * Offset added to a connector's identifier to
+ * get the identifier of its EDID's blob
+ */
+#define MOCK_EDID_BLOB  1000
+
+/**
+ * Get the identifier of a CRT controller
+ * 
+ * @param   CARD  The index of the graphics card
+ * @param   I     The index of the CRT controller on the graphics card
+ * @return        The identifier of the CRT controller
+ */
+#define MOCK_CRTC_ID(CARD, I)  ((uint32_t)(100 * ((CARD) + 1) + 10 + (I)))
+
+/**
+ * Get the identifier of the connector that shows a CRT controller
+ * 
+ * @param   CARD  The index of the graphics card
+ * @param   I     The index of the CRT controller on the graphics card
+ * @return        The identifier of the connector
+ */
+#define MOCK_CONNECTOR_ID(CARD, I)  (MOCK_CRTC_ID(CARD, I) + 10)
+
+/**
+ * Get the identifier of the encoder that drives a CRT controller
+ * 
+ * @param   CARD  The index of the graphics card
+ * @param   I     The index of the CRT controller on the graphics card
+ * @return        The identifier of the encoder
+ */
+#define MOCK_ENCODER_ID(CARD, I)  (MOCK_CRTC_ID(CARD, I) + 20)
+
+
+
+/**
+ * An atomic request
+ */
+struct _drmModeAtomicReq
+{
+	/**
+	 * The number of properties in the request
+	 */
+	size_t count;
+
+	/**
+	 * The objects whose properties are set
+	 */
+	uint32_t objects[MOCK_CARDS * MOCK_CRTCS * 2];
+
+	/**
+	 * The properties that are set
+	 */
+	uint32_t props[MOCK_CARDS * MOCK_CRTCS * 2];
+
+	/**
+	 * The values of the properties
+	 */
+	uint64_t values[MOCK_CARDS * MOCK_CRTCS * 2];
+};
+
+
+
+mock_card_t mock_cards[MOCK_CARDS] = {
+	{.fd = -1},
+	{.fd = -1}
+};
+
+int mock_commit_errno = 0;
+
+/**
+ * The identifier to give the next property blob
+ */
+static uint32_t mock_next_blob = 1;
+
+/**
+ * The identifiers of the CRT controllers' properties
+ */
+static uint32_t mock_crtc_props[] = {MOCK_PROP_ACTIVE, MOCK_PROP_GAMMA_LUT, MOCK_PROP_GAMMA_LUT_SIZE};
+
+/**
+ * The identifiers of the connectors' properties
+ */
+static uint32_t mock_connector_props[] = {MOCK_PROP_DPMS, MOCK_PROP_EDID};
+
+
+
+/**
+ * Reset the counters in `mock_cards`
+ */
+void
+mock_reset(void)
+{
+	size_t k;
+	for (k = 0; k < MOCK_CARDS; k++) {
+		mock_cards[k].commits = 0;
+		mock_cards[k].blobs_created = 0;
+		mock_cards[k].blobs_destroyed = 0;
+		mock_cards[k].legacy_sets = 0;
+	}
+}
+
+
+/**
+ * Get the graphics card that a file descriptor is open to
+ * 
+ * @param   fd  The file descriptor
+ * @return      The index of the graphics card, `MOCK_CARDS` if none
+ */
+static size_t
+mock_card(int fd)
+{
+	size_t k;
+	for (k = 0; k < MOCK_CARDS; k++)
+		if (mock_cards[k].fd == fd)
+			break;
+	return k;
+}
+
+
+/**
+ * Get a CRT controller from its identifier
+ * 
+ * @param   fd  The file descriptor for the graphics card
+ * @param   id  The identifier of the CRT controller
+ * @return      The index of the CRT controller on the graphics card, `MOCK_CRTCS` if none
+ */
+static size_t
+mock_crtc(int fd, uint32_t id)
+{
+	size_t k = mock_card(fd), i;
+	for (i = 0; k < MOCK_CARDS && i < MOCK_CRTCS; i++)
+		if (MOCK_CRTC_ID(k, i) == id)
+			return i;
+	return MOCK_CRTCS;
+}
+
+
+int
+drmSetClientCap(int fd, uint64_t capability, uint64_t value)
+{
+	(void) value;
+	if (mock_card(fd) == MOCK_CARDS || capability != DRM_CLIENT_CAP_ATOMIC) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+
+drmModeResPtr
+drmModeGetResources(int fd)
+{
+	drmModeResPtr res;
+	size_t k = mock_card(fd), i;
+
+	/* Graphics cards are opened in order, and their resources are read first. */
+	if (k == MOCK_CARDS)
+		for (k = 0; k < MOCK_CARDS && mock_cards[k].fd >= 0; k++);
+	if (k == MOCK_CARDS) {
+		errno = ENODEV;
+		return NULL;
+	}
+	mock_cards[k].fd = fd;
+
+	res = calloc(1, sizeof(*res));
+	if (!res)
+		return NULL;
+	res->count_crtcs = res->count_connectors = res->count_encoders = MOCK_CRTCS;
+	res->crtcs = calloc(3 * MOCK_CRTCS, sizeof(uint32_t));
+	if (!res->crtcs) {
+		free(res);
+		return NULL;
+	}
+	res->connectors = &res->crtcs[MOCK_CRTCS];
+	res->encoders = &res->crtcs[2 * MOCK_CRTCS];
+	for (i = 0; i < MOCK_CRTCS; i++) {
+		res->crtcs[i] = MOCK_CRTC_ID(k, i);
+		res->connectors[i] = MOCK_CONNECTOR_ID(k, i);
+		res->encoders[i] = MOCK_ENCODER_ID(k, i);
+	}
+	return res;
+}
+
+
+void
+drmModeFreeResources(drmModeResPtr ptr)
+{
+	if (ptr) {
+		/* The card is closed after its resources are freed. */
+		mock_cards[ptr->crtcs[0] / 100 - 1].fd = -1;
+		free(ptr->crtcs);
+		free(ptr);
+	}
+}
+
+
+drmModeConnectorPtr
+drmModeGetConnector(int fd, uint32_t connector_id)
+{
+	drmModeConnectorPtr connector;
+	size_t k = mock_card(fd);
+	if (k == MOCK_CARDS || mock_crtc(fd, connector_id - 10) == MOCK_CRTCS) {
+		errno = ENOENT;
+		return NULL;
+	}
+	connector = calloc(1, sizeof(*connector) + sizeof(uint64_t[2]));
+	if (!connector)
+		return NULL;
+	connector->connector_id = connector_id;
+	connector->encoder_id = connector_id + 10;
+	connector->connection = DRM_MODE_CONNECTED;
+	connector->count_props = 2;
+	connector->props = mock_connector_props;
+	connector->prop_values = (uint64_t *)&connector[1];
+	connector->prop_values[1] = MOCK_EDID_BLOB + connector_id;
+	return connector;
+}
+
+
+void
+drmModeFreeConnector(drmModeConnectorPtr ptr)
+{
+	free(ptr);
+}
+
+
+drmModeEncoderPtr
+drmModeGetEncoder(int fd, uint32_t encoder_id)
+{
+	drmModeEncoderPtr encoder;
+	if (mock_crtc(fd, encoder_id - 20) == MOCK_CRTCS) {
+		errno = ENOENT;
+		return NULL;
+	}
+	encoder = calloc(1, sizeof(*encoder));
+	if (!encoder)
+		return NULL;
+	encoder->encoder_id = encoder_id;
+	encoder->crtc_id = encoder_id - 20;
+	return encoder;
+}
+
+
+void
+drmModeFreeEncoder(drmModeEncoderPtr ptr)
+{
+	free(ptr);
+}
+
+
+drmModeCrtcPtr
+drmModeGetCrtc(int fd, uint32_t crtc_id)
+{
+	drmModeCrtcPtr crtc;
+	if (mock_crtc(fd, crtc_id) == MOCK_CRTCS) {
+		errno = ENOENT;
+		return NULL;
+	}
+	crtc = calloc(1, sizeof(*crtc));
+	if (!crtc)
+		return NULL;
+	crtc->crtc_id = crtc_id;
+	crtc->gamma_size = MOCK_GAMMA_STOPS;
+	return crtc;
+}
+
+
+void
+drmModeFreeCrtc(drmModeCrtcPtr ptr)
+{
+	free(ptr);
+}
+
+
+drmModeObjectPropertiesPtr
+drmModeObjectGetProperties(int fd, uint32_t object_id, uint32_t object_type)
+{
+	drmModeObjectPropertiesPtr props;
+	if (object_type != DRM_MODE_OBJECT_CRTC || mock_crtc(fd, object_id) == MOCK_CRTCS) {
+		errno = EINVAL;
+		return NULL;
+	}
+	props = calloc(1, sizeof(*props) + sizeof(uint64_t[3]));
+	if (!props)
+		return NULL;
+	props->count_props = 3;
+	props->props = mock_crtc_props;
+	props->prop_values = (uint64_t *)&props[1];
+	props->prop_values[0] = 1;
+	props->prop_values[2] = MOCK_GAMMA_STOPS;
+	return props;
+}
+
+
+void
+drmModeFreeObjectProperties(drmModeObjectPropertiesPtr ptr)
+{
+	free(ptr);
+}
+
+
+drmModePropertyPtr
+drmModeGetProperty(int fd, uint32_t property_id)
+{
+	drmModePropertyPtr prop;
+	const char *name;
+	(void) fd;
+	switch (property_id) {
+	case MOCK_PROP_GAMMA_LUT:       name = "GAMMA_LUT";       break;
+	case MOCK_PROP_GAMMA_LUT_SIZE:  name = "GAMMA_LUT_SIZE";  break;
+	case MOCK_PROP_ACTIVE:          name = "ACTIVE";          break;
+	case MOCK_PROP_DPMS:            name = "DPMS";            break;
+	case MOCK_PROP_EDID:            name = "EDID";            break;
+	default:
+		errno = ENOENT;
+		return NULL;
+	}
+	prop = calloc(1, sizeof(*prop));
+	if (!prop)
+		return NULL;
+	prop->prop_id = property_id;
+	strcpy(prop->name, name);
+	return prop;
+}
+
+
+void
+drmModeFreeProperty(drmModePropertyPtr ptr)
+{
+	free(ptr);
+}
+
+
+drmModePropertyBlobPtr
+drmModeGetPropertyBlob(int fd, uint32_t blob_id)
+{
+	static const unsigned char header[] = {0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00};
+	drmModePropertyBlobPtr blob;
+	unsigned char *data;
+	(void) fd;
+	if (blob_id < MOCK_EDID_BLOB) {
+		errno = ENOENT;
+		return NULL;
+	}
+	blob = calloc(1, sizeof(*blob) + 128);
+	if (!blob)
+		return NULL;
+	data = (unsigned char *)&blob[1];
+	memcpy(data, header, sizeof(header));
+	data[sizeof(header)] = (unsigned char)(blob_id - MOCK_EDID_BLOB);
+	blob->id = blob_id;
+	blob->length = 128;
+	blob->data = data;
+	return blob;
+}
+
+
+void
+drmModeFreePropertyBlob(drmModePropertyBlobPtr ptr)
+{
+	free(ptr);
+}
+
+
+int
+drmModeCrtcGetGamma(int fd, uint32_t crtc_id, uint32_t size, uint16_t *red, uint16_t *green, uint16_t *blue)
+{
+	uint32_t i;
+	if (mock_crtc(fd, crtc_id) == MOCK_CRTCS || size != MOCK_GAMMA_STOPS) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+	for (i = 0; i < size; i++)
+		red[i] = green[i] = blue[i] = (uint16_t)(i * 0x101);
+	return 0;
+}
+
+
+int
+drmModeCrtcSetGamma(int fd, uint32_t crtc_id, uint32_t size, uint16_t *red, uint16_t *green, uint16_t *blue)
+{
+	(void) red, (void) green, (void) blue;
+	if (mock_crtc(fd, crtc_id) == MOCK_CRTCS || size != MOCK_GAMMA_STOPS) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+	mock_cards[mock_card(fd)].legacy_sets++;
+	return 0;
+}
+
+
+drmModeAtomicReqPtr
+drmModeAtomicAlloc(void)
+{
+	return calloc(1, sizeof(drmModeAtomicReq));
+}
+
+
+void
+drmModeAtomicFree(drmModeAtomicReqPtr req)
+{
+	free(req);
+}
+
+
+int
+drmModeAtomicAddProperty(drmModeAtomicReqPtr req, uint32_t object_id, uint32_t property_id, uint64_t value)
+{
+	if (req->count == sizeof(req->props) / sizeof(*req->props))
+		return -ENOMEM;
+	req->objects[req->count] = object_id;
+	req->props[req->count] = property_id;
+	req->values[req->count] = value;
+	return (int)++req->count;
+}
+
+
+int
+drmModeAtomicCommit(int fd, drmModeAtomicReqPtr req, uint32_t flags, void *user_data)
+{
+	size_t k = mock_card(fd), i, c;
+	(void) user_data;
+	if (k == MOCK_CARDS) {
+		errno = EBADF;
+		return -EBADF;
+	}
+	mock_cards[k].commits++;
+	if (mock_commit_errno) {
+		errno = mock_commit_errno;
+		return -mock_commit_errno;
+	}
+	for (i = 0; i < req->count; i++) {
+		if (flags || req->props[i] != MOCK_PROP_GAMMA_LUT || mock_crtc(fd, req->objects[i]) == MOCK_CRTCS) {
+			errno = EINVAL;
+			return -EINVAL;
+		}
+	}
+	for (i = 0; i < req->count; i++) {
+		c = mock_crtc(fd, req->objects[i]);
+		mock_cards[k].gamma_lut[c] = (unsigned int)req->values[i];
+	}
+	return 0;
+}
+
+
+int
+drmModeCreatePropertyBlob(int fd, const void *data, size_t size, uint32_t *id)
+{
+	size_t k = mock_card(fd);
+	(void) data;
+	if (k == MOCK_CARDS || size != MOCK_GAMMA_STOPS * sizeof(struct drm_color_lut)) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+	mock_cards[k].blobs_created++;
+	*id = mock_next_blob++;
+	return 0;
+}
+
+
+int
+drmModeDestroyPropertyBlob(int fd, uint32_t id)
+{
+	size_t k = mock_card(fd);
+	if (k == MOCK_CARDS || !id) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+	mock_cards[k].blobs_destroyed++;
+	return 0;
+}
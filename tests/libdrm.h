@@ -0,0 +1,77 @@
+/* See LICENSE file for copyright and license details. */
+#include <stddef.h>
+
+
+/**
+ * The number of graphics cards that the mock libdrm has
+ */
+#define MOCK_CARDS  2
+
+/**
+ * The number of CRT controllers, each with a connected
+ * connector, on each graphics card
+ */
+#define MOCK_CRTCS  2
+
+/**
+ * The number of stops on the CRT controllers' gamma ramps
+ */
+#define MOCK_GAMMA_STOPS  256
+
+
+
+/**
+ * What the mock libdrm has been asked to do with a graphics card
+ */
+typedef struct mock_card
+{
+	/**
+	 * The file descriptor that the graphics card was opened
+	 * with, -1 if it has not been opened
+	 */
+	int fd;
+
+	/**
+	 * The number of atomic commits, including failed ones
+	 */
+	size_t commits;
+
+	/**
+	 * The number of property blobs that have been created
+	 */
+	size_t blobs_created;
+
+	/**
+	 * The number of property blobs that have been destroyed
+	 */
+	size_t blobs_destroyed;
+
+	/**
+	 * The number of gamma ramps applied with the legacy interface
+	 */
+	size_t legacy_sets;
+
+	/**
+	 * The property blob with each CRT controller's committed
+	 * `GAMMA_LUT`, 0 if none
+	 */
+	unsigned int gamma_lut[MOCK_CRTCS];
+
+} mock_card_t;
+
+
+
+/**
+ * The graphics cards, in the order they are opened
+ */
+extern mock_card_t mock_cards[MOCK_CARDS];
+
+/**
+ * If non-zero, atomic commits fail with this error
+ */
+extern int mock_commit_errno;
+
+/**
+ * Reset the counters in `mock_cards`
+ */
+void mock_reset(void);
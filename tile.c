@@ -0,0 +1,221 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+/**
+ * The maximum number of tiles to keep in the cache
+ */
+#ifndef TILE_CACHE_MAX
+# define TILE_CACHE_MAX  64
+#endif
+
+/**
+ * The maximum number of bytes of tile memory to keep in the cache
+ */
+#ifndef TILE_CACHE_SIZE
+# define TILE_CACHE_SIZE  (64UL << 20)
+#endif
+
+
+
+/**
+ * A cached rendering of the lines of a pattern
+ * that is repeated down the screen
+ */
+typedef struct tile
+{
+	/**
+	 * The pattern the tile belongs to, 0 if the slot is unused
+	 */
+	int pattern;
+
+	/**
+	 * Pattern-specific parameter that the tile was rendered with
+	 */
+	uint32_t parameter;
+
+	/**
+	 * The number of lines in the tile
+	 */
+	uint32_t rows;
+
+	/**
+	 * The width of the tile, in pixels
+	 */
+	uint32_t width;
+
+	/**
+	 * The pixel format the tile was rendered in
+	 */
+	fb_format_t format;
+
+	/**
+	 * The tile's pixels, `width` pixels per line without padding
+	 */
+	int8_t *mem;
+
+	/**
+	 * The number of bytes allocated to `mem`
+	 */
+	size_t size;
+
+	/**
+	 * When the tile was last used, for eviction
+	 */
+	unsigned long long int last_used;
+
+	/**
+	 * Whether the tile may be in use, pinned
+	 * tiles are not evicted
+	 */
+	int pinned;
+
+} tile_t;
+
+
+/**
+ * The cached tiles
+ */
+static tile_t tiles[TILE_CACHE_MAX];
+
+/**
+ * The total number of bytes allocated for the tiles in `tiles`
+ */
+static size_t tiles_size = 0;
+
+/**
+ * Counter used to set `tile_t.last_used`
+ */
+static unsigned long long int tile_clock = 0;
+
+
+
+/**
+ * Release a tile slot
+ * 
+ * @param  tile  The tile
+ */
+static void
+tile_evict(tile_t *restrict tile)
+{
+	free(tile->mem);
+	tiles_size -= tile->size;
+	tile->mem = NULL;
+	tile->size = 0;
+	tile->pattern = 0;
+}
+
+
+/**
+ * Look up a tile in the cache, or allocate a new tile
+ * 
+ * The tile is described by `view`, which is a framebuffer
+ * whose memory is the tile's pixels and whose height is the
+ * number of lines in the tile. `view` can be drawn on using
+ * the regular framebuffer functions, and passed to `fb_draw_tile`.
+ * The tile remains valid until `tile_unpin` is called.
+ * 
+ * @param   fb         The framebuffer the tile will be drawn on
+ * @param   pattern    Non-zero identifier for the pattern
+ * @param   parameter  Pattern-specific parameter the tile depends on
+ * @param   rows       The number of lines in the tile
+ * @param   view       Output parameter for the tile
+ * @return             1 if the tile was cached, 0 if it was allocated
+ *                     and must be rendered by the caller, -1 on error
+ */
+int
+tile_get(const framebuffer_t *restrict fb, int pattern, uint32_t parameter,
+         uint32_t rows, framebuffer_t *restrict view)
+{
+	tile_t *restrict tile = NULL;
+	size_t i, size = (size_t)rows * (size_t)fb->width * (size_t)fb->bytes_per_pixel;
+	int cached = 0;
+
+	for (i = 0; i < TILE_CACHE_MAX; i++) {
+		if (tiles[i].pattern == pattern && tiles[i].parameter == parameter &&
+		    tiles[i].rows == rows && tiles[i].width == fb->width &&
+		    fb_same_format(&tiles[i].format, &fb->format)) {
+			tile = &tiles[i];
+			cached = 1;
+			goto found;
+		}
+	}
+
+	if (size > TILE_CACHE_SIZE) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* Evict the least recently used tiles until the new tile fits. */
+	for (;;) {
+		tile = NULL;
+		if (tiles_size + size <= TILE_CACHE_SIZE)
+			for (i = 0; i < TILE_CACHE_MAX && !tile; i++)
+				if (!tiles[i].pattern)
+					tile = &tiles[i];
+		if (tile)
+			break;
+		for (i = 0; i < TILE_CACHE_MAX; i++)
+			if (tiles[i].pattern && !tiles[i].pinned && (!tile || tiles[i].last_used < tile->last_used))
+				tile = &tiles[i];
+		if (!tile) {
+			errno = ENOMEM;
+			return -1;
+		}
+		tile_evict(tile);
+	}
+
+	tile->mem = malloc(size);
+	if (!tile->mem)
+		return -1;
+	tile->size = size;
+	tiles_size += size;
+	tile->pattern = pattern;
+	tile->parameter = parameter;
+	tile->rows = rows;
+	tile->width = fb->width;
+	tile->format = fb->format;
+
+found:
+	tile->last_used = ++tile_clock;
+	tile->pinned = 1;
+
+	*view = *fb;
+	view->height = rows;
+	view->clip_top = 0;
+	view->clip_bottom = rows;
+	view->line_length = fb->width * fb->bytes_per_pixel;
+	view->mem = view->device = tile->mem;
+	view->shadow = NULL;
+	view->damage_count = 0;
+	view->prev_damage_count = 0;
+	/* The tile is read back right away, so keep it in the cache. */
+	view->fill_stream = view->fill_row;
+	return cached;
+}
+
+
+/**
+ * Allow all tiles returned by `tile_get` to be evicted
+ */
+void
+tile_unpin(void)
+{
+	size_t i;
+	for (i = 0; i < TILE_CACHE_MAX; i++)
+		tiles[i].pinned = 0;
+}
+
+
+/**
+ * Release all cached tiles
+ */
+void
+tile_clear(void)
+{
+	size_t i;
+	for (i = 0; i < TILE_CACHE_MAX; i++)
+		if (tiles[i].pattern)
+			tile_evict(&tiles[i]);
+	tile_clock = 0;
+}